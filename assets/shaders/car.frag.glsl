@@ -1,12 +1,51 @@
 #version 430
 
+// Variant defines (see ShaderVariants in graphics.h):
+// RENDER_NORMALS   - output the normal as the color
+// GAMMA_CORRECTION - convert the output from linear to gamma space
+// SPOTLIGHTS       - light with the spotlights in the light buffer
+// LIGHT_CLUSTERS   - only loop over the spotlights in the fragment's cluster
+// SOFT_SHADOWS     - filter shadows with multiple taps
+// TEMPORAL_AA      - jitter the projection and output the velocity for the TAA resolve
+
 in vec3 vertPos;
 in vec3 vertNormal;
 in vec3 vertTangent;
 in vec2 vertUV;
 in vec4 vertColor;
 
-out vec4 fragColor;
+layout(location=0) out vec4 fragColor;
+#ifdef TEMPORAL_AA
+in vec4 vertClipPos;
+in vec4 vertPreviousClipPos;
+
+layout(location=1) out vec2 fragVelocity; // how far the surface moved on screen since the last frame, in uv units
+#endif
+
+struct Light {
+	vec4 posRange;       // xyz = position, w = range
+	vec4 dirCosOuter;    // xyz = direction, w = cos(outer cutoff)
+	vec4 colorCosInner;  // rgb = color, w = cos(inner cutoff)
+	vec4 attenuation;    // x = constant, y = linear, z = quadratic
+	vec4 boundingSphere;
+	mat4 shadowMatrix;   // world space -> shadow atlas uv
+	vec4 shadowRect;     // uv bounds of the atlas tile, all 0 for no shadow
+};
+
+// must match lighting.h
+const uint ClusterGridX = 16;
+const uint ClusterGridY = 9;
+const uint ClusterGridZ = 24;
+const uint NumClusters = ClusterGridX * ClusterGridY * ClusterGridZ;
+const uint MaxLightsPerCluster = 64;
+
+layout(std430, binding=0) readonly buffer LightBuffer {
+	Light Lights[];
+};
+layout(std430, binding=1) readonly buffer ClusterBuffer {
+	uint ClusterLightCounts[NumClusters];
+	uint ClusterLightIndices[];
+};
 
 layout(location=4) uniform vec3 CameraPos;
 layout(location=5) uniform vec3 CameraDir;
@@ -15,15 +54,20 @@ layout(location=7) uniform vec3 DiffuseColor;
 layout(location=8) uniform vec3 SpecularColor;
 layout(location=9) uniform float SpecularExponent;
 layout(location=10) uniform float Alpha;
-layout(location=11) uniform bool RenderNormals;
 layout(location=12) uniform samplerCube GarageDiffuse;
 layout(location=13) uniform float Reflectivity;
 layout(location=14) uniform samplerCubeShadow ShadowMap;
 layout(location=20) uniform vec3 LightPos;
 layout(location=21) uniform float FarPlane;
-layout(location=23) uniform bool DoGammaCorrection;
+layout(location=22) uniform int ShadowTaps; // how many of ShadowSampleOffsets to filter with
+layout(location=40) uniform mat4 View;
+layout(location=41) uniform vec2 ScreenSize;
+layout(location=42) uniform vec2 ClusterDepthParams;
+layout(location=43) uniform int NumLights;
+layout(location=45) uniform sampler2DShadow ShadowAtlas;
 
 const float ShadowBias = 0.05;
+const float ShadowNormalOffset = 0.05;
 const float ShadowSampleDist = 0.02;
 const vec3 ShadowSampleOffsets[20] = vec3[](
 	vec3( 1,  1,  1), vec3( 1, -1,  1), vec3(-1, -1,  1), vec3(-1,  1,  1), 
@@ -37,12 +81,16 @@ vec3 calcPointLight(vec3 normal, vec3 diffuseColor) {
 	float distToLight = length(lightToFrag);
 	float shadowRef = (distToLight - ShadowBias) / FarPlane;
 
+#ifdef SOFT_SHADOWS
 	float lightFactor = 0;
-	for (int i = 0; i < ShadowSampleOffsets.length(); ++i) {
+	for (int i = 0; i < ShadowTaps; ++i) {
 		lightFactor += texture(ShadowMap, vec4(lightToFrag + ShadowSampleDist * ShadowSampleOffsets[i], shadowRef)).r;
 	}
 	
-	lightFactor /= ShadowSampleOffsets.length();
+	lightFactor /= ShadowTaps;
+#else
+	float lightFactor = texture(ShadowMap, vec4(lightToFrag, shadowRef)).r;
+#endif
 	lightFactor *= 10 / (1 + distToLight * distToLight);
 
 	vec3 lightD = normalize(LightPos - vertPos);
@@ -55,47 +103,111 @@ vec3 calcPointLight(vec3 normal, vec3 diffuseColor) {
 	return lightFactor * (diffuse * DiffuseColor + specular * SpecularColor);	
 }
 
-vec3 calcSpotlight(vec3 normal, vec3 diffuseColor) {
-	vec3 spotlight = vec3(0);
+float calcSpotlightShadow(Light light, vec3 normal) {
+	if (light.shadowRect.z == 0)
+		return 1;
+
+	// offsetting along the normal keeps surfaces at grazing angles from shadowing themselves
+	vec3 shadowPos = vertPos + ShadowNormalOffset * normal;
+	vec4 atlasPos = light.shadowMatrix * vec4(shadowPos, 1);
+	vec2 uv = atlasPos.xy / atlasPos.w;
+	float shadowRef = (distance(shadowPos, light.posRange.xyz) - ShadowBias) / light.posRange.w;
+
+	// the tile may still be from a few frames ago when the light pointed somewhere else
+	if (any(lessThan(uv, light.shadowRect.xy)) || any(greaterThan(uv, light.shadowRect.zw)) || atlasPos.w <= 0)
+		return 1;
+
+#ifdef SOFT_SHADOWS
+	// 2x2 bilinear taps, clamped so they never read a neighbouring tile
+	vec2 texelSize = 1.0 / vec2(textureSize(ShadowAtlas, 0));
+	float lightFactor = 0;
+	for (int y = 0; y < 2; ++y) {
+		for (int x = 0; x < 2; ++x) {
+			vec2 sampleUV = clamp(uv + (vec2(x, y) - 0.5) * texelSize, light.shadowRect.xy, light.shadowRect.zw);
+			lightFactor += texture(ShadowAtlas, vec3(sampleUV, shadowRef));
+		}
+	}
+
+	return lightFactor / 4;
+#else
+	return texture(ShadowAtlas, vec3(uv, shadowRef));
+#endif
+}
+
+vec3 calcSpotlight(Light light, vec3 normal, vec3 diffuseColor, vec3 specularColor, float specularExponent) {
+	vec3 lighting = vec3(0);
 	
-	vec3 fragToLight = CameraPos - vertPos;
+	vec3 fragToLight = light.posRange.xyz - vertPos;
 	float distToLight = length(fragToLight);
 	vec3 lightD = fragToLight / distToLight;
-	float cosTheta = dot(lightD, -normalize(CameraDir));
+	float cosTheta = dot(lightD, -light.dirCosOuter.xyz);
 
-	const float outerCutoff = cos(radians(17.5));
-	const float innerCutoff = cos(radians(12.5));
+	float cosOuterCutoff = light.dirCosOuter.w;
+	float cosInnerCutoff = light.colorCosInner.w;
+	float window = clamp(1 - pow(distToLight / light.posRange.w, 4), 0, 1);
+
+	float intensity = min((cosTheta - cosOuterCutoff) / max(cosInnerCutoff - cosOuterCutoff, 1e-4), 1) * window * window;
+	if (intensity > 0)
+		intensity *= calcSpotlightShadow(light, normal);
 
-	float intensity = min((cosTheta - outerCutoff) / (innerCutoff - outerCutoff), 1);
 	if (intensity > 0) {
 		vec3 cameraD = normalize(CameraPos - vertPos);
 		vec3 halfwayLightCamera = normalize(lightD + cameraD);
 		float diffuse = max(0, dot(normal, lightD));
-		float specular = pow(max(0, dot(normal, halfwayLightCamera)), 32);
-		float attenutation = 1 + 0.25 * distToLight * distToLight;
-		spotlight = 20 * intensity * (diffuse * diffuseColor + specular * vec3(1)) / attenutation;
+		float specular = pow(max(0, dot(normal, halfwayLightCamera)), specularExponent);
+		float attenutation = dot(light.attenuation.xyz, vec3(1, distToLight, distToLight * distToLight));
+		lighting = light.colorCosInner.rgb * intensity * (diffuse * diffuseColor + specular * specularColor) / attenutation;
 	}
 
-	return spotlight;
+	return lighting;
+}
+
+vec3 calcSpotlights(vec3 normal, vec3 diffuseColor, vec3 specularColor, float specularExponent) {
+	vec3 lighting = vec3(0);
+
+#ifdef LIGHT_CLUSTERS
+	float viewZ = (View * vec4(vertPos, 1)).z;
+	uint slice = uint(clamp(log(viewZ) * ClusterDepthParams.x + ClusterDepthParams.y, 0, ClusterGridZ - 1));
+	uvec2 tile = uvec2(gl_FragCoord.xy / ScreenSize * vec2(ClusterGridX, ClusterGridY));
+	tile = min(tile, uvec2(ClusterGridX - 1, ClusterGridY - 1));
+	uint cluster = tile.x + ClusterGridX * (tile.y + ClusterGridY * slice);
+
+	uint numLights = ClusterLightCounts[cluster];
+	for (uint i = 0; i < numLights; ++i) {
+		Light light = Lights[ClusterLightIndices[cluster * MaxLightsPerCluster + i]];
+		lighting += calcSpotlight(light, normal, diffuseColor, specularColor, specularExponent);
+	}
+#else
+	for (int i = 0; i < NumLights; ++i)
+		lighting += calcSpotlight(Lights[i], normal, diffuseColor, specularColor, specularExponent);
+#endif
+
+	return lighting;
 }
 
 void main() {
+#ifdef TEMPORAL_AA
+	fragVelocity = 0.5 * (vertClipPos.xy / vertClipPos.w - vertPreviousClipPos.xy / vertPreviousClipPos.w);
+#endif
 
 	vec3 normal = normalize(vertNormal);
 	
-	if (RenderNormals)
-		fragColor = vec4(0.5 * (1 + normal), 1);
-	else
-	{
-		vec3 cameraD = normalize(CameraPos - vertPos);
-		vec3 lighting = calcPointLight(normal, DiffuseColor);
-		//lighting += calcSpotlight(normal, DiffuseColor);
-
-		vec3 reflectDir = reflect(-cameraD, normal);
-		vec3 reflection = texture(GarageDiffuse, reflectDir).rgb;
-
-		vec3 color = mix(lighting, reflection, Reflectivity);
-		vec3 gamma = vec3(DoGammaCorrection ? 1.0 / 2.2 : 1.0);
-		fragColor = vec4(pow(color, gamma), Alpha);
-	}
+#ifdef RENDER_NORMALS
+	fragColor = vec4(0.5 * (1 + normal), 1);
+#else
+	vec3 cameraD = normalize(CameraPos - vertPos);
+	vec3 lighting = calcPointLight(normal, DiffuseColor);
+#ifdef SPOTLIGHTS
+	lighting += calcSpotlights(normal, DiffuseColor, SpecularColor, SpecularExponent);
+#endif
+
+	vec3 reflectDir = reflect(-cameraD, normal);
+	vec3 reflection = texture(GarageDiffuse, reflectDir).rgb;
+
+	vec3 color = mix(lighting, reflection, Reflectivity);
+#ifdef GAMMA_CORRECTION
+	color = pow(color, vec3(1.0 / 2.2));
+#endif
+	fragColor = vec4(color, Alpha);
+#endif
 }
\ No newline at end of file
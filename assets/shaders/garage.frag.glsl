@@ -1,41 +1,73 @@
 #version 430
 
+// Variant defines (see ShaderVariants in graphics.h):
+// RENDER_NORMALS   - output the normal as the color
+// GAMMA_CORRECTION - convert the output from linear to gamma space
+// SPOTLIGHTS       - light with the spotlights in the light buffer
+// LIGHT_CLUSTERS   - only loop over the spotlights in the fragment's cluster
+// SOFT_SHADOWS     - filter shadows with multiple taps
+// NORMAL_MAPPING   - perturb the normal with the normal map
+// TEMPORAL_AA      - jitter the projection and output the velocity for the TAA resolve
+
 in vec3 vertPos;
 in vec3 vertNormal;
 in vec3 vertTangent;
 in vec3 vertTexDir;
 in vec4 vertColor;
 
-out vec4 fragColor;
+layout(location=0) out vec4 fragColor;
+#ifdef TEMPORAL_AA
+in vec4 vertClipPos;
+in vec4 vertPreviousClipPos;
+
+layout(location=1) out vec2 fragVelocity; // how far the surface moved on screen since the last frame, in uv units
+#endif
+
+struct Light {
+	vec4 posRange;       // xyz = position, w = range
+	vec4 dirCosOuter;    // xyz = direction, w = cos(outer cutoff)
+	vec4 colorCosInner;  // rgb = color, w = cos(inner cutoff)
+	vec4 attenuation;    // x = constant, y = linear, z = quadratic
+	vec4 boundingSphere;
+	mat4 shadowMatrix;   // world space -> shadow atlas uv
+	vec4 shadowRect;     // uv bounds of the atlas tile, all 0 for no shadow
+};
+
+// must match lighting.h
+const uint ClusterGridX = 16;
+const uint ClusterGridY = 9;
+const uint ClusterGridZ = 24;
+const uint NumClusters = ClusterGridX * ClusterGridY * ClusterGridZ;
+const uint MaxLightsPerCluster = 64;
 
-struct Spotlight {
-	vec3 pos;
-	vec3 dir;
-	vec3 color;
-	float cosOuterCutoff;
-	float cosInnerCutoff;
+layout(std430, binding=0) readonly buffer LightBuffer {
+	Light Lights[];
+};
+layout(std430, binding=1) readonly buffer ClusterBuffer {
+	uint ClusterLightCounts[NumClusters];
+	uint ClusterLightIndices[];
 };
 
 layout(location=4) uniform vec3 CameraPos;
 layout(location=5) uniform vec3 CameraDir;
 layout(location=6) uniform vec3 AmbientColor;
-layout(location=11) uniform bool RenderNormals;
 layout(location=12) uniform samplerCube DiffuseMap;
 layout(location=13) uniform samplerCube NormalMap;
 layout(location=14) uniform samplerCubeShadow ShadowMap;
 layout(location=15) uniform samplerCube DisplacementMap;
 layout(location=20) uniform vec3 LightPos;
 layout(location=21) uniform float FarPlane;
-layout(location=22) uniform bool DoSpotlight;
-layout(location=23) uniform bool DoGammaCorrection;
-
-//TODO
-//layout(location=30) uniform Spotlight StageLights[2];
-//layout(location=31) uniform sampler2DShadow SpotlightShadowMaps[2];
+layout(location=22) uniform int ShadowTaps; // how many of ShadowSampleOffsets to filter with
+layout(location=40) uniform mat4 View;
+layout(location=41) uniform vec2 ScreenSize;
+layout(location=42) uniform vec2 ClusterDepthParams;
+layout(location=43) uniform int NumLights;
+layout(location=45) uniform sampler2DShadow ShadowAtlas;
 
 //TODO: some shadow acne is still visible
 const float SpecularExponent = 8;
 const float ShadowBias = 0.05;
+const float ShadowNormalOffset = 0.05;
 const float ShadowSampleDist = 0.05;
 const vec3 ShadowSampleOffsets[20] = vec3[](
 	vec3( 1,  1,  1), vec3( 1, -1,  1), vec3(-1, -1,  1), vec3(-1,  1,  1), 
@@ -66,44 +98,111 @@ vec3 calcPointLight(vec3 normal, vec3 diffuseColor) {
 	//	}
 	//	lightFactor /= (1 + shadowSampleOffsets.length);
 	//}
+#ifdef SOFT_SHADOWS
 	float lightFactor = 0;
-	for (int i = 0; i < ShadowSampleOffsets.length(); ++i) {
+	for (int i = 0; i < ShadowTaps; ++i) {
 		vec4 shadowCoords = vec4(lightToFrag + ShadowSampleDist * ShadowSampleOffsets[i], shadowRef);
 		lightFactor += texture(ShadowMap, shadowCoords).r;
 	}
+	lightFactor /= ShadowTaps;
+#else
+	float lightFactor = texture(ShadowMap, vec4(lightToFrag, shadowRef)).r;
+#endif
 
 	float attenutation = 1 + distToLight * distToLight;
 
-	lightFactor *= 10 / attenutation / ShadowSampleOffsets.length();
+	lightFactor *= 10 / attenutation;
 	return lightFactor * (diffuse * diffuseColor + specular * vec3(1));
 }
 
-vec3 calcLighting(Spotlight spotlight, vec3 normal, vec3 diffuseColor) {
+float calcSpotlightShadow(Light light, vec3 normal) {
+	if (light.shadowRect.z == 0)
+		return 1;
+
+	// offsetting along the normal keeps surfaces at grazing angles from shadowing themselves
+	vec3 shadowPos = vertPos + ShadowNormalOffset * normal;
+	vec4 atlasPos = light.shadowMatrix * vec4(shadowPos, 1);
+	vec2 uv = atlasPos.xy / atlasPos.w;
+	float shadowRef = (distance(shadowPos, light.posRange.xyz) - ShadowBias) / light.posRange.w;
+
+	// the tile may still be from a few frames ago when the light pointed somewhere else
+	if (any(lessThan(uv, light.shadowRect.xy)) || any(greaterThan(uv, light.shadowRect.zw)) || atlasPos.w <= 0)
+		return 1;
+
+#ifdef SOFT_SHADOWS
+	// 2x2 bilinear taps, clamped so they never read a neighbouring tile
+	vec2 texelSize = 1.0 / vec2(textureSize(ShadowAtlas, 0));
+	float lightFactor = 0;
+	for (int y = 0; y < 2; ++y) {
+		for (int x = 0; x < 2; ++x) {
+			vec2 sampleUV = clamp(uv + (vec2(x, y) - 0.5) * texelSize, light.shadowRect.xy, light.shadowRect.zw);
+			lightFactor += texture(ShadowAtlas, vec3(sampleUV, shadowRef));
+		}
+	}
+
+	return lightFactor / 4;
+#else
+	return texture(ShadowAtlas, vec3(uv, shadowRef));
+#endif
+}
+
+vec3 calcSpotlight(Light light, vec3 normal, vec3 diffuseColor, vec3 specularColor, float specularExponent) {
 	vec3 lighting = vec3(0);
 	
-	vec3 fragToLight = spotlight.pos - vertPos;
+	vec3 fragToLight = light.posRange.xyz - vertPos;
 	float distToLight = length(fragToLight);
 	vec3 lightD = fragToLight / distToLight;
-	float cosTheta = dot(lightD, -spotlight.dir);
+	float cosTheta = dot(lightD, -light.dirCosOuter.xyz);
+
+	float cosOuterCutoff = light.dirCosOuter.w;
+	float cosInnerCutoff = light.colorCosInner.w;
+	float window = clamp(1 - pow(distToLight / light.posRange.w, 4), 0, 1);
 
-	float cosOuterCutoff = spotlight.cosOuterCutoff;
-	float cosInnerCutoff = spotlight.cosInnerCutoff;
+	float intensity = min((cosTheta - cosOuterCutoff) / max(cosInnerCutoff - cosOuterCutoff, 1e-4), 1) * window * window;
+	if (intensity > 0)
+		intensity *= calcSpotlightShadow(light, normal);
 
-	float intensity = min((cosTheta - cosOuterCutoff) / (cosInnerCutoff - cosOuterCutoff), 1);
 	if (intensity > 0) {
 		vec3 cameraD = normalize(CameraPos - vertPos);
 		vec3 halfwayLightCamera = normalize(lightD + cameraD);
 		float diffuse = max(0, dot(normal, lightD));
-		float specular = pow(max(0, dot(normal, halfwayLightCamera)), SpecularExponent);
-		float attenutation = 1 + 0.25 * distToLight * distToLight;
-		lighting = spotlight.color * intensity * (diffuse * diffuseColor + specular * vec3(1)) / attenutation;
+		float specular = pow(max(0, dot(normal, halfwayLightCamera)), specularExponent);
+		float attenutation = dot(light.attenuation.xyz, vec3(1, distToLight, distToLight * distToLight));
+		lighting = light.colorCosInner.rgb * intensity * (diffuse * diffuseColor + specular * specularColor) / attenutation;
+	}
+
+	return lighting;
+}
+
+vec3 calcSpotlights(vec3 normal, vec3 diffuseColor, vec3 specularColor, float specularExponent) {
+	vec3 lighting = vec3(0);
+
+#ifdef LIGHT_CLUSTERS
+	float viewZ = (View * vec4(vertPos, 1)).z;
+	uint slice = uint(clamp(log(viewZ) * ClusterDepthParams.x + ClusterDepthParams.y, 0, ClusterGridZ - 1));
+	uvec2 tile = uvec2(gl_FragCoord.xy / ScreenSize * vec2(ClusterGridX, ClusterGridY));
+	tile = min(tile, uvec2(ClusterGridX - 1, ClusterGridY - 1));
+	uint cluster = tile.x + ClusterGridX * (tile.y + ClusterGridY * slice);
+
+	uint numLights = ClusterLightCounts[cluster];
+	for (uint i = 0; i < numLights; ++i) {
+		Light light = Lights[ClusterLightIndices[cluster * MaxLightsPerCluster + i]];
+		lighting += calcSpotlight(light, normal, diffuseColor, specularColor, specularExponent);
 	}
+#else
+	for (int i = 0; i < NumLights; ++i)
+		lighting += calcSpotlight(Lights[i], normal, diffuseColor, specularColor, specularExponent);
+#endif
 
 	return lighting;
 }
 
 void main() {
+#ifdef TEMPORAL_AA
+	fragVelocity = 0.5 * (vertClipPos.xy / vertClipPos.w - vertPreviousClipPos.xy / vertPreviousClipPos.w);
+#endif
 	vec3 normal = normalize(vertNormal);
+#ifdef NORMAL_MAPPING
 	vec3 tangent = normalize(vertTangent);
 	tangent = normalize(tangent - dot(tangent, normal) * normal);
 	vec3 bitangent = cross(tangent, normal);
@@ -111,34 +210,22 @@ void main() {
 	mat3 tbn = mat3(tangent, bitangent, normal);
 	normal = texture(NormalMap, vertTexDir).rgb * 2 - 1;
 	normal = normalize(tbn * normal);
+#endif
 
-	if (RenderNormals)
-		fragColor = vec4(0.5 * (1 + normal), 1);
-	else
-	{
-		vec3 diffuseColor = texture(DiffuseMap, vertTexDir).rgb;
-
-		vec3 lighting = calcPointLight(normal, diffuseColor);
-		Spotlight headlight1;
-		headlight1.pos = vec3(-1.9891, 1.8, 4.8);
-		headlight1.dir = normalize(vec3(-0.1, 0, 1));
-		headlight1.color = vec3(20);
-		headlight1.cosOuterCutoff = cos(radians(37.5));
-		headlight1.cosInnerCutoff = cos(radians(12.5));
-		
-		Spotlight headlight2;
-		headlight2.pos = vec3(+1.9891, 1.8, 4.8);
-		headlight2.dir = normalize(vec3(+0.1, 0, 1));
-		headlight2.color = vec3(20);
-		headlight2.cosOuterCutoff = cos(radians(37.5));
-		headlight2.cosInnerCutoff = cos(radians(12.5));
-		
-		lighting += calcLighting(headlight1, normal, diffuseColor);
-		lighting += calcLighting(headlight2, normal, diffuseColor);
-		//lighting += calcLighting(StageLights[0], normal, diffuseColor);
-		//lighting += calcLighting(StageLights[1], normal, diffuseColor);
-		
-		vec3 gamma = vec3(DoGammaCorrection ? 1.0 / 2.2 : 1.0);
-		fragColor = vec4(pow(vertColor.rgb * (AmbientColor + lighting), gamma), 1);
-	}
+#ifdef RENDER_NORMALS
+	fragColor = vec4(0.5 * (1 + normal), 1);
+#else
+	vec3 diffuseColor = texture(DiffuseMap, vertTexDir).rgb;
+
+	vec3 lighting = calcPointLight(normal, diffuseColor);
+#ifdef SPOTLIGHTS
+	lighting += calcSpotlights(normal, diffuseColor, vec3(1), SpecularExponent);
+#endif
+	
+	vec3 color = vertColor.rgb * (AmbientColor + lighting);
+#ifdef GAMMA_CORRECTION
+	color = pow(color, vec3(1.0 / 2.2));
+#endif
+	fragColor = vec4(color, 1);
+#endif
 }
\ No newline at end of file
@@ -12,11 +12,25 @@ out vec3 vertTangent;
 out vec3 vertTexDir;
 out vec4 vertColor;
 
+#ifdef TEMPORAL_AA
+out vec4 vertClipPos;         // unjittered, for the velocity
+out vec4 vertPreviousClipPos;
+#endif
+
 layout(location=0) uniform mat4 Model;
 layout(location=1) uniform mat4 MVP;
+#ifdef TEMPORAL_AA
+layout(location=2) uniform mat4 PreviousMVP; // of the frame before
+layout(location=3) uniform vec2 Jitter;      // subpixel offset of this frame in NDC
+#endif
 
 void main() {
 	gl_Position = MVP * vec4(pos, 1);
+#ifdef TEMPORAL_AA
+	vertClipPos = gl_Position;
+	vertPreviousClipPos = PreviousMVP * vec4(pos, 1);
+	gl_Position.xy += Jitter * gl_Position.w;
+#endif
 
 	mat3 m = mat3(Model);
 	vertPos = (Model * vec4(pos, 1)).xyz;
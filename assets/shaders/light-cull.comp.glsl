@@ -0,0 +1,78 @@
+#version 430
+
+// must match lighting.h
+const uint ClusterGridX = 16;
+const uint ClusterGridY = 9;
+const uint ClusterGridZ = 24;
+const uint NumClusters = ClusterGridX * ClusterGridY * ClusterGridZ;
+const uint MaxLightsPerCluster = 64;
+const uint BatchSize = 64;
+
+layout(local_size_x=64) in;
+
+struct Light {
+	vec4 posRange;
+	vec4 dirCosOuter;
+	vec4 colorCosInner;
+	vec4 attenuation;
+	vec4 boundingSphere;
+	mat4 shadowMatrix;
+	vec4 shadowRect;
+};
+
+layout(std430, binding=0) readonly buffer LightBuffer {
+	Light Lights[];
+};
+layout(std430, binding=1) writeonly buffer ClusterBuffer {
+	uint ClusterLightCounts[NumClusters];
+	uint ClusterLightIndices[];
+};
+
+layout(location=0) uniform mat4 View;
+layout(location=1) uniform vec2 ProjScale;
+layout(location=2) uniform vec2 ClusterDepthRange;
+layout(location=3) uniform int NumLights;
+
+// view space bounding spheres of the current batch of lights, shared by the whole work group
+shared vec4 BatchSpheres[BatchSize];
+
+void main() {
+	uint clusterIndex = gl_GlobalInvocationID.x;
+	uint x = clusterIndex % ClusterGridX;
+	uint y = (clusterIndex / ClusterGridX) % ClusterGridY;
+	uint z = clusterIndex / (ClusterGridX * ClusterGridY);
+
+	float near = ClusterDepthRange.x;
+	float far = ClusterDepthRange.y;
+	float sliceNear = z == 0 ? 0 : near * pow(far / near, float(z) / ClusterGridZ);
+	float sliceFar = near * pow(far / near, float(z + 1) / ClusterGridZ);
+
+	vec2 gridSize = vec2(ClusterGridX, ClusterGridY);
+	vec2 rayMin = (vec2(x, y) / gridSize * 2 - 1) * ProjScale;
+	vec2 rayMax = (vec2(x + 1, y + 1) / gridSize * 2 - 1) * ProjScale;
+	vec3 aabbMin = vec3(min(rayMin * sliceNear, rayMin * sliceFar), sliceNear);
+	vec3 aabbMax = vec3(max(rayMax * sliceNear, rayMax * sliceFar), sliceFar);
+
+	uint count = 0;
+	for (uint batch = 0; batch < uint(NumLights); batch += BatchSize) {
+		uint lightIndex = batch + gl_LocalInvocationIndex;
+		if (lightIndex < uint(NumLights)) {
+			vec4 sphere = Lights[lightIndex].boundingSphere;
+			BatchSpheres[gl_LocalInvocationIndex] = vec4((View * vec4(sphere.xyz, 1)).xyz, sphere.w);
+		}
+		barrier();
+
+		uint batchCount = min(BatchSize, uint(NumLights) - batch);
+		for (uint i = 0; i < batchCount; ++i) {
+			vec4 sphere = BatchSpheres[i];
+			vec3 toClosest = clamp(sphere.xyz, aabbMin, aabbMax) - sphere.xyz;
+			if (dot(toClosest, toClosest) <= sphere.w * sphere.w && count < MaxLightsPerCluster) {
+				ClusterLightIndices[clusterIndex * MaxLightsPerCluster + count] = batch + i;
+				++count;
+			}
+		}
+		barrier();
+	}
+
+	ClusterLightCounts[clusterIndex] = count;
+}
\ No newline at end of file
@@ -0,0 +1,39 @@
+#version 430
+
+out vec4 fragColor;
+
+layout(location=0) uniform sampler2D Scene;      // this frame, rendered with a jittered projection
+layout(location=1) uniform sampler2D Velocity;   // screen space motion since the last frame, in uv units
+layout(location=2) uniform sampler2D History;    // the resolve of the last frame
+layout(location=3) uniform vec2 SceneSize;       // the used part of all three textures
+layout(location=4) uniform vec2 TexelSize;       // of the whole textures
+layout(location=5) uniform float HistoryWeight;  // 0 throws the history away
+
+// Blends the pixel with where its surface was in the history. The history is clamped to the
+// colors around the pixel first, anything outside of those was disoccluded or lit differently
+// and would smear.
+void main() {
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	ivec2 maxPixel = ivec2(SceneSize) - 1;
+	vec3 center = texelFetch(Scene, pixel, 0).rgb;
+
+	vec3 minColor = center;
+	vec3 maxColor = center;
+	for (int y = -1; y <= 1; ++y) {
+		for (int x = -1; x <= 1; ++x) {
+			vec3 neighbor = texelFetch(Scene, clamp(pixel + ivec2(x, y), ivec2(0), maxPixel), 0).rgb;
+			minColor = min(minColor, neighbor);
+			maxColor = max(maxColor, neighbor);
+		}
+	}
+
+	vec2 velocity = texelFetch(Velocity, pixel, 0).xy;
+	vec2 previousPixel = gl_FragCoord.xy - velocity * SceneSize;
+	float weight = HistoryWeight;
+	if (any(lessThan(previousPixel, vec2(0))) || any(greaterThan(previousPixel, SceneSize)))
+		weight = 0;
+
+	vec3 history = texture(History, clamp(previousPixel, vec2(0.5), SceneSize - 0.5) * TexelSize).rgb;
+	history = clamp(history, minColor, maxColor);
+	fragColor = vec4(mix(center, history, weight), 1);
+}
\ No newline at end of file
@@ -6,8 +6,14 @@ in vec4 vertColor;
 out vec4 fragColor;
 
 uniform sampler2D Atlas;
+layout(location=1) uniform bool DistanceField; // the atlas holds distances to the glyph edges, at 0.5
 
 void main() {
 	float alpha = texture(Atlas, vertUV).r;
+	if (DistanceField) {
+		// antialiased over a screen pixel, whatever the scale and rotation
+		float width = max(fwidth(alpha), 1e-4);
+		alpha = clamp((alpha - 0.5) / width + 0.5, 0.0, 1.0);
+	}
 	fragColor = vertColor * vec4(1.0, 1.0, 1.0, alpha);
 }
\ No newline at end of file
@@ -0,0 +1,39 @@
+#version 430
+
+out vec4 fragColor;
+
+layout(location=0) uniform sampler2D Scene;
+layout(location=1) uniform vec2 ScenePixelsPerPixel; // scene size / output size
+layout(location=2) uniform vec2 TexelSize;           // of the whole scene texture, only part of it is used
+layout(location=3) uniform vec2 SceneSize;
+layout(location=4) uniform float Sharpness;          // 0 to 1
+
+vec3 sampleScene(vec2 pixel) {
+	// stay clear of the unused part of the texture
+	pixel = clamp(pixel, vec2(0.5), SceneSize - 0.5);
+	return texture(Scene, pixel * TexelSize).rgb;
+}
+
+// Bilinear upscale followed by contrast adaptive sharpening: the center is pushed away from its
+// four neighbors, less so where the local contrast is high already so edges don't ring.
+void main() {
+	vec2 pixel = gl_FragCoord.xy * ScenePixelsPerPixel;
+	vec3 center = sampleScene(pixel);
+	if (Sharpness <= 0.0) {
+		fragColor = vec4(center, 1);
+		return;
+	}
+
+	vec3 north = sampleScene(pixel + vec2(0, 1));
+	vec3 south = sampleScene(pixel - vec2(0, 1));
+	vec3 east = sampleScene(pixel + vec2(1, 0));
+	vec3 west = sampleScene(pixel - vec2(1, 0));
+
+	vec3 minColor = min(center, min(min(north, south), min(east, west)));
+	vec3 maxColor = max(center, max(max(north, south), max(east, west)));
+	vec3 amount = sqrt(clamp(min(minColor, 1.0 - maxColor) / max(maxColor, 1e-4), 0.0, 1.0));
+	vec3 weight = -0.2 * Sharpness * amount;
+
+	vec3 color = (center + weight * (north + south + east + west)) / (1.0 + 4.0 * weight);
+	fragColor = vec4(clamp(color, 0.0, 1.0), 1);
+}
\ No newline at end of file
@@ -0,0 +1,7 @@
+#version 430
+
+// One triangle that covers the whole screen, no vertex buffer needed.
+void main() {
+	vec2 pos = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+	gl_Position = vec4(2.0 * pos - 1.0, 0, 1);
+}
\ No newline at end of file
@@ -0,0 +1,138 @@
+#include "benchmark.h"
+
+#include <string.h>
+
+int parseBenchmarkOption(int argc, char **argv, int i, BenchmarkOptions *options)
+{
+	const char *arg = argv[i];
+	const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+	if (strcmp(arg, "--benchmark") == 0)
+		options->enabled = true;
+	else if (strcmp(arg, "--headless") == 0)
+		options->headless = true;
+	else if (strcmp(arg, "--regress") == 0)
+		options->regress = true;
+	else if (strcmp(arg, "--update-goldens") == 0)
+		options->regress = options->updateGoldens = true;
+	else if (strcmp(arg, "--frames") == 0 && value)
+	{
+		options->numFrames = atoi(value);
+		return 2;
+	}
+	else if (strcmp(arg, "--warmup") == 0 && value)
+	{
+		options->numWarmupFrames = atoi(value);
+		return 2;
+	}
+	else if (strcmp(arg, "--size") == 0 && value)
+	{
+		if (sscanf(value, "%dx%d", &options->width, &options->height) != 2)
+		{
+			fprintf(stderr, "ERROR: expected --size WIDTHxHEIGHT, got '%s'\n", value);
+			return -1;
+		}
+		return 2;
+	}
+	else if (strcmp(arg, "--output") == 0 && value)
+	{
+		options->outputFilename = value;
+		return 2;
+	}
+	else
+		return 0;
+
+	return 1;
+}
+
+bool checkBenchmarkOptions(const BenchmarkOptions *options)
+{
+	if (options->headless && !options->enabled && !options->regress)
+	{
+		fprintf(stderr, "ERROR: --headless only works together with --benchmark or --regress\n");
+		return false;
+	}
+	if (options->enabled && options->regress)
+	{
+		fprintf(stderr, "ERROR: can't benchmark and run the regression suite at the same time\n");
+		return false;
+	}
+	if (options->numFrames <= 0 || options->numWarmupFrames < 0 || options->width <= 0 || options->height <= 0)
+	{
+		fprintf(stderr, "ERROR: the number of frames and the size have to be positive\n");
+		return false;
+	}
+	return true;
+}
+
+Benchmark *createBenchmark(const BenchmarkOptions &options)
+{
+	Benchmark *benchmark = new Benchmark();
+	benchmark->options = options;
+	benchmark->frameMs.reserve(options.numFrames);
+	benchmark->frameStartTimer = getTimerValue();
+	return benchmark;
+}
+
+void endBenchmarkFrame(Benchmark *benchmark, const GpuProfiler *gpuProfiler)
+{
+	glFinish();
+
+	uint64_t now = getTimerValue();
+	bool warmup = benchmark->frame < benchmark->options.numWarmupFrames;
+	if (!warmup)
+		benchmark->frameMs.push_back((float)(1000 * getDeltaTime(benchmark->frameStartTimer, now)));
+
+	// the GPU samples read back this frame are from GpuProfilerLatency frames ago
+	collectGpuPassSamples(&benchmark->gpuPassSamples, gpuProfiler, benchmark->frame - GpuProfilerLatency >= benchmark->options.numWarmupFrames);
+
+	++benchmark->frame;
+	benchmark->frameStartTimer = now;
+}
+
+static void writeTimingStats(FILE *file, TimingStats stats)
+{
+	fprintf(file, "{ \"min\": %.4f, \"avg\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"samples\": %d }",
+		stats.minMs, stats.avgMs, stats.p50Ms, stats.p95Ms, stats.p99Ms, stats.numSamples);
+}
+
+bool finishBenchmark(Benchmark *benchmark, GpuProfiler *gpuProfiler)
+{
+	flushGpuProfiler(gpuProfiler);
+	collectGpuPassSamples(&benchmark->gpuPassSamples, gpuProfiler);
+
+	const BenchmarkOptions &options = benchmark->options;
+	FILE *file = fopen(options.outputFilename, "wb");
+	if (!file)
+	{
+		fprintf(stderr, "ERROR: failed to open '%s' for writing the benchmark results\n", options.outputFilename);
+		return false;
+	}
+
+	TimingStats frameStats = getTimingStats(benchmark->frameMs.data(), (int)benchmark->frameMs.size());
+
+	fprintf(file, "{\n");
+	fprintf(file, "\t\"renderer\": \"%s\",\n", (const char *)glGetString(GL_RENDERER));
+	fprintf(file, "\t\"version\": \"%s\",\n", (const char *)glGetString(GL_VERSION));
+	fprintf(file, "\t\"width\": %d,\n", options.width);
+	fprintf(file, "\t\"height\": %d,\n", options.height);
+	fprintf(file, "\t\"frames\": %d,\n", options.numFrames);
+	fprintf(file, "\t\"warmupFrames\": %d,\n", options.numWarmupFrames);
+	fprintf(file, "\t\"frameMs\": ");
+	writeTimingStats(file, frameStats);
+	fprintf(file, ",\n\t\"gpuPassMs\": {");
+	for (int pass = 0; pass < gpuProfiler->numPasses; ++pass)
+	{
+		std::vector<float> &samples = benchmark->gpuPassSamples.samplesMs[pass];
+		fprintf(file, "%s\n\t\t\"%s\": ", pass > 0 ? "," : "", gpuProfiler->passNames[pass]);
+		writeTimingStats(file, getTimingStats(samples.data(), (int)samples.size()));
+	}
+	fprintf(file, "\n\t}\n}\n");
+	fclose(file);
+
+	printf("benchmark: %d frames at %dx%d, frame time min %.2f avg %.2f p50 %.2f p95 %.2f p99 %.2f ms, results in '%s'\n",
+		frameStats.numSamples, options.width, options.height,
+		frameStats.minMs, frameStats.avgMs, frameStats.p50Ms, frameStats.p95Ms, frameStats.p99Ms,
+		options.outputFilename);
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "profiler.h"
+#include <vector>
+
+// Benchmark mode
+// --------------
+// Renders a fixed number of frames offscreen at a fixed resolution, advancing time by a fixed
+// step each frame, so that every run renders exactly the same images regardless of how fast
+// the machine is. Every frame waits for the GPU to finish, so the frame times include all of
+// the GPU work even without swapping buffers. The first few frames fill the shadow atlas and
+// the caches and are left out of the statistics.
+//
+//   car-demo --benchmark [--headless] [--frames N] [--warmup N] [--size WxH] [--output file.json]
+//
+// --headless renders through EGL without any window, so it runs on machines without a display.
+// The regression suite (see regression.h) shares these options, only --headless applies to it.
+// The options of every run, like --quality, are in options.h.
+
+struct BenchmarkOptions
+{
+	bool enabled = false;
+	bool headless = false;
+	bool regress = false; // --regress
+	bool updateGoldens = false; // --update-goldens
+	int numFrames = 600;
+	int numWarmupFrames = 30;
+	int width = 1280;
+	int height = 720;
+	double frameTime = 1.0 / 60; // seconds of simulated time per frame
+	const char *outputFilename = "benchmark.json";
+};
+
+struct Benchmark
+{
+	BenchmarkOptions options;
+	int frame;
+	uint64_t frameStartTimer;
+	std::vector<float> frameMs;
+	GpuPassSamples gpuPassSamples;
+};
+
+// Returns how many arguments the option at argv[i] took, 0 if it isn't a benchmark option and -1
+// for a bad value. parseCommandLine() in options.h goes through all of them.
+int parseBenchmarkOption(int argc, char **argv, int i, BenchmarkOptions *options);
+// Returns false if the options don't make sense together, options.enabled tells if --benchmark was given.
+bool checkBenchmarkOptions(const BenchmarkOptions *options);
+
+Benchmark *createBenchmark(const BenchmarkOptions &options);
+// Call at the very end of every frame.
+void endBenchmarkFrame(Benchmark *benchmark, const GpuProfiler *gpuProfiler);
+// Writes the results to options.outputFilename.
+bool finishBenchmark(Benchmark *benchmark, GpuProfiler *gpuProfiler);
\ No newline at end of file
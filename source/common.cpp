@@ -1,5 +1,15 @@
 #include "common.h"
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 char *readWholeFile(const char *filename, size_t *outSize)
 {
 	FILE *f = fopen(filename, "rb");
@@ -32,11 +42,84 @@ char *readWholeFile(const char *filename, size_t *outSize)
 	}
 }
 
-size_t hashBytes(const void *bytes, size_t numBytes)
+bool writeWholeFile(const char *filename, const void *contents, size_t size)
+{
+	FILE *f = fopen(filename, "wb");
+	if (f)
+	{
+		size_t written = fwrite(contents, 1, size, f);
+		fclose(f);
+		return written == size;
+	}
+	else
+		return false;
+}
+
+#ifdef _WIN32
+const void *mapWholeFile(const char *filename, size_t *outSize)
+{
+	*outSize = 0;
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	LARGE_INTEGER size;
+	const void *contents = NULL;
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+	{
+		// the view keeps the file mapped after both handles are closed
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping)
+		{
+			contents = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+		if (contents)
+			*outSize = (size_t)size.QuadPart;
+	}
+	CloseHandle(file);
+	return contents;
+}
+
+void unmapFile(const void *contents, size_t size)
+{
+	if (contents)
+		UnmapViewOfFile(contents);
+}
+#else
+const void *mapWholeFile(const char *filename, size_t *outSize)
+{
+	*outSize = 0;
+	int file = open(filename, O_RDONLY);
+	if (file < 0)
+		return NULL;
+
+	struct stat info;
+	void *contents = NULL;
+	if (fstat(file, &info) == 0 && info.st_size > 0)
+	{
+		contents = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (contents == MAP_FAILED)
+			contents = NULL;
+		else
+			*outSize = (size_t)info.st_size;
+	}
+	close(file); // the mapping stays
+	return contents;
+}
+
+void unmapFile(const void *contents, size_t size)
+{
+	if (contents)
+		munmap((void *)contents, size);
+}
+#endif
+
+size_t hashBytes(const void *bytes, size_t numBytes, size_t seed)
 {
 	// FNV 1a: https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
 
-	uint64_t hash = 14695981039346656037llu;
+	uint64_t hash = seed;
 	const uint8_t *dat = (const uint8_t *)bytes;
 
 	for (size_t i = 0; i < numBytes; ++i)
@@ -10,5 +10,11 @@
 typedef uint32_t uint;
 
 char *readWholeFile(const char *filename, size_t *outSize=NULL);
+bool writeWholeFile(const char *filename, const void *contents, size_t size);
+// Maps the file into memory read only, NULL if it can't be opened or is empty. The pages are
+// only read from disk (or the OS file cache) as they are touched.
+const void *mapWholeFile(const char *filename, size_t *outSize);
+void unmapFile(const void *contents, size_t size);
 
-size_t hashBytes(const void *bytes, size_t numBytes);
\ No newline at end of file
+// pass the previous hash as the seed to hash several pieces of data together
+size_t hashBytes(const void *bytes, size_t numBytes, size_t seed=14695981039346656037llu);
\ No newline at end of file
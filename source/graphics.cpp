@@ -1,5 +1,7 @@
 #include "graphics.h"
 #include "system.h"
+#include "profiler.h"
+#include "jobs.h"
 
 #pragma warning(push)
 #pragma warning(disable: 4365)
@@ -16,44 +18,47 @@
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "lib/tiny_obj_loader.h"
 #pragma warning(pop)
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
+#include <sys/stat.h>
 
-static constexpr int getCharIndex(const Font *font, char character)
-{
-	if (character >= font->firstChar && character < font->firstChar + font->numChars)
-		return character - font->firstChar;
-	else
-		return font->numChars;
-}
-static constexpr float getKerning(const Font *font, char char1, char char2)
-{
-	int index1 = getCharIndex(font, char1);
-	int index2 = getCharIndex(font, char2);
-	return font->kerningScale * font->xKerning[index1][index2];
-}
-
-static GLuint createShader(GLenum type, const char *source)
+static GLuint createShader(GLenum type, const char *source, const char *const *defines, int numDefines)
 {
 	GLuint shader = glCreateShader(type);
 	if (shader)
 	{
-		glShaderSource(shader, 1, &source, NULL);
-		glCompileShader(shader);
-
-		GLint shaderOk;
-		glGetShaderiv(shader, GL_COMPILE_STATUS, &shaderOk);
-		if (!shaderOk)
+		// #version has to come first, so the defines are spliced in after it
+		const char *body = strchr(source, '\n');
+		body = body ? body + 1 : source + strlen(source);
+
+		const char *strings[2 + 3 * MaxShaderDefines + 1];
+		GLint lengths[countof(strings)];
+		int numStrings = 0;
+		strings[numStrings] = source;
+		lengths[numStrings++] = (GLint)(body - source);
+		for (int i = 0; i < numDefines; ++i)
 		{
-			GLint logLength;
-			glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
-			char *log = (char *)malloc((size_t)logLength);
-			glGetShaderInfoLog(shader, logLength, NULL, (GLchar *)log);
-			fprintf(stderr, "GLSL error: %s\n", log);
-			free(log);
-
-			glDeleteShader(shader);
-			shader = 0;
+			strings[numStrings] = "#define ";
+			lengths[numStrings++] = -1;
+			strings[numStrings] = defines[i];
+			lengths[numStrings++] = -1;
+			strings[numStrings] = "\n";
+			lengths[numStrings++] = -1;
 		}
+		// keep the line numbers in error messages matching the file
+		strings[numStrings] = numDefines > 0 ? "#line 2\n" : "";
+		lengths[numStrings++] = -1;
+		strings[numStrings] = body;
+		lengths[numStrings++] = -1;
+
+		// the compile status isn't checked until the program is linked,
+		// that way drivers can compile several shaders in parallel
+		glShaderSource(shader, numStrings, strings, lengths);
+		glCompileShader(shader);
 	}
 	else
 		fprintf(stderr, "OpenGL failed to allocate a shader");
@@ -61,47 +66,9 @@ static GLuint createShader(GLenum type, const char *source)
 	glCheckErrors();
 	return shader;
 }
-static vec2 getStringSize(const Font *font, const char *string)
-{
-	vec2 size = vec2(0);
-	float x = 0;
-	float y = 0;
-
-	if (string != NULL && string[0] != 0)
-	{
-		float minx = +Inf, miny = +Inf;
-		float maxx = -Inf, maxy = -Inf;
-
-		//OPTIMIZATION: we really only need to calculate x0, y0 for the first character and x1, y1 for the last character
-		for (int i = 0; string[i] != 0; ++i)
-		{
-			char c0 = string[i + 0];
-			char c1 = string[i + 1];
-			int index = getCharIndex(font, c0);
-
-			float x0 = x + font->xOffset[index];
-			float y0 = y + font->yOffset[index];
-			float x1 = x0 + font->w[index];
-			float y1 = y0 + font->h[index];
-
-			minx = min(minx, x0);
-			miny = min(miny, y0);
-			maxx = max(maxx, x1);
-			maxy = max(maxy, y1);
-
-			x += font->xAdvance[index] + getKerning(font, string[i], string[i + 1]);
-		}
-
-		size.x = maxx - minx;
-		size.y = maxy - miny;
-	}
-
-	return size;
-}
-
 void convertObjToModel(const char *objFilename, const char *outFilename)
 {
-	// see loadModel() for a description of the .model file format.
+	// see readModelData() for a description of the .model file format.
 
 	struct V
 	{
@@ -231,53 +198,59 @@ void convertObjToModel(const char *objFilename, const char *outFilename)
 		}
 	}
 
-	FILE *f = fopen(outFilename, "wb");
-	uint flags = 3;
-	uint numVertices = (uint)outVertices.size();
-	uint numMaterials = (uint)outMaterials.size();
-	uint numObjects = (uint)outObjects.size();
-
-	fwrite(&flags, sizeof(flags), 1, f);
-	fwrite(&numVertices, sizeof(numVertices), 1, f);
-	fwrite(&numMaterials, sizeof(numMaterials), 1, f);
-	fwrite(&numObjects, sizeof(numObjects), 1, f);
-	fwrite(&minAABB, sizeof(minAABB), 1, f);
-	fwrite(&maxAABB, sizeof(maxAABB), 1, f);
-	for (const auto &v : outVertices)
+	ModelData data;
+	data.numVertices = (int)outVertices.size();
+	data.vertices = (Vertex *)malloc(outVertices.size() * sizeof(Vertex));
+	for (int i = 0; i < data.numVertices; ++i)
 	{
-		fwrite(&v.pos, sizeof(v.pos), 1, f);
-		fwrite(&v.normal, sizeof(v.normal), 1, f);
+		data.vertices[i] = Vertex();
+		data.vertices[i].pos = outVertices[i].pos;
+		data.vertices[i].normal = outVertices[i].normal;
 	}
-	for (const auto &m : outMaterials)
+
+	data.numMaterials = (int)outMaterials.size();
+	data.materials = (Material *)malloc(outMaterials.size() * sizeof(Material));
+	for (int i = 0; i < data.numMaterials; ++i)
 	{
-		fwrite(&m.ambient, sizeof(m.ambient), 1, f);
-		fwrite(&m.diffuse, sizeof(m.diffuse), 1, f);
-		fwrite(&m.specular, sizeof(m.specular), 1, f);
-		fwrite(&m.specularExponent, sizeof(m.specularExponent), 1, f);
-		fwrite(&m.alpha, sizeof(m.alpha), 1, f);
+		const M &m = outMaterials[i];
+		data.materials[i].ambientColor = m.ambient;
+		data.materials[i].diffuseColor = m.diffuse;
+		data.materials[i].specularColor = m.specular;
+		data.materials[i].specularExponent = m.specularExponent;
+		data.materials[i].alpha = m.alpha;
 	}
-	for (const auto &o : outObjects)
+
+	data.numObjects = (int)outObjects.size();
+	data.materialIndices = (int *)malloc(outObjects.size() * sizeof(int));
+	data.minAABBs = (vec3 *)malloc(outObjects.size() * sizeof(vec3));
+	data.maxAABBs = (vec3 *)malloc(outObjects.size() * sizeof(vec3));
+	data.numIndices = (int *)malloc(outObjects.size() * sizeof(int));
+	data.indices = (uint **)malloc(outObjects.size() * sizeof(uint *));
+	data.minAABB = minAABB;
+	data.maxAABB = maxAABB;
+	for (int i = 0; i < data.numObjects; ++i)
 	{
-		vec3 minAABB = vec3(+Inf);
-		vec3 maxAABB = vec3(-Inf);
-		for (auto i : o.vertexIndices)
+		const O &o = outObjects[i];
+		data.materialIndices[i] = (int)o.materialIndex;
+		data.minAABBs[i] = vec3(+Inf);
+		data.maxAABBs[i] = vec3(-Inf);
+		for (auto index : o.vertexIndices)
 		{
-			vec3 pos = outVertices[i].pos;
-			minAABB = min(minAABB, pos);
-			maxAABB = max(maxAABB, pos);
+			data.minAABBs[i] = min(data.minAABBs[i], outVertices[index].pos);
+			data.maxAABBs[i] = max(data.maxAABBs[i], outVertices[index].pos);
 		}
 
-		uint numIndices = (uint)o.vertexIndices.size();
-		fwrite(&o.materialIndex, sizeof(o.materialIndex), 1, f);
-		fwrite(&minAABB, sizeof(minAABB), 1, f);
-		fwrite(&maxAABB, sizeof(maxAABB), 1, f);
-		fwrite(&numIndices, sizeof(numIndices), 1, f);
-		fwrite(&o.vertexIndices[0], sizeof(o.vertexIndices[0]), numIndices, f);
+		data.numIndices[i] = (int)o.vertexIndices.size();
+		data.indices[i] = (uint *)malloc(o.vertexIndices.size() * sizeof(uint));
+		memcpy(data.indices[i], o.vertexIndices.data(), o.vertexIndices.size() * sizeof(uint));
 	}
-	fclose(f);
+
+	if (!writeModelData(outFilename, &data))
+		fprintf(stderr, "ERROR: failed to write '%s'\n", outFilename);
+	freeModelData(&data);
 }
 
-CompositeModel *loadModel(const char *filename)
+bool readModelData(const char *filename, ModelData *data)
 {
 	/*
 	.model custom file format
@@ -323,89 +296,265 @@ CompositeModel *loadModel(const char *filename)
 	*/
 
 	FILE *f = fopen(filename, "rb");
-	if (f)
+	if (!f)
+		return false;
+
+	uint flags, numVertices, numMaterials, numObjects;
+	fread(&flags, sizeof(flags), 1, f);
+	fread(&numVertices, sizeof(numVertices), 1, f);
+	fread(&numMaterials, sizeof(numMaterials), 1, f);
+	fread(&numObjects, sizeof(numObjects), 1, f);
+	fread(&data->minAABB, sizeof(data->minAABB), 1, f);
+	fread(&data->maxAABB, sizeof(data->maxAABB), 1, f);
+
+	data->numVertices = (int)numVertices;
+	data->vertices = (Vertex *)malloc(numVertices * sizeof(Vertex));
+	data->numMaterials = (int)numMaterials;
+	data->materials = (Material *)malloc(numMaterials * sizeof(Material));
+	data->numObjects = (int)numObjects;
+	data->materialIndices = (int *)malloc(numObjects * sizeof(int));
+	data->minAABBs = (vec3 *)malloc(numObjects * sizeof(vec3));
+	data->maxAABBs = (vec3 *)malloc(numObjects * sizeof(vec3));
+	data->numIndices = (int *)malloc(numObjects * sizeof(int));
+	data->indices = (uint **)malloc(numObjects * sizeof(uint *));
+
+	for (uint i = 0; i < numVertices; ++i)
 	{
-		CompositeModel *model = (CompositeModel *)malloc(sizeof(CompositeModel));
-		uint flags, numVertices, numMaterials, numObjects;
-		fread(&flags, sizeof(flags), 1, f);
-		fread(&numVertices, sizeof(numVertices), 1, f);
-		fread(&numMaterials, sizeof(numMaterials), 1, f);
-		fread(&numObjects, sizeof(numObjects), 1, f);
-		fread(&model->minAABB, sizeof(model->minAABB), 1, f);
-		fread(&model->maxAABB, sizeof(model->maxAABB), 1, f);
-
-		model->numMaterials = (int)numMaterials;
-		model->materials = (Material *)malloc(numMaterials * sizeof(Material));
-		model->numModels = (int)numObjects;
-		model->meshes = (Mesh *)malloc(numObjects * sizeof(Mesh));
-		model->localTransforms = (Transform *)malloc(numObjects * sizeof(Transform));
-		model->materialIndices = (int *)malloc(numObjects * sizeof(int));
-		model->transform = Transform();
-		model->minAABBs = (vec3 *)malloc(numObjects * sizeof(vec3));
-		model->maxAABBs = (vec3 *)malloc(numObjects * sizeof(vec3));
-
-		Vertex *vertices = (Vertex *)malloc(numVertices * sizeof(*vertices));
-		for (uint i = 0; i < numVertices; ++i)
-		{
-			vec3 pos, normal;
-			fread(&pos, sizeof(pos), 1, f);
-			fread(&normal, sizeof(normal), 1, f);
-			
-			vertices[i].pos = pos;
-			vertices[i].normal = normal;
-			vertices[i].tangent = vec3(0);
-			vertices[i].uv = vec2(0);
-			vertices[i].color = vec4(1);
-		}
-		GpuBuffer vertexBuffer = createGpuBuffer(vertices, numVertices * sizeof(*vertices));
-		free(vertices);
+		vec3 pos, normal;
+		fread(&pos, sizeof(pos), 1, f);
+		fread(&normal, sizeof(normal), 1, f);
+
+		data->vertices[i].pos = pos;
+		data->vertices[i].normal = normal;
+		data->vertices[i].tangent = vec3(0);
+		data->vertices[i].uv = vec2(0);
+		data->vertices[i].color = vec4(1);
+	}
 
-		for (uint i = 0; i < numMaterials; ++i)
-		{
-			vec3 ambient, diffuse, specular;
-			float specularExponent, alpha;
-			fread(&ambient, sizeof(ambient), 1, f);
-			fread(&diffuse, sizeof(diffuse), 1, f);
-			fread(&specular, sizeof(specular), 1, f);
-			fread(&specularExponent, sizeof(specularExponent), 1, f);
-			fread(&alpha, sizeof(alpha), 1, f);
-
-			model->materials[i].ambientColor = ambient;
-			model->materials[i].diffuseColor = diffuse;
-			model->materials[i].specularColor = specular;
-			model->materials[i].specularExponent = specularExponent;
-			model->materials[i].alpha = alpha;
-		}
+	for (uint i = 0; i < numMaterials; ++i)
+	{
+		vec3 ambient, diffuse, specular;
+		float specularExponent, alpha;
+		fread(&ambient, sizeof(ambient), 1, f);
+		fread(&diffuse, sizeof(diffuse), 1, f);
+		fread(&specular, sizeof(specular), 1, f);
+		fread(&specularExponent, sizeof(specularExponent), 1, f);
+		fread(&alpha, sizeof(alpha), 1, f);
+
+		data->materials[i].ambientColor = ambient;
+		data->materials[i].diffuseColor = diffuse;
+		data->materials[i].specularColor = specular;
+		data->materials[i].specularExponent = specularExponent;
+		data->materials[i].alpha = alpha;
+	}
+
+	for (uint i = 0; i < numObjects; ++i)
+	{
+		uint materialIndex;
+		uint numIndices;
+		fread(&materialIndex, sizeof(materialIndex), 1, f);
+		fread(&data->minAABBs[i], sizeof(data->minAABBs[i]), 1, f);
+		fread(&data->maxAABBs[i], sizeof(data->maxAABBs[i]), 1, f);
+		fread(&numIndices, sizeof(numIndices), 1, f);
+
+		data->materialIndices[i] = (int)materialIndex;
+		data->numIndices[i] = (int)numIndices;
+		data->indices[i] = (uint *)malloc(numIndices * sizeof(uint));
+		fread(data->indices[i], sizeof(uint), numIndices, f);
+	}
+
+	fclose(f);
+	return true;
+}
+
+bool writeModelData(const char *filename, const ModelData *data)
+{
+	// see readModelData() for a description of the .model file format.
+
+	FILE *f = fopen(filename, "wb");
+	if (!f)
+		return false;
+
+	uint flags = 3;
+	uint numVertices = (uint)data->numVertices;
+	uint numMaterials = (uint)data->numMaterials;
+	uint numObjects = (uint)data->numObjects;
+
+	fwrite(&flags, sizeof(flags), 1, f);
+	fwrite(&numVertices, sizeof(numVertices), 1, f);
+	fwrite(&numMaterials, sizeof(numMaterials), 1, f);
+	fwrite(&numObjects, sizeof(numObjects), 1, f);
+	fwrite(&data->minAABB, sizeof(data->minAABB), 1, f);
+	fwrite(&data->maxAABB, sizeof(data->maxAABB), 1, f);
+	for (uint i = 0; i < numVertices; ++i)
+	{
+		fwrite(&data->vertices[i].pos, sizeof(vec3), 1, f);
+		fwrite(&data->vertices[i].normal, sizeof(vec3), 1, f);
+	}
+	for (uint i = 0; i < numMaterials; ++i)
+	{
+		const Material &m = data->materials[i];
+		fwrite(&m.ambientColor, sizeof(m.ambientColor), 1, f);
+		fwrite(&m.diffuseColor, sizeof(m.diffuseColor), 1, f);
+		fwrite(&m.specularColor, sizeof(m.specularColor), 1, f);
+		fwrite(&m.specularExponent, sizeof(m.specularExponent), 1, f);
+		fwrite(&m.alpha, sizeof(m.alpha), 1, f);
+	}
+	for (uint i = 0; i < numObjects; ++i)
+	{
+		uint materialIndex = (uint)data->materialIndices[i];
+		uint numIndices = (uint)data->numIndices[i];
+		fwrite(&materialIndex, sizeof(materialIndex), 1, f);
+		fwrite(&data->minAABBs[i], sizeof(data->minAABBs[i]), 1, f);
+		fwrite(&data->maxAABBs[i], sizeof(data->maxAABBs[i]), 1, f);
+		fwrite(&numIndices, sizeof(numIndices), 1, f);
+		fwrite(data->indices[i], sizeof(uint), numIndices, f);
+	}
+
+	bool ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
+
+void freeModelData(ModelData *data)
+{
+	for (int i = 0; i < data->numObjects; ++i)
+		free(data->indices[i]);
+	free(data->vertices);
+	free(data->materials);
+	free(data->materialIndices);
+	free(data->minAABBs);
+	free(data->maxAABBs);
+	free(data->numIndices);
+	free(data->indices);
+	*data = ModelData();
+}
+
+TransformHierarchy *createTransformHierarchy(int initialCapacity)
+{
+	TransformHierarchy *hierarchy = (TransformHierarchy *)calloc(1, sizeof(TransformHierarchy));
+	hierarchy->capacity = max(initialCapacity, 1);
+	hierarchy->parents = (int *)malloc(hierarchy->capacity * sizeof(int));
+	hierarchy->depths = (int *)malloc(hierarchy->capacity * sizeof(int));
+	hierarchy->positions = (vec3 *)malloc(hierarchy->capacity * sizeof(vec3));
+	hierarchy->scales = (vec3 *)malloc(hierarchy->capacity * sizeof(vec3));
+	hierarchy->rotations = (quat *)malloc(hierarchy->capacity * sizeof(quat));
+	hierarchy->worldMatrices = (mat4 *)malloc(hierarchy->capacity * sizeof(mat4));
+	hierarchy->flags = (uint8_t *)malloc(hierarchy->capacity * sizeof(uint8_t));
+	return hierarchy;
+}
+
+int addTransform(TransformHierarchy *hierarchy, int parent, const Transform &local)
+{
+	assert(parent < hierarchy->numNodes);
+
+	if (hierarchy->numNodes == hierarchy->capacity)
+	{
+		hierarchy->capacity *= 2;
+		hierarchy->parents = (int *)realloc(hierarchy->parents, hierarchy->capacity * sizeof(int));
+		hierarchy->depths = (int *)realloc(hierarchy->depths, hierarchy->capacity * sizeof(int));
+		hierarchy->positions = (vec3 *)realloc(hierarchy->positions, hierarchy->capacity * sizeof(vec3));
+		hierarchy->scales = (vec3 *)realloc(hierarchy->scales, hierarchy->capacity * sizeof(vec3));
+		hierarchy->rotations = (quat *)realloc(hierarchy->rotations, hierarchy->capacity * sizeof(quat));
+		hierarchy->worldMatrices = (mat4 *)realloc(hierarchy->worldMatrices, hierarchy->capacity * sizeof(mat4));
+		hierarchy->flags = (uint8_t *)realloc(hierarchy->flags, hierarchy->capacity * sizeof(uint8_t));
+	}
+
+	int node = hierarchy->numNodes++;
+	hierarchy->parents[node] = parent;
+	hierarchy->depths[node] = parent >= 0 ? hierarchy->depths[parent] + 1 : 0;
+	hierarchy->maxDepth = max(hierarchy->maxDepth, hierarchy->depths[node]);
+	hierarchy->worldMatrices[node] = mat4(1);
+	hierarchy->flags[node] = 0;
+	setLocalTransform(hierarchy, node, local);
+	return node;
+}
+
+// Updates the nodes in [begin, end) at the given depth, or at any depth if it's negative.
+static int updateTransformRange(TransformHierarchy *hierarchy, int begin, int end, int depth)
+{
+	// parents come first, so a parent's flags are already this update's when its children get to them
+	int numUpdated = 0;
+	for (int node = begin; node < end; ++node)
+	{
+		if (depth >= 0 && hierarchy->depths[node] != depth)
+			continue;
 
-		for (uint i = 0; i < numObjects; ++i)
+		int parent = hierarchy->parents[node];
+		bool parentChanged = parent >= 0 && (hierarchy->flags[parent] & TransformChanged);
+		if (!(hierarchy->flags[node] & TransformDirty) && !parentChanged)
 		{
-			uint materialIndex;
-			uint numIndices;
-			vec3 minAABB, maxAABB;
-			fread(&materialIndex, sizeof(materialIndex), 1, f);
-			fread(&minAABB, sizeof(minAABB), 1, f);
-			fread(&maxAABB, sizeof(maxAABB), 1, f);
-			fread(&numIndices, sizeof(numIndices), 1, f);
-			
-			uint *indices = (uint *)malloc(numIndices * sizeof(indices));
-			fread(indices, sizeof(*indices), numIndices, f);
-			model->meshes[i] = createMesh(vertexBuffer, numVertices, indices, numIndices);
-			model->materialIndices[i] = materialIndex;
-			model->localTransforms[i] = Transform();
-			model->localTransforms[i].parent = &model->transform;
-			model->minAABBs[i] = minAABB;
-			model->maxAABBs[i] = maxAABB;
-			free(indices);
+			hierarchy->flags[node] = 0;
+			continue;
 		}
 
-		fclose(f);
-		return model;
+		mat4 local = getLocalTransform(hierarchy, node).getLocalMatrix();
+		hierarchy->worldMatrices[node] = parent >= 0 ? hierarchy->worldMatrices[parent] * local : local;
+		hierarchy->flags[node] = TransformChanged;
+		++numUpdated;
 	}
-	else
+	return numUpdated;
+}
+
+void updateTransforms(TransformHierarchy *hierarchy)
+{
+	// a small hierarchy is done long before the workers would even wake up
+	if (hierarchy->numNodes < TransformJobGrainSize || getNumJobThreads() == 1)
+	{
+		hierarchy->numUpdated = updateTransformRange(hierarchy, 0, hierarchy->numNodes, -1);
+		return;
+	}
+
+	// every node only depends on its parent, so all the nodes at one depth can go in parallel
+	std::atomic<int> numUpdated(0);
+	for (int depth = 0; depth <= hierarchy->maxDepth; ++depth)
+	{
+		parallelFor(hierarchy->numNodes, TransformJobGrainSize, [&](int begin, int end)
+		{
+			numUpdated += updateTransformRange(hierarchy, begin, end, depth);
+		});
+	}
+	hierarchy->numUpdated = numUpdated;
+}
+
+CompositeModel *loadModel(const char *filename, TransformHierarchy *hierarchy)
+{
+	CPU_PROFILE("load model");
+
+	ModelData data;
+	if (!readModelData(filename, &data))
 		return NULL;
+
+	CompositeModel *model = (CompositeModel *)malloc(sizeof(CompositeModel));
+	model->minAABB = data.minAABB;
+	model->maxAABB = data.maxAABB;
+	model->numMaterials = data.numMaterials;
+	model->materials = data.materials;
+	model->numModels = data.numObjects;
+	model->meshes = (Mesh *)malloc(data.numObjects * sizeof(Mesh));
+	model->localTransforms = (int *)malloc(data.numObjects * sizeof(int));
+	model->materialIndices = data.materialIndices;
+	model->transform = addTransform(hierarchy, -1);
+	model->minAABBs = data.minAABBs;
+	model->maxAABBs = data.maxAABBs;
+
+	GpuBuffer vertexBuffer = createGpuBuffer(data.vertices, data.numVertices * sizeof(Vertex));
+	for (int i = 0; i < data.numObjects; ++i)
+	{
+		model->meshes[i] = createMesh(vertexBuffer, data.numVertices, data.indices[i], data.numIndices[i]);
+		model->localTransforms[i] = addTransform(hierarchy, model->transform);
+	}
+
+	// the model keeps the materials and bounds
+	data.materials = NULL;
+	data.materialIndices = NULL;
+	data.minAABBs = NULL;
+	data.maxAABBs = NULL;
+	freeModelData(&data);
+	return model;
 }
 
-CompositeModel *loadModelObj(const char *objFilename)
+CompositeModel *loadModelObj(const char *objFilename, TransformHierarchy *hierarchy)
 {
 	tinyobj::attrib_t attrib;
 	std::vector<tinyobj::shape_t> shapes;
@@ -434,14 +583,13 @@ CompositeModel *loadModelObj(const char *objFilename)
 		model->numModels = (int)shapes.size();
 		model->meshes = (Mesh *)malloc(shapes.size() * sizeof(Mesh));
 		model->materialIndices = (int *)malloc(shapes.size() * sizeof(int));
-		model->localTransforms = (Transform *)malloc(shapes.size() * sizeof(Transform));
+		model->localTransforms = (int *)malloc(shapes.size() * sizeof(int));
 		model->materials = (Material *)malloc(shapes.size() * sizeof(Material));
-		model->transform = Transform();
+		model->transform = addTransform(hierarchy, -1);
 
 		for (int meshIdx = 0; meshIdx < model->numModels; ++meshIdx)
 		{
-			model->localTransforms[meshIdx] = Transform();
-			model->localTransforms[meshIdx].parent = &model->transform;
+			model->localTransforms[meshIdx] = addTransform(hierarchy, model->transform);
 			
 			tinyobj::mesh_t data = shapes[meshIdx].mesh;
 			uint *indices = (uint *)malloc(data.indices.size() * sizeof(uint));
@@ -522,29 +670,27 @@ CompositeModel *loadModelObj(const char *objFilename)
 		return NULL;
 }
 
-CompositeModel *copyModel(const CompositeModel *model)
+CompositeModel *copyModel(const CompositeModel *model, TransformHierarchy *hierarchy)
 {
 	const CompositeModel *original = model;
 	CompositeModel *copy = (CompositeModel *)malloc(sizeof(CompositeModel));
 	memcpy(copy, original, sizeof(CompositeModel));
 	
-	copy->localTransforms = (Transform *)malloc(original->numModels * sizeof(Transform));
-	memcpy(copy->localTransforms, original->localTransforms, original->numModels * sizeof(Transform));
+	// the copy gets its own nodes with the same local transforms
+	copy->transform = addTransform(hierarchy, -1, getLocalTransform(hierarchy, original->transform));
+	copy->localTransforms = (int *)malloc(original->numModels * sizeof(int));
 	for (int i = 0; i < copy->numModels; ++i)
-	{
-		if (copy->localTransforms[i].parent == &original->transform)
-			copy->localTransforms[i].parent = &copy->transform;
-	}
+		copy->localTransforms[i] = addTransform(hierarchy, copy->transform, getLocalTransform(hierarchy, original->localTransforms[i]));
 
 	return copy;
 }
 
-Model createModel(const Vertex *vertices, int numVertices, const uint *indices, int numIndices)
+Model createModel(const Vertex *vertices, int numVertices, const uint *indices, int numIndices, TransformHierarchy *hierarchy)
 {
 	Model model;
 	model.mesh = createMesh(vertices, numVertices, indices, numIndices);
 	model.material = Material();
-	model.transform = Transform();
+	model.transform = addTransform(hierarchy, -1);
 
 	model.minAABB = vec3(+Inf);
 	model.maxAABB = vec3(-Inf);
@@ -621,6 +767,7 @@ Texture loadTexture(
 	GLenum wrapT,
 	bool genMipmaps)
 {
+	CPU_PROFILE("load texture");
 	Texture texture = 0;
 
 	int width, height, comp;
@@ -691,6 +838,7 @@ CubeMap loadCubeMap(
 	GLenum magFilter,
 	bool genMipmaps)
 {
+	CPU_PROFILE("load cube map");
 	CubeMap cubeMap;
 	glGenTextures(1, &cubeMap);
 
@@ -845,7 +993,7 @@ Framebuffer createFramebuffer(Texture colorAttachment, Texture depthAttachment)
 		if (colorAttachment != 0)
 			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorAttachment, 0);
 		if (depthAttachment != 0)
-			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorAttachment, 0);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthAttachment, 0);
 	}
 	else 
 		fprintf(stderr, "OpenGL failed to allocate framebuffer\n");
@@ -914,24 +1062,62 @@ LightProbe createShadowProbe(
 	return probe;
 }
 
+void freeLightProbe(LightProbe *probe)
+{
+	glDeleteFramebuffers(6, probe->framebuffers);
+	if (probe->colorMap)
+		glDeleteTextures(1, &probe->colorMap);
+	if (probe->depthMap)
+		glDeleteTextures(1, &probe->depthMap);
+	*probe = LightProbe();
+}
+
 Spotlight createSpotlight(
 	vec3 pos,
 	vec3 dir,
 	vec3 color,
-	int shadowMapResolution)
+	float innerCutoffRadians,
+	float outerCutoffRadians,
+	vec3 attenuation,
+	bool castsShadows)
 {
-	auto angleBetween = [](vec3 a, vec3 b)
-	{
-		return acos(dot(a, b) / sqrt(lengthSq(a) * lengthSq(b)));
-	};
+	// lights are cut off once they fall below this intensity
+	constexpr float LightCutoffIntensity = 0.01f;
+	// the shaders fade between the cutoffs, so they have to differ
+	assert(innerCutoffRadians < outerCutoffRadians);
 
 	Spotlight spotlight;
-	//float rotY = angleBetween(vec3(1, 0, 0), vec3(dir))
+	spotlight.pos = pos;
+	spotlight.dir = normalize(dir);
+	spotlight.color = color;
+	spotlight.innerCutoffRadians = innerCutoffRadians;
+	spotlight.outerCutoffRadians = outerCutoffRadians;
+	spotlight.constantAttenuation = attenuation.x;
+	spotlight.linearAttenutation = attenuation.y;
+	spotlight.quadraticAttenuation = attenuation.z;
+	spotlight.castsShadows = castsShadows;
+
+	// any vector that isn't parallel to the direction will do
+	vec3 notParallel = fabs(spotlight.dir.y) < 0.99f ? vec3(0, 1, 0) : vec3(1, 0, 0);
+	spotlight.up = normalize(cross(cross(spotlight.dir, notParallel), spotlight.dir));
+
+	// solve: intensity / (constant + linear * d + quadratic * d^2) = cutoff
+	float c = spotlight.constantAttenuation - max(color.r, max(color.g, color.b)) / LightCutoffIntensity;
+	float b = spotlight.linearAttenutation;
+	float a = spotlight.quadraticAttenuation;
+	if (a > 0)
+		spotlight.range = (-b + sqrt(b * b - 4 * a * c)) / (2 * a);
+	else if (b > 0)
+		spotlight.range = -c / b;
+	else
+		spotlight.range = FarPlane;
+
 	return spotlight;
 }
 
 ShaderProgram loadShaderProgram(const char *vertFilename, const char *fragFilename)
 {
+	CPU_PROFILE("load shader program");
 	char *vertSrc = readWholeFile(vertFilename);
 	char *fragSrc = readWholeFile(fragFilename);
 	ShaderProgram shader = 0;
@@ -952,311 +1138,1708 @@ ShaderProgram loadShaderProgram(const char *vertFilename, const char *fragFilena
 	return shader;
 }
 
-ShaderProgram createShaderProgram(
-	const GLenum *types,
-	const char *const *sources,
-	int numSources)
+ShaderProgram loadComputeShaderProgram(const char *filename)
 {
-	ShaderProgram program = glCreateProgram();
-	if (program != 0)
-	{
-		// I need a workaround for Intel GPUs
-
-		GLuint *shaders = (GLuint *)malloc(numSources * sizeof(GLuint));
-		bool allComponentsCompiledOk = true;
-		for (int i = 0; i < numSources; ++i)
-		{
-			shaders[i] = createShader(types[i], sources[i]);
-			if (!shaders[i])
-				allComponentsCompiledOk = false;
-		}
+	CPU_PROFILE("load compute shader");
+	char *source = readWholeFile(filename);
+	ShaderProgram shader = 0;
 
-		GLint linkOk = 0;
-		if (allComponentsCompiledOk)
-		{
-			for (int i = 0; i < numSources; ++i)
-				glAttachShader(program, shaders[i]);
+	if (source == NULL)
+		fprintf(stderr, "couldn't read compute shader file '%s'\n", filename);
+	else
+	{
+		GLenum type = GL_COMPUTE_SHADER;
+		shader = createShaderProgram(&type, &source, 1);
+	}
 
-			//NOTE: if youre getting a segfault here on intel, check to make sure your
-			// shader code is 100% correct. Run it through glslang or something. Intel
-			// drivers like to crash when the shader code is incorrect.
-			glLinkProgram(program);
+	free(source);
+	return shader;
+}
 
-			glGetProgramiv(program, GL_LINK_STATUS, &linkOk);
-			if (!linkOk)
-			{
-				GLint logLength;
-				glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLength);
-				char *log = (char *)malloc((size_t)logLength);
-				glGetProgramInfoLog(program, logLength, NULL, (GLchar *)log);
-				fprintf(stderr, "GLSLC: %s", log);
-				free(log);
-			}
+// Program binary cache
+// --------------------
+// Linked programs are saved to ShaderCacheDirectory and loaded back with glProgramBinary on the
+// next launch. Files are named after a hash of everything that goes into the program plus the
+// driver's vendor/renderer/version strings, so any change to those just misses the cache.
+// Binaries the driver rejects are silently compiled from source again.
 
-			for (int i = 0; i < numSources; ++i)
-			{
-				glDetachShader(program, shaders[i]);
-				glDeleteShader(shaders[i]);
-			}
-		}
+static const char *const ShaderCacheDirectory = "shader-cache";
+constexpr uint32_t ShaderCacheMagic = 0x31434853; // "SHC1"
+constexpr int MaxShaderStages = 4;
 
-		free(shaders);
+// from GL_KHR_parallel_shader_compile, which glad's GLenum doesn't have
+constexpr GLenum CompletionStatus = (GLenum)0x91B1;
 
-		if (!linkOk)
-			glClearErrors();
-	} 
-	else
-		fprintf(stderr, "OpenGL failed to allocate shader program");
+struct ShaderCacheHeader
+{
+	uint32_t magic;
+	uint32_t binaryFormat;
+	uint64_t key;
+	uint32_t binarySize;
+	uint32_t compileMicroseconds; // how long compiling from source took, to report the time the cache saves
+};
+
+struct PendingShaderProgram
+{
+	ShaderProgram program;
+	GLuint shaders[MaxShaderStages];
+	int numShaders;
+	uint64_t key;
+	uint64_t startTime;
+	double compileSeconds; // stored with the binary, set before finishShaderProgram()
+	bool fromCache;
+};
+
+ShaderCacheStats shaderCacheStats;
+
+static bool isGLExtensionSupported(const char *name)
+{
+	GLint numExtensions = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+	for (GLint i = 0; i < numExtensions; ++i)
+	{
+		if (strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), name) == 0)
+			return true;
+	}
+	return false;
+}
 
-	glCheckErrors();
-	return program;
+static void initShaderCompiler()
+{
+	static bool initialized = false;
+	if (initialized)
+		return;
+	initialized = true;
+
+	// glad wasn't generated with these, they are the same function under two names
+	typedef void (APIENTRY *MaxShaderCompilerThreadsProc)(GLuint count);
+	MaxShaderCompilerThreadsProc maxShaderCompilerThreads = NULL;
+	if (isGLExtensionSupported("GL_KHR_parallel_shader_compile"))
+		maxShaderCompilerThreads = (MaxShaderCompilerThreadsProc)getGLProcAddress("glMaxShaderCompilerThreadsKHR");
+	else if (isGLExtensionSupported("GL_ARB_parallel_shader_compile"))
+		maxShaderCompilerThreads = (MaxShaderCompilerThreadsProc)getGLProcAddress("glMaxShaderCompilerThreadsARB");
+
+	if (maxShaderCompilerThreads)
+	{
+		maxShaderCompilerThreads(0xFFFFFFFF); // as many threads as the driver likes
+		shaderCacheStats.parallelCompile = true;
+	}
 }
 
-GpuBuffer createGpuBuffer(
-	const void *data,
-	size_t numBytes,
-	GLenum usage)
+static uint64_t getShaderCacheKey(
+	const GLenum *types,
+	const char *const *sources,
+	int numSources,
+	const char *const *defines,
+	int numDefines)
 {
-	GpuBuffer buffer;
-	glGenBuffers(1, &buffer);
+	const char *driverStrings[] = {
+		(const char *)glGetString(GL_VENDOR),
+		(const char *)glGetString(GL_RENDERER),
+		(const char *)glGetString(GL_VERSION),
+	};
 
-	if (buffer)
+	uint64_t key = hashBytes(&numSources, sizeof(numSources));
+	for (int i = 0; i < numSources; ++i)
 	{
-		glBindBuffer(GL_ARRAY_BUFFER, buffer);
-		glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)numBytes, data, usage);
+		key = hashBytes(&types[i], sizeof(types[i]), key);
+		key = hashBytes(sources[i], strlen(sources[i]) + 1, key);
+	}
+	for (int i = 0; i < numDefines; ++i)
+		key = hashBytes(defines[i], strlen(defines[i]) + 1, key);
+	for (int i = 0; i < (int)countof(driverStrings); ++i)
+	{
+		if (driverStrings[i])
+			key = hashBytes(driverStrings[i], strlen(driverStrings[i]) + 1, key);
 	}
-	else
-		fprintf(stderr, "OpenGL failed to allocate a %zu byte buffer", numBytes);
 
-	glCheckErrors();
-	return buffer;
+	return key;
 }
 
-void drawString(
-	const Font *font,
-	const char *string,
-	vec2 position,
-	bool center,
-	vec2 scale,
-	vec4 color,
-	float rotationRadians)
+static void getShaderCacheFilename(uint64_t key, char *filename, size_t maxLength)
+{
+	snprintf(filename, maxLength, "%s/%016llx.bin", ShaderCacheDirectory, (unsigned long long)key);
+}
+
+static bool loadProgramBinary(ShaderProgram program, uint64_t key, uint32_t *outCompileMicroseconds)
 {
-	struct TextVertex
+	char filename[256];
+	getShaderCacheFilename(key, filename, sizeof(filename));
+
+	size_t size;
+	char *contents = readWholeFile(filename, &size);
+	if (contents == NULL)
+		return false;
+
+	ShaderCacheHeader header;
+	bool ok = size >= sizeof(header);
+	if (ok)
 	{
-		vec2 pos;
-		vec2 uv;
-		vec4 color;
-	};
-	
-	constexpr int TextBufferSize = 512;
-	static TextVertex vertices[TextBufferSize * 4];
-	static uint16_t indices[TextBufferSize * 6];
-	static GpuBuffer vertexBuffer = createGpuBuffer(NULL, sizeof(vertices), GL_STREAM_DRAW);
-	static GpuBuffer indexBuffer = createGpuBuffer(NULL, sizeof(indices), GL_STREAM_DRAW);
-	static ShaderProgram shader = loadShaderProgram("assets/shaders/text.vert.glsl", "assets/shaders/text.frag.glsl");
-	static VertexSpecification vertexSpec = 0;
-
-	if (vertexSpec == 0)
-	{
-		glGenVertexArrays(1, &vertexSpec);
-		if (vertexSpec != 0)
-		{
-			glBindVertexArray(vertexSpec);
-			glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
-			glEnableVertexAttribArray(0);
-			glEnableVertexAttribArray(1);
-			glEnableVertexAttribArray(2);
-			glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void *)offsetof(TextVertex, pos));
-			glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void *)offsetof(TextVertex, uv));
-			glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void *)offsetof(TextVertex, color));
-			glBindVertexArray(0);
-		}
-		else
-			fprintf(stderr, "OpenGL failed to allocate vertex array object\n");
+		memcpy(&header, contents, sizeof(header));
+		ok = header.magic == ShaderCacheMagic && header.key == key && header.binarySize == size - sizeof(header);
 	}
 
-	int length = (int)strlen(string);
-	assert(length < TextBufferSize);
+	// passing a format the driver doesn't know about is an error, so check first
+	if (ok)
+	{
+		GLint numFormats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+		std::vector<GLint> formats(numFormats > 0 ? numFormats : 1);
+		if (numFormats > 0)
+			glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, formats.data());
+
+		ok = false;
+		for (int i = 0; i < numFormats; ++i)
+			ok |= (uint32_t)formats[i] == header.binaryFormat;
+	}
 
-	vec2 origin = vec2(0);
-	if (center)
+	if (ok)
 	{
-		vec2 size = scale * getStringSize(font, string);
-		origin.x -= size.x / 2;
-		origin.y += size.y / 2;
+		glProgramBinary(program, (GLenum)header.binaryFormat, contents + sizeof(header), (GLsizei)header.binarySize);
+		GLint linkOk = 0;
+		glGetProgramiv(program, GL_LINK_STATUS, &linkOk);
+		ok = linkOk != 0;
+		glClearErrors();
+		*outCompileMicroseconds = header.compileMicroseconds;
 	}
 
-	vec2 pos = origin;
-	int nextVertex = 0;
-	for (int i = 0; i < length; ++i)
+	free(contents);
+	return ok;
+}
+
+static void saveProgramBinary(ShaderProgram program, uint64_t key, uint32_t compileMicroseconds)
+{
+	GLint binarySize = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &binarySize);
+	if (binarySize <= 0)
+		return;
+
+	char *contents = (char *)malloc(sizeof(ShaderCacheHeader) + binarySize);
+	GLenum binaryFormat;
+	glGetProgramBinary(program, binarySize, NULL, &binaryFormat, contents + sizeof(ShaderCacheHeader));
+
+	ShaderCacheHeader header;
+	header.magic = ShaderCacheMagic;
+	header.binaryFormat = binaryFormat;
+	header.key = key;
+	header.binarySize = (uint32_t)binarySize;
+	header.compileMicroseconds = compileMicroseconds;
+	memcpy(contents, &header, sizeof(header));
+
+	char filename[256];
+	getShaderCacheFilename(key, filename, sizeof(filename));
+	writeWholeFile(filename, contents, sizeof(header) + binarySize); // not being able to cache isn't an error
+	free(contents);
+}
+
+// Kicks off compiling and linking but doesn't wait for it to finish.
+static PendingShaderProgram startShaderProgram(
+	const GLenum *types,
+	const char *const *sources,
+	int numSources,
+	const char *const *defines,
+	int numDefines)
+{
+	assert(numSources <= MaxShaderStages);
+	assert(numDefines <= MaxShaderDefines);
+	initShaderCompiler();
+
+	PendingShaderProgram pending = {};
+	pending.startTime = getTimerValue();
+	pending.key = getShaderCacheKey(types, sources, numSources, defines, numDefines);
+	pending.program = glCreateProgram();
+	if (pending.program != 0)
 	{
-		int c = getCharIndex(font, string[i]);
+		uint32_t compileMicroseconds;
+		if (loadProgramBinary(pending.program, pending.key, &compileMicroseconds))
+		{
+			pending.fromCache = true;
+			shaderCacheStats.numCacheHits++;
+			shaderCacheStats.savedSeconds += 1e-6 * compileMicroseconds;
+			return pending;
+		}
 
-		float x0 = pos.x + scale.x * font->xOffset[c];
-		float x1 = x0 + scale.x * font->w[c];
-		float y0 = pos.y + scale.y * font->yOffset[c];
-		float y1 = y0 + scale.y * font->h[c];
-		float u0 = font->x[c] / (float)font->atlasWidth;
-		float v0 = font->y[c] / (float)font->atlasHeight;
-		float u1 = (font->x[c] + font->w[c]) / (float)font->atlasWidth;
-		float v1 = (font->y[c] + font->h[c]) / (float)font->atlasHeight;
+		// I need a workaround for Intel GPUs
 
-		vertices[nextVertex++] = { vec2(x0, y0), vec2(u0, v0), color };
-		vertices[nextVertex++] = { vec2(x1, y0), vec2(u1, v0), color };
-		vertices[nextVertex++] = { vec2(x1, y1), vec2(u1, v1), color };
-		vertices[nextVertex++] = { vec2(x0, y1), vec2(u0, v1), color };
+		for (int i = 0; i < numSources; ++i)
+		{
+			pending.shaders[i] = createShader(types[i], sources[i], defines, numDefines);
+			if (pending.shaders[i])
+				glAttachShader(pending.program, pending.shaders[i]);
+		}
+		pending.numShaders = numSources;
 
-		pos.x += scale.x * (font->xAdvance[c] + getKerning(font, string[i], string[i + 1]));
+		//NOTE: if youre getting a segfault here on intel, check to make sure your
+		// shader code is 100% correct. Run it through glslang or something. Intel
+		// drivers like to crash when the shader code is incorrect.
+		glProgramParameteri(pending.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		glLinkProgram(pending.program);
 	}
+	else
+		fprintf(stderr, "OpenGL failed to allocate shader program");
 
-	int nextIndex = 0;
-	for (int i = 0; i < length; ++i)
-	{
-		int base = i * 4;
-		indices[nextIndex++] = uint16_t(base + 0);
-		indices[nextIndex++] = uint16_t(base + 1);
-		indices[nextIndex++] = uint16_t(base + 2);
-		indices[nextIndex++] = uint16_t(base + 2);
-		indices[nextIndex++] = uint16_t(base + 3);
-		indices[nextIndex++] = uint16_t(base + 0);
-	}
-
-	int numVertices = nextVertex;
-	int numIndices = nextIndex;
-
-	mat4 projection = orthoMatLH(0.0f, (float)windowWidth, (float)windowHeight, 0.0f, -1.0f, 1.0f);
-	mat4 model = translationMat(vec3(position, 0)) * rotationMat(vec3(0, 0, 1), rotationRadians);
-	mat4 mvp = projection * model;
-	glUseProgram(shader);
-	glUniformMatrix4fv(0, 1, GL_FALSE, (GLfloat *)&mvp);
-
-	glBindVertexArray(vertexSpec);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STREAM_DRAW);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STREAM_DRAW);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, font->atlas);
-	glDrawElements(GL_TRIANGLES, (GLsizei)numIndices, GL_UNSIGNED_SHORT, NULL);
+	return pending;
+}
 
-	glCheckErrors();
+// Whether the driver is done with the program, so finishing it won't block. Always true without
+// parallel compiling, the program is then done by the time glLinkProgram() returns anyway.
+static bool isShaderProgramReady(const PendingShaderProgram *pending)
+{
+	if (pending->program == 0 || pending->fromCache || !shaderCacheStats.parallelCompile)
+		return true;
+
+	GLint completed = GL_FALSE;
+	glGetProgramiv(pending->program, CompletionStatus, &completed);
+	return completed == GL_TRUE;
 }
 
-Font *loadFont(const char *filename, float sizeInPixels)
+// Waits for the program to link, reports errors and stores it in the cache.
+static ShaderProgram finishShaderProgram(PendingShaderProgram *pending)
 {
-	char *fontData = readWholeFile(filename);
-	if (fontData)
+	ShaderProgram program = pending->program;
+	if (program != 0 && !pending->fromCache)
 	{
-		stbtt_fontinfo info;
-		if (stbtt_InitFont(&info, (uint8_t *)fontData, 0))
+		GLint linkOk = 0;
+		glGetProgramiv(program, GL_LINK_STATUS, &linkOk);
+		if (!linkOk)
 		{
-			constexpr int FirstChar = 32;
-			constexpr int NumChars = 96;
-			constexpr int AtlasWidth = 512;
-			constexpr int AtlasHeight = 512;
-
-			stbtt_packedchar charInfo[NumChars];
-			uint8_t *atlasPixels = (uint8_t *)malloc(AtlasWidth * AtlasHeight);
-
-			stbtt_pack_context pack;
-			stbtt_PackBegin(&pack, atlasPixels, AtlasWidth, AtlasHeight, 0, 1, NULL);
-			stbtt_PackSetOversampling(&pack, 1, 1);
-			int success = stbtt_PackFontRange(&pack, (uint8_t *)fontData, 0, STBTT_POINT_SIZE(sizeInPixels), FirstChar, NumChars, charInfo);
-			stbtt_PackEnd(&pack);
-
-			if (!success)
-				fprintf(stderr, "couldn't properly pack font '%s'", filename);
-
-			Font *font = (Font *)malloc(sizeof(Font));
-			font->atlas = createTexture(atlasPixels, AtlasWidth, AtlasHeight, GL_RED, GL_RED);
-			free(atlasPixels);
-
-			font->firstChar = FirstChar;
-			font->numChars = NumChars - 1;
-			font->atlasWidth = AtlasWidth;
-			font->atlasHeight = AtlasHeight;
-
-			float scale = stbtt_ScaleForPixelHeight(&info, sizeInPixels);
-			font->kerningScale = scale;
-
-			int ascent, descent, lineGap;
-			stbtt_GetFontVMetrics(&info, &ascent, &descent, &lineGap);
-			font->ascent = scale * ascent;
-			font->descent = scale * descent;
-			font->lineGap = scale * lineGap;
-
-			for (int i = 0; i < NumChars; ++i)
-			{
-				font->x[i] = charInfo[i].x0;
-				font->y[i] = charInfo[i].y0;
-				font->w[i] = uint16_t(charInfo[i].x1 - charInfo[i].x0);
-				font->h[i] = uint16_t(charInfo[i].y1 - charInfo[i].y0);
-				font->xOffset[i] = charInfo[i].xoff;
-				font->yOffset[i] = charInfo[i].yoff;
-				font->xAdvance[i] = charInfo[i].xadvance;
-			}
-
-			int glyphs[NumChars];
-			for (int i = 0; i < NumChars; ++i)
-				glyphs[i] = stbtt_FindGlyphIndex(&info, FirstChar + i);
-
-			int kerningLength = stbtt_GetKerningTableLength(&info);
-			memset(&font->xKerning, 0, sizeof(font->xKerning));
-			if (kerningLength > 0)
+			for (int i = 0; i < pending->numShaders; ++i)
 			{
-				stbtt_kerningentry *kerning = (stbtt_kerningentry *)malloc(kerningLength * sizeof(stbtt_kerningentry));
-				stbtt_GetKerningTable(&info, kerning, kerningLength);
-
-				// Even though this looks like it would be terribly slow it actually isnt that bad.. ~10% of the total font load time
-				for (int charIdx1 = 0; charIdx1 < NumChars; ++charIdx1)
+				GLint shaderOk = 0;
+				glGetShaderiv(pending->shaders[i], GL_COMPILE_STATUS, &shaderOk);
+				if (!shaderOk)
 				{
-					int glyph1 = glyphs[charIdx1];
-					for (int kernIdx1 = 0; kernIdx1 < kerningLength; ++kernIdx1)
-					{
-						if (kerning[kernIdx1].glyph1 == glyph1)
-						{
-							for (int kernIdx2 = kernIdx1; kernIdx2 < kerningLength && kerning[kernIdx2].glyph1 == glyph1; ++kernIdx2)
-							{
-								int glyph2 = kerning[kernIdx2].glyph2;
-								for (int charIdx2 = 0; charIdx2 < NumChars; ++charIdx2)
-								{
-									if (glyph2 == glyphs[charIdx2])
-									{
-										font->xKerning[charIdx1][charIdx2] = int16_t(kerning[kernIdx2].advance);
-										break;
-									}
-								}
-							}
-						}
-
-						if (kerning[kernIdx1].glyph1 >= glyph1)
-							break;
-					}
+					GLint logLength;
+					glGetShaderiv(pending->shaders[i], GL_INFO_LOG_LENGTH, &logLength);
+					char *log = (char *)malloc((size_t)logLength + 1);
+					glGetShaderInfoLog(pending->shaders[i], logLength, NULL, (GLchar *)log);
+					log[logLength] = 0;
+					fprintf(stderr, "GLSL error: %s\n", log);
+					free(log);
 				}
-
-				free(kerning);
 			}
 
-			free(fontData);
-			return font;
+			GLint logLength;
+			glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLength);
+			char *log = (char *)malloc((size_t)logLength + 1);
+			glGetProgramInfoLog(program, logLength, NULL, (GLchar *)log);
+			log[logLength] = 0;
+			fprintf(stderr, "GLSLC: %s", log);
+			free(log);
 		}
-		else
+
+		for (int i = 0; i < pending->numShaders; ++i)
 		{
-			free(fontData);
-			fprintf(stderr, "couldn't load font from '%s'", filename);
-			return NULL;
+			if (pending->shaders[i])
+			{
+				glDetachShader(program, pending->shaders[i]);
+				glDeleteShader(pending->shaders[i]);
+			}
 		}
-	}
-	else
-	{
-		fprintf(stderr, "couldn't read font file '%s'", filename);
-		return NULL;
-	}
-}
 
-bool shaderIsValid(ShaderProgram program)
+		if (linkOk)
+			saveProgramBinary(program, pending->key, (uint32_t)(1e6 * pending->compileSeconds));
+		else
+			glClearErrors();
+	}
+
+	shaderCacheStats.numPrograms++;
+	glCheckErrors();
+	return program;
+}
+
+// finishShaderProgram() for a program that's compiled on its own, its compile time is all its own.
+static ShaderProgram waitForShaderProgram(PendingShaderProgram *pending)
+{
+	if (pending->program != 0 && !pending->fromCache)
+	{
+		GLint linkOk;
+		glGetProgramiv(pending->program, GL_LINK_STATUS, &linkOk); // blocks until it's done
+		pending->compileSeconds = getDeltaTime(pending->startTime, getTimerValue());
+		shaderCacheStats.compileSeconds += pending->compileSeconds;
+	}
+	return finishShaderProgram(pending);
+}
+
+ShaderProgram createShaderProgram(
+	const GLenum *types,
+	const char *const *sources,
+	int numSources,
+	const char *const *defines,
+	int numDefines)
+{
+	PendingShaderProgram pending = startShaderProgram(types, sources, numSources, defines, numDefines);
+	return waitForShaderProgram(&pending);
+}
+
+ShaderVariants *loadShaderVariants(
+	const char *vertFilename,
+	const char *fragFilename,
+	const char *const *defines,
+	int numDefines)
+{
+	assert(numDefines <= MaxShaderDefines);
+
+	char *vertSrc = readWholeFile(vertFilename);
+	char *fragSrc = readWholeFile(fragFilename);
+	if (vertSrc == NULL || fragSrc == NULL)
+	{
+		if (vertSrc == NULL)
+			fprintf(stderr, "couldn't read vertex shader file '%s'\n", vertFilename);
+		else
+			fprintf(stderr, "couldn't read fragment shader file '%s'\n", fragFilename);
+
+		// no sources, so every variant stays program 0 like loadShaderProgram() returns
+		free(vertSrc);
+		free(fragSrc);
+		vertSrc = fragSrc = NULL;
+	}
+
+	ShaderVariants *variants = (ShaderVariants *)calloc(1, sizeof(ShaderVariants));
+	variants->vertSrc = vertSrc;
+	variants->fragSrc = fragSrc;
+	variants->numDefines = numDefines;
+	for (int i = 0; i < numDefines; ++i)
+		variants->defines[i] = defines[i];
+	return variants;
+}
+
+static PendingShaderProgram startShaderVariant(ShaderVariants *variants, uint32_t key)
+{
+	assert(key < (1u << variants->numDefines));
+
+	const char *defines[MaxShaderDefines];
+	int numDefines = 0;
+	for (int i = 0; i < variants->numDefines; ++i)
+	{
+		if (key & (1u << i))
+			defines[numDefines++] = variants->defines[i];
+	}
+
+	GLenum types[] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+	const char *sources[] = { variants->vertSrc, variants->fragSrc };
+	return startShaderProgram(types, sources, countof(sources), defines, numDefines);
+}
+
+ShaderProgram getShaderVariant(ShaderVariants *variants, uint32_t key)
+{
+	assert(key < (1u << variants->numDefines));
+
+	if (variants->programs[key] == 0 && variants->vertSrc)
+	{
+		PendingShaderProgram pending = startShaderVariant(variants, key);
+		variants->programs[key] = waitForShaderProgram(&pending);
+	}
+
+	return variants->programs[key];
+}
+
+void compileShaderVariants(const ShaderVariantRef *refs, int numRefs)
+{
+	CPU_PROFILE("compile shader variants");
+	// start everything before waiting on anything, so parallel compiling drivers can overlap them
+	uint64_t batchStart = getTimerValue();
+	std::vector<PendingShaderProgram> pending(numRefs);
+	std::vector<bool> finished(numRefs, true);
+	int numUnfinished = 0;
+	for (int i = 0; i < numRefs; ++i)
+	{
+		if (refs[i].variants->programs[refs[i].key] == 0 && refs[i].variants->vertSrc)
+		{
+			pending[i] = startShaderVariant(refs[i].variants, refs[i].key);
+			finished[i] = pending[i].program == 0;
+			numUnfinished += finished[i] ? 0 : 1;
+		}
+	}
+
+	// finish the programs in the order the driver completes them. The compiles overlap, so each
+	// is charged the wall clock time since the previous one completed, which adds up to the time
+	// the whole batch took instead of counting the overlap several times
+	uint64_t lastCompletion = batchStart;
+	while (numUnfinished > 0)
+	{
+		bool anyReady = false;
+		for (int i = 0; i < numRefs; ++i)
+		{
+			if (finished[i] || !isShaderProgramReady(&pending[i]))
+				continue;
+
+			if (!pending[i].fromCache)
+			{
+				GLint linkOk;
+				glGetProgramiv(pending[i].program, GL_LINK_STATUS, &linkOk); // makes sure it's done without the extension
+				uint64_t now = getTimerValue();
+				pending[i].compileSeconds = getDeltaTime(lastCompletion, now);
+				shaderCacheStats.compileSeconds += pending[i].compileSeconds;
+				lastCompletion = now;
+			}
+			refs[i].variants->programs[refs[i].key] = finishShaderProgram(&pending[i]);
+			finished[i] = true;
+			--numUnfinished;
+			anyReady = true;
+		}
+
+		if (!anyReady)
+			std::this_thread::yield();
+	}
+}
+
+GpuBuffer createGpuBuffer(
+	const void *data,
+	size_t numBytes,
+	GLenum usage)
+{
+	GpuBuffer buffer;
+	glGenBuffers(1, &buffer);
+
+	if (buffer)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)numBytes, data, usage);
+	}
+	else
+		fprintf(stderr, "OpenGL failed to allocate a %zu byte buffer", numBytes);
+
+	glCheckErrors();
+	return buffer;
+}
+
+// Glyph cache
+// -----------
+// Fonts only rasterize the glyphs that are actually drawn, the first time they're laid out, into
+// an atlas made of rows ("shelves") that fill up left to right. A glyph goes into the first shelf
+// that's high enough without being much higher. When there's no room left the least recently used
+// shelf that nothing of the current frame is in gets emptied and reused, so the atlas stays at
+// GlyphAtlasSize squared however many different characters are drawn. The atlas is kept on the
+// CPU too, the rows that changed are uploaded when the text is drawn.
+//
+// The printable ASCII glyphs are rasterized at load and go into the font cache together with the
+// kerning pairs between them, everything else is looked up in the TrueType font, which is only
+// read once something outside of those is needed.
+//
+// Layout first walks the string with the cache locked shared, which is all it takes once its
+// glyphs and kerning pairs are in there, so the labels laid out on the job system don't wait for
+// each other. Only when something is missing is the string walked again with the lock exclusive,
+// which is what adding to the cache, rasterizing, evicting and uploading take.
+
+constexpr uint32_t FirstPreloadedChar = 32;
+constexpr uint32_t NumPreloadedChars = 95; // up to '~'
+constexpr int16_t NoShelf = -1;            // not rasterized yet, or evicted
+constexpr int16_t EmptyGlyphShelf = -2;    // nothing to rasterize, like a space
+constexpr uint32_t ReplacementCharacter = 0xFFFD;
+constexpr int MaxGlyphShelves = GlyphAtlasSize / 2; // a glyph is at least a pixel high, plus the padding
+
+struct FontGlyph
+{
+	uint32_t codepoint;
+	int index;          // in the TrueType font, 0 is its "missing glyph" box
+	uint16_t x, y;      // top left corner in the atlas in pixels - divide by the atlas size before use!
+	uint16_t w, h;      // size in the atlas in pixels
+	float xOffset;      // x-position relative to the cursor where to begin drawing the glyph
+	float yOffset;      // y-position above the baseline where to begin drawing the glyph
+	float xAdvance;     // how many fractional pixels to advance the cursor after the glyph
+	int16_t shelf;      // index into GlyphCache::shelves, or NoShelf/EmptyGlyphShelf
+	bool preloaded;     // its kerning with the other preloaded glyphs is in GlyphCache::kerning
+};
+
+struct GlyphShelf
+{
+	int y;
+	int height;
+	int nextX;
+};
+
+struct FontKerning
+{
+	uint32_t glyphs;    // first glyph index << 16 | second glyph index
+	int16_t advance;    // multiply by kerningScale before use!
+};
+
+struct GlyphCache
+{
+	std::shared_mutex lock; // layoutString() is called from the job system
+	std::vector<FontGlyph> glyphs;
+	std::unordered_map<uint32_t, int> glyphIndices; // codepoint -> glyphs
+	std::vector<GlyphShelf> shelves;
+	std::atomic<uint32_t> shelfLastUsed[MaxGlyphShelves]; // text frame a glyph on it was last laid out in, set with the lock shared
+	int nextShelfY;
+	std::vector<FontKerning> kerning;                  // between preloaded glyphs, sorted
+	std::unordered_map<uint32_t, int16_t> moreKerning; // every other pair, as they're looked up
+	uint8_t *atlasPixels;
+	int dirtyMinY, dirtyMaxY; // rows changed since the last upload, none if min > max
+
+	char *filename;
+	char *fontData; // NULL until the TrueType font is needed
+	stbtt_fontinfo info;
+	bool fontFailed;
+	bool reportedFull;
+	std::atomic<uint32_t> evictions; // shelves emptied so far, the UVs of retained layouts are stale when it changes
+};
+
+// Advanced by flushText(), glyphs of the current frame are never evicted.
+static std::atomic<uint32_t> textFrame{ 1 };
+
+static bool loadFontData(GlyphCache *cache)
+{
+	if (cache->fontData || cache->fontFailed)
+		return cache->fontData != NULL;
+
+	CPU_PROFILE("read font file");
+	cache->fontData = readWholeFile(cache->filename);
+	if (!cache->fontData)
+		fprintf(stderr, "couldn't read font file '%s'", cache->filename);
+	else if (!stbtt_InitFont(&cache->info, (uint8_t *)cache->fontData, 0))
+	{
+		fprintf(stderr, "couldn't load font from '%s'", cache->filename);
+		free(cache->fontData);
+		cache->fontData = NULL;
+	}
+	cache->fontFailed = cache->fontData == NULL;
+	return !cache->fontFailed;
+}
+
+// Keeps the shelf from being evicted this frame.
+static void markShelfUsed(GlyphCache *cache, int16_t shelf)
+{
+	uint32_t frame = textFrame;
+	if (cache->shelfLastUsed[shelf].load(std::memory_order_relaxed) != frame)
+		cache->shelfLastUsed[shelf].store(frame, std::memory_order_relaxed);
+}
+
+static void markAtlasRowsDirty(GlyphCache *cache, int y, int height)
+{
+	cache->dirtyMinY = min(cache->dirtyMinY, y);
+	cache->dirtyMaxY = max(cache->dirtyMaxY, y + height - 1);
+}
+
+// Finds room for a w x h glyph, with a pixel to the right and below so the bilinear filter never
+// reaches into a neighbor. Returns the shelf or NoShelf if everything is in use this frame.
+static int16_t allocateGlyphSpace(GlyphCache *cache, int w, int h, int *x, int *y)
+{
+	int paddedW = w + 1;
+	int paddedH = h + 1;
+	int shelf = -1;
+	for (int i = 0; i < (int)cache->shelves.size() && shelf < 0; ++i)
+	{
+		const GlyphShelf &s = cache->shelves[i];
+		if (s.height >= paddedH && s.height <= paddedH + paddedH / 4 + 2 && s.nextX + paddedW <= GlyphAtlasSize)
+			shelf = i;
+	}
+
+	if (shelf < 0 && cache->nextShelfY + paddedH <= GlyphAtlasSize && paddedW <= GlyphAtlasSize && (int)cache->shelves.size() < MaxGlyphShelves)
+	{
+		cache->shelfLastUsed[cache->shelves.size()] = 0;
+		cache->shelves.push_back({ cache->nextShelfY, paddedH, 0 });
+		cache->nextShelfY += paddedH;
+		shelf = (int)cache->shelves.size() - 1;
+	}
+
+	if (shelf < 0)
+	{
+		// evict the least recently used shelf that's high enough
+		uint32_t frame = textFrame;
+		uint32_t shelfLastUsed = 0;
+		for (int i = 0; i < (int)cache->shelves.size(); ++i)
+		{
+			uint32_t lastUsed = cache->shelfLastUsed[i];
+			if (cache->shelves[i].height >= paddedH && lastUsed < frame && (shelf < 0 || lastUsed < shelfLastUsed))
+			{
+				shelf = i;
+				shelfLastUsed = lastUsed;
+			}
+		}
+		if (shelf < 0 || paddedW > GlyphAtlasSize)
+			return NoShelf;
+
+		for (FontGlyph &glyph : cache->glyphs)
+		{
+			if (glyph.shelf == shelf)
+				glyph.shelf = NoShelf;
+		}
+		GlyphShelf &s = cache->shelves[shelf];
+		s.nextX = 0;
+		++cache->evictions;
+		memset(cache->atlasPixels + s.y * GlyphAtlasSize, 0, s.height * GlyphAtlasSize);
+		markAtlasRowsDirty(cache, s.y, s.height);
+	}
+
+	GlyphShelf &s = cache->shelves[shelf];
+	*x = s.nextX;
+	*y = s.y;
+	s.nextX += paddedW;
+	return (int16_t)shelf;
+}
+
+static void rasterizeGlyph(const Font *font, GlyphCache *cache, FontGlyph *glyph)
+{
+	if (!loadFontData(cache))
+		return;
+
+	constexpr int Padding = FontDistanceFieldPadding;
+	constexpr float DistanceScale = 127.0f / Padding; // the field goes from 0 to 1 over Padding pixels on either side of the edge
+
+	int w = 0, h = 0, xOffset = 0, yOffset = 0;
+	uint8_t *field = NULL;
+	if (font->distanceField)
+		field = stbtt_GetGlyphSDF(&cache->info, font->glyphScale, glyph->index, Padding, 128, DistanceScale, &w, &h, &xOffset, &yOffset);
+	else
+	{
+		int x1, y1;
+		stbtt_GetGlyphBitmapBox(&cache->info, glyph->index, font->glyphScale, font->glyphScale, &xOffset, &yOffset, &x1, &y1);
+		w = x1 - xOffset;
+		h = y1 - yOffset;
+	}
+
+	glyph->xOffset = (float)xOffset;
+	glyph->yOffset = (float)yOffset;
+	glyph->w = uint16_t(max(w, 0));
+	glyph->h = uint16_t(max(h, 0));
+	if (w <= 0 || h <= 0)
+	{
+		glyph->w = glyph->h = 0;
+		glyph->shelf = EmptyGlyphShelf;
+		stbtt_FreeSDF(field, NULL);
+		return;
+	}
+
+	int x, y;
+	glyph->shelf = allocateGlyphSpace(cache, w, h, &x, &y);
+	if (glyph->shelf == NoShelf)
+	{
+		if (!cache->reportedFull)
+			fprintf(stderr, "ERROR: the glyph atlas of '%s' is full, some text won't be drawn\n", cache->filename);
+		cache->reportedFull = true;
+		stbtt_FreeSDF(field, NULL);
+		return;
+	}
+
+	glyph->x = uint16_t(x);
+	glyph->y = uint16_t(y);
+	uint8_t *pixels = cache->atlasPixels + y * GlyphAtlasSize + x;
+	if (field)
+	{
+		for (int row = 0; row < h; ++row)
+			memcpy(pixels + row * GlyphAtlasSize, field + row * w, w);
+		stbtt_FreeSDF(field, NULL);
+	}
+	else
+		stbtt_MakeGlyphBitmap(&cache->info, pixels, w, h, GlyphAtlasSize, font->glyphScale, font->glyphScale, glyph->index);
+	markAtlasRowsDirty(cache, y, h);
+}
+
+// The glyph, rasterized into the atlas unless that's full. Only valid until the next call. With
+// the cache locked shared it's NULL instead when the glyph would have to be added or rasterized.
+static const FontGlyph *getGlyph(const Font *font, GlyphCache *cache, uint32_t codepoint, bool exclusive)
+{
+	FontGlyph *glyph;
+	auto found = cache->glyphIndices.find(codepoint);
+	if (found != cache->glyphIndices.end())
+		glyph = &cache->glyphs[found->second];
+	else if (!exclusive)
+		return NULL;
+	else
+	{
+		FontGlyph newGlyph = {};
+		newGlyph.codepoint = codepoint;
+		newGlyph.shelf = NoShelf;
+		if (loadFontData(cache))
+		{
+			int advance, leftSideBearing;
+			newGlyph.index = stbtt_FindGlyphIndex(&cache->info, (int)codepoint);
+			stbtt_GetGlyphHMetrics(&cache->info, newGlyph.index, &advance, &leftSideBearing);
+			newGlyph.xAdvance = font->glyphScale * advance;
+		}
+		cache->glyphIndices[codepoint] = (int)cache->glyphs.size();
+		cache->glyphs.push_back(newGlyph);
+		glyph = &cache->glyphs.back();
+	}
+
+	if (glyph->shelf == NoShelf)
+	{
+		if (!exclusive)
+			return NULL;
+		rasterizeGlyph(font, cache, glyph);
+	}
+
+	if (glyph->shelf >= 0)
+		markShelfUsed(cache, glyph->shelf);
+	return glyph;
+}
+
+// The one place kerning comes from, for the preloaded table and for every other pair. stb_truetype
+// only reads a legacy kern table when the font has no GPOS, and its GPOS reader skips the lookup
+// types some fonts keep all their pairs in, so a pair GPOS says nothing about falls back to kern.
+static int16_t getGlyphKernAdvance(const stbtt_fontinfo *info, int glyph1, int glyph2)
+{
+	int advance = stbtt_GetGlyphKernAdvance(info, glyph1, glyph2);
+	if (advance == 0 && info->gpos && info->kern)
+		advance = stbtt__GetGlyphKernInfoAdvance(info, glyph1, glyph2);
+	return (int16_t)advance;
+}
+
+// False if the pair isn't in the cache yet and it's only locked shared.
+static bool getKerning(const Font *font, GlyphCache *cache, const FontGlyph &glyph1, const FontGlyph &glyph2, bool exclusive, float *kerning)
+{
+	uint32_t key = (uint32_t)glyph1.index << 16 | (uint32_t)glyph2.index;
+	int16_t advance = 0;
+	if (glyph1.preloaded && glyph2.preloaded)
+	{
+		auto found = std::lower_bound(cache->kerning.begin(), cache->kerning.end(), key, [](const FontKerning &k, uint32_t key) { return k.glyphs < key; });
+		if (found != cache->kerning.end() && found->glyphs == key)
+			advance = found->advance;
+	}
+	else
+	{
+		auto found = cache->moreKerning.find(key);
+		if (found != cache->moreKerning.end())
+			advance = found->second;
+		else if (!exclusive)
+			return false;
+		else if (loadFontData(cache))
+		{
+			advance = getGlyphKernAdvance(&cache->info, glyph1.index, glyph2.index);
+			cache->moreKerning[key] = advance;
+		}
+	}
+	*kerning = font->kerningScale * advance;
+	return true;
+}
+
+// Invalid sequences decode to U+FFFD, one byte at a time.
+static uint32_t decodeUtf8(const char **string)
+{
+	const uint8_t *s = (const uint8_t *)*string;
+	uint32_t codepoint = s[0];
+	int length = 1;
+	if (s[0] >= 0xF0 && s[0] < 0xF8)
+		codepoint = s[0] & 0x07, length = 4;
+	else if (s[0] >= 0xE0)
+		codepoint = s[0] & 0x0F, length = 3;
+	else if (s[0] >= 0xC0)
+		codepoint = s[0] & 0x1F, length = 2;
+	else if (s[0] >= 0x80)
+		length = 0;
+
+	for (int i = 1; i < length; ++i)
+	{
+		if ((s[i] & 0xC0) != 0x80)
+		{
+			length = 0;
+			break;
+		}
+		codepoint = (codepoint << 6) | (s[i] & 0x3F);
+	}
+
+	if (length == 0)
+	{
+		*string += 1;
+		return ReplacementCharacter;
+	}
+	*string += length;
+	return codepoint;
+}
+
+// Uploads the atlas rows rasterized since the last call, needs the OpenGL context.
+static void updateFontAtlas(const Font *font)
+{
+	GlyphCache *cache = font->glyphs;
+	std::unique_lock<std::shared_mutex> lock(cache->lock);
+	if (cache->dirtyMinY > cache->dirtyMaxY || !font->atlas)
+		return;
+
+	int rows = cache->dirtyMaxY - cache->dirtyMinY + 1;
+	glBindTexture(GL_TEXTURE_2D, font->atlas);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, cache->dirtyMinY, GlyphAtlasSize, rows, GL_RED, GL_UNSIGNED_BYTE, cache->atlasPixels + cache->dirtyMinY * GlyphAtlasSize);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	cache->dirtyMinY = GlyphAtlasSize;
+	cache->dirtyMaxY = -1;
+}
+
+static float getLineHeight(const Font *font)
+{
+	return font->ascent - font->descent + font->lineGap;
+}
+
+// Size of the glyph boxes, the cache has to be locked. False if it's only locked shared and
+// something is missing from it.
+static bool measureString(const Font *font, const char *string, bool exclusive, vec2 *size)
+{
+	GlyphCache *cache = font->glyphs;
+	*size = vec2(0);
+	if (string == NULL || string[0] == 0)
+		return true;
+
+	float minx = +Inf, miny = +Inf;
+	float maxx = -Inf, maxy = -Inf;
+	float x = 0, y = 0;
+	bool lineStart = true;
+	FontGlyph previous = {};
+	for (const char *s = string; *s; )
+	{
+		if (*s == '\n')
+		{
+			x = 0;
+			y += getLineHeight(font);
+			lineStart = true;
+			++s;
+			continue;
+		}
+
+		const FontGlyph *found = getGlyph(font, cache, decodeUtf8(&s), exclusive);
+		if (!found)
+			return false;
+		FontGlyph glyph = *found;
+		float kerning = 0;
+		if (!lineStart && !getKerning(font, cache, previous, glyph, exclusive, &kerning))
+			return false;
+		x += kerning;
+		lineStart = false;
+
+		float x0 = x + glyph.xOffset;
+		float y0 = y + glyph.yOffset;
+		minx = min(minx, x0);
+		miny = min(miny, y0);
+		maxx = max(maxx, x0 + glyph.w);
+		maxy = max(maxy, y0 + glyph.h);
+
+		x += glyph.xAdvance;
+		previous = glyph;
+	}
+	if (minx <= maxx) // not only newlines
+		*size = vec2(maxx - minx, maxy - miny);
+	return true;
+}
+
+vec2 getStringSize(const Font *font, const char *string)
+{
+	GlyphCache *cache = font->glyphs;
+	vec2 size;
+	{
+		std::shared_lock<std::shared_mutex> lock(cache->lock);
+		if (measureString(font, string, false, &size))
+			return size;
+	}
+	std::unique_lock<std::shared_mutex> lock(cache->lock);
+	measureString(font, string, true, &size);
+	return size;
+}
+
+// layoutString() with the cache locked, also collects the shelves the glyphs are on if asked to.
+// Centering shifts the quads once the extent of each line and of all of them is known, so the
+// string is only walked once. -1 if the cache is only locked shared and something is missing.
+static int layoutGlyphs(const Font *font, const char *string, bool center, vec2 scale, vec4 color, bool exclusive, TextVertex *vertices, std::vector<int16_t> *shelves)
+{
+	GlyphCache *cache = font->glyphs;
+	vec2 pos = vec2(0);
+	int nextVertex = 0;
+	int lineStartVertex = 0;
+	bool lineStart = true;
+	float lineMinX = +Inf, lineMaxX = -Inf;
+	float minY = +Inf, maxY = -Inf;
+	FontGlyph previous = {};
+	for (const char *s = string; ; )
+	{
+		if (*s == '\n' || *s == 0)
+		{
+			if (center && lineMinX <= lineMaxX)
+			{
+				float shift = -0.5f * (lineMaxX - lineMinX);
+				for (int i = lineStartVertex; i < nextVertex; ++i)
+					vertices[i].pos.x += shift;
+			}
+			if (*s == 0)
+				break;
+
+			pos.x = 0;
+			pos.y += scale.y * getLineHeight(font);
+			lineStartVertex = nextVertex;
+			lineStart = true;
+			lineMinX = +Inf, lineMaxX = -Inf;
+			++s;
+			continue;
+		}
+
+		const FontGlyph *found = getGlyph(font, cache, decodeUtf8(&s), exclusive);
+		if (!found)
+			return -1;
+		FontGlyph glyph = *found;
+		float kerning = 0;
+		if (!lineStart && !getKerning(font, cache, previous, glyph, exclusive, &kerning))
+			return -1;
+		pos.x += scale.x * kerning;
+		lineStart = false;
+		previous = glyph;
+
+		float x0 = pos.x + scale.x * glyph.xOffset;
+		float x1 = x0 + scale.x * glyph.w;
+		float y0 = pos.y + scale.y * glyph.yOffset;
+		float y1 = y0 + scale.y * glyph.h;
+		lineMinX = min(lineMinX, x0);
+		lineMaxX = max(lineMaxX, x1);
+		minY = min(minY, y0);
+		maxY = max(maxY, y1);
+		pos.x += scale.x * glyph.xAdvance;
+
+		// whitespace, or what didn't fit into the atlas
+		if (glyph.shelf < 0)
+			continue;
+
+		if (shelves && std::find(shelves->begin(), shelves->end(), glyph.shelf) == shelves->end())
+			shelves->push_back(glyph.shelf);
+
+		float u0 = glyph.x / (float)font->atlasWidth;
+		float v0 = glyph.y / (float)font->atlasHeight;
+		float u1 = (glyph.x + glyph.w) / (float)font->atlasWidth;
+		float v1 = (glyph.y + glyph.h) / (float)font->atlasHeight;
+
+		vertices[nextVertex++] = { vec2(x0, y0), vec2(u0, v0), color };
+		vertices[nextVertex++] = { vec2(x1, y0), vec2(u1, v0), color };
+		vertices[nextVertex++] = { vec2(x1, y1), vec2(u1, v1), color };
+		vertices[nextVertex++] = { vec2(x0, y1), vec2(u0, v1), color };
+	}
+
+	if (center && minY <= maxY)
+	{
+		float shift = 0.5f * (maxY - minY);
+		for (int i = 0; i < nextVertex; ++i)
+			vertices[i].pos.y += shift;
+	}
+	return nextVertex;
+}
+
+// Takes the lock exclusively only if the shared walk found something missing.
+static int layoutGlyphsLocked(const Font *font, const char *string, bool center, vec2 scale, vec4 color, TextVertex *vertices, std::vector<int16_t> *shelves)
+{
+	GlyphCache *cache = font->glyphs;
+	{
+		std::shared_lock<std::shared_mutex> lock(cache->lock);
+		int numVertices = layoutGlyphs(font, string, center, scale, color, false, vertices, shelves);
+		if (numVertices >= 0)
+			return numVertices;
+	}
+	std::unique_lock<std::shared_mutex> lock(cache->lock);
+	if (shelves)
+		shelves->clear();
+	return layoutGlyphs(font, string, center, scale, color, true, vertices, shelves);
+}
+
+int layoutString(const Font *font, const char *string, bool center, vec2 scale, vec4 color, TextVertex *vertices)
+{
+	return layoutGlyphsLocked(font, string, center, scale, color, vertices, NULL);
+}
+
+// Retained text
+// -------------
+// A TextLayout keeps the quads of its string, which are only laid out again when the string
+// changes or when the atlas evicted a shelf since, which might have held one of its glyphs.
+// Drawing it marks the shelves its glyphs are on as used, which is all the glyph cache needs to
+// keep them. The quads are still copied into the text batch every frame, they have to be moved
+// and rotated anyway and it keeps all text in one draw call.
+//
+// drawString() keeps a TextLayout per (font, string, scale, color, centering) it's called with,
+// found by a hash of those, and drops the ones that weren't drawn for TextLayoutCacheFrames. A
+// string only gets one the second time it's drawn, the first time it's laid out into a scratch
+// buffer, so a string that changes every frame doesn't allocate a layout every frame. Past
+// MaxCachedTextLayouts everything new is laid out into the scratch buffer.
+
+constexpr uint32_t TextLayoutCacheFrames = 60;
+constexpr size_t MaxCachedTextLayouts = 256;
+constexpr int RecentTextKeys = 256; // direct mapped by the hash, the strings drawn once lately
+
+struct TextLayout
+{
+	const Font *font;
+	bool center;
+	vec2 scale;
+	vec4 color;
+	char *string;
+	uint32_t evictions;             // of the glyph cache when it was laid out
+	std::vector<TextVertex> vertices;
+	int numVertices;
+	std::vector<int16_t> shelves;   // the ones the glyphs are on
+	uint32_t lastDrawn;             // text frame, only used by drawString()'s cache
+};
+
+static void updateTextLayout(TextLayout *layout)
+{
+	// every codepoint takes at least a byte and is at most a quad
+	size_t length = strlen(layout->string);
+	if (layout->vertices.size() < 4 * length)
+		layout->vertices.resize(4 * length);
+
+	// read first, an eviction while laying out only means it's laid out again next time
+	layout->evictions = layout->font->glyphs->evictions;
+	layout->shelves.clear();
+	layout->numVertices = layoutGlyphsLocked(layout->font, layout->string, layout->center, layout->scale, layout->color, layout->vertices.data(), &layout->shelves);
+}
+
+TextLayout *createTextLayout(const Font *font, bool center, vec2 scale, vec4 color)
+{
+	TextLayout *layout = new TextLayout();
+	layout->font = font;
+	layout->center = center;
+	layout->scale = scale;
+	layout->color = color;
+	layout->string = strdup("");
+	return layout;
+}
+
+bool setTextLayoutString(TextLayout *layout, const char *string)
+{
+	if (strcmp(layout->string, string) == 0)
+		return false;
+
+	free(layout->string);
+	layout->string = strdup(string);
+	updateTextLayout(layout);
+	return true;
+}
+
+vec2 getTextLayoutSize(const TextLayout *layout)
+{
+	return getStringSize(layout->font, layout->string);
+}
+
+void drawTextLayout(TextLayout *layout, vec2 position, float rotationRadians)
+{
+	GlyphCache *cache = layout->font->glyphs;
+	bool current;
+	{
+		// checked under the lock so nothing is evicted between that and marking the shelves used
+		std::shared_lock<std::shared_mutex> lock(cache->lock);
+		current = layout->evictions == cache->evictions;
+		if (current)
+		{
+			for (int16_t shelf : layout->shelves)
+				markShelfUsed(cache, shelf);
+		}
+	}
+	if (!current)
+		updateTextLayout(layout);
+	drawTextVertices(layout->font, layout->vertices.data(), layout->numVertices, position, rotationRadians);
+}
+
+void freeTextLayout(TextLayout *layout)
+{
+	if (!layout)
+		return;
+
+	free(layout->string);
+	delete layout;
+}
+
+static std::unordered_map<uint64_t, TextLayout *> textLayoutCache;
+static uint64_t recentTextKeys[RecentTextKeys];
+static std::vector<TextVertex> textScratch; // drawString()'s quads of strings without a TextLayout
+
+// Drops what drawString() didn't use for a while.
+static void trimTextLayoutCache()
+{
+	uint32_t frame = textFrame;
+	for (auto i = textLayoutCache.begin(); i != textLayoutCache.end(); )
+	{
+		if (frame - i->second->lastDrawn > TextLayoutCacheFrames)
+		{
+			freeTextLayout(i->second);
+			i = textLayoutCache.erase(i);
+		}
+		else
+			++i;
+	}
+}
+
+// Font cache
+// ----------
+// Rasterizing the preloaded glyphs and filling the kerning table is nearly all of the time loading
+// a font takes, so the glyph cache right after that is saved to FontCacheDirectory and mapped back
+// in on the next launch. Files are named after a hash of the font file's name, size and
+// modification time and of everything that goes into the atlas, so a hit doesn't even have to read
+// the TTF, and a changed font just misses the cache.
+
+static const char *const FontCacheDirectory = "font-cache";
+constexpr uint32_t FontCacheMagic = 0x34434E46; // "FNC4"
+
+struct FontCacheHeader
+{
+	uint32_t magic;
+	uint64_t key;
+	float glyphScale;
+	float ascent;
+	float descent;
+	float lineGap;
+	float kerningScale;
+	int32_t numGlyphs;
+	int32_t numShelves;
+	int32_t nextShelfY;
+	int32_t numKerningPairs;
+	// followed by the glyphs, the shelves, the kerning pairs and the atlas pixels
+};
+
+// 0 if the font file doesn't exist.
+static uint64_t getFontCacheKey(const char *filename, float sizeInPixels, bool distanceField)
+{
+	struct stat fileInfo;
+	if (stat(filename, &fileInfo) != 0)
+		return 0;
+
+	int64_t fileSize = (int64_t)fileInfo.st_size;
+	int64_t modifiedTime = (int64_t)fileInfo.st_mtime;
+	int layout[] = { FontDistanceFieldPadding, GlyphAtlasSize, (int)sizeof(FontGlyph), (int)sizeof(GlyphShelf) };
+
+	uint64_t key = hashBytes(filename, strlen(filename) + 1);
+	key = hashBytes(&fileSize, sizeof(fileSize), key);
+	key = hashBytes(&modifiedTime, sizeof(modifiedTime), key);
+	key = hashBytes(&sizeInPixels, sizeof(sizeInPixels), key);
+	key = hashBytes(&distanceField, sizeof(distanceField), key);
+	key = hashBytes(layout, sizeof(layout), key);
+	return key;
+}
+
+static void getFontCacheFilename(uint64_t key, char *filename, size_t maxLength)
+{
+	snprintf(filename, maxLength, "%s/%016llx.font", FontCacheDirectory, (unsigned long long)key);
+}
+
+static size_t getFontCacheSize(const FontCacheHeader &header)
+{
+	return sizeof(header) +
+		header.numGlyphs * sizeof(FontGlyph) +
+		header.numShelves * sizeof(GlyphShelf) +
+		header.numKerningPairs * sizeof(FontKerning) +
+		GlyphAtlasSize * GlyphAtlasSize;
+}
+
+static bool loadCachedFont(uint64_t key, Font *font)
+{
+	char filename[256];
+	getFontCacheFilename(key, filename, sizeof(filename));
+
+	size_t size;
+	const uint8_t *contents = (const uint8_t *)mapWholeFile(filename, &size);
+	if (contents == NULL)
+		return false;
+
+	FontCacheHeader header;
+	bool ok = size >= sizeof(header);
+	if (ok)
+	{
+		memcpy(&header, contents, sizeof(header));
+		ok = header.magic == FontCacheMagic && header.key == key && header.numGlyphs >= 0 && header.numShelves >= 0 && header.numShelves <= MaxGlyphShelves &&
+			header.numKerningPairs >= 0 && size == getFontCacheSize(header);
+	}
+
+	if (ok)
+	{
+		GlyphCache *cache = font->glyphs;
+		font->glyphScale = header.glyphScale;
+		font->ascent = header.ascent;
+		font->descent = header.descent;
+		font->lineGap = header.lineGap;
+		font->kerningScale = header.kerningScale;
+
+		const uint8_t *next = contents + sizeof(header);
+		const FontGlyph *glyphs = (const FontGlyph *)next;
+		cache->glyphs.assign(glyphs, glyphs + header.numGlyphs);
+		next += header.numGlyphs * sizeof(FontGlyph);
+		const GlyphShelf *shelves = (const GlyphShelf *)next;
+		cache->shelves.assign(shelves, shelves + header.numShelves);
+		next += header.numShelves * sizeof(GlyphShelf);
+		const FontKerning *kerning = (const FontKerning *)next;
+		cache->kerning.assign(kerning, kerning + header.numKerningPairs);
+		next += header.numKerningPairs * sizeof(FontKerning);
+		memcpy(cache->atlasPixels, next, GlyphAtlasSize * GlyphAtlasSize);
+		cache->nextShelfY = header.nextShelfY;
+
+		for (int i = 0; i < header.numGlyphs; ++i)
+			cache->glyphIndices[cache->glyphs[i].codepoint] = i;
+	}
+
+	unmapFile(contents, size);
+	return ok;
+}
+
+static void saveCachedFont(uint64_t key, const Font *font)
+{
+	const GlyphCache *cache = font->glyphs;
+	FontCacheHeader header = {};
+	header.magic = FontCacheMagic;
+	header.key = key;
+	header.glyphScale = font->glyphScale;
+	header.ascent = font->ascent;
+	header.descent = font->descent;
+	header.lineGap = font->lineGap;
+	header.kerningScale = font->kerningScale;
+	header.numGlyphs = (int32_t)cache->glyphs.size();
+	header.numShelves = (int32_t)cache->shelves.size();
+	header.nextShelfY = cache->nextShelfY;
+	header.numKerningPairs = (int32_t)cache->kerning.size();
+
+	size_t size = getFontCacheSize(header);
+	uint8_t *contents = (uint8_t *)malloc(size);
+	uint8_t *next = contents;
+	memcpy(next, &header, sizeof(header));
+	next += sizeof(header);
+	memcpy(next, cache->glyphs.data(), header.numGlyphs * sizeof(FontGlyph));
+	next += header.numGlyphs * sizeof(FontGlyph);
+	memcpy(next, cache->shelves.data(), header.numShelves * sizeof(GlyphShelf));
+	next += header.numShelves * sizeof(GlyphShelf);
+	memcpy(next, cache->kerning.data(), header.numKerningPairs * sizeof(FontKerning));
+	next += header.numKerningPairs * sizeof(FontKerning);
+	memcpy(next, cache->atlasPixels, GlyphAtlasSize * GlyphAtlasSize);
+
+	char filename[256];
+	getFontCacheFilename(key, filename, sizeof(filename));
+	writeWholeFile(filename, contents, size); // not being able to cache isn't an error
+	free(contents);
+}
+
+// Rasterizes the preloaded glyphs and collects the kerning pairs between them.
+static bool preloadGlyphs(Font *font, float sizeInPixels)
+{
+	GlyphCache *cache = font->glyphs;
+	if (!loadFontData(cache))
+		return false;
+
+	// the glyphs are as big as STBTT_POINT_SIZE makes them, the kerning and the line metrics are scaled by the pixel height
+	font->glyphScale = stbtt_ScaleForMappingEmToPixels(&cache->info, sizeInPixels);
+	float scale = stbtt_ScaleForPixelHeight(&cache->info, sizeInPixels);
+	font->kerningScale = scale;
+
+	int ascent, descent, lineGap;
+	stbtt_GetFontVMetrics(&cache->info, &ascent, &descent, &lineGap);
+	font->ascent = scale * ascent;
+	font->descent = scale * descent;
+	font->lineGap = scale * lineGap;
+
+	std::vector<int> preloadedIndices;
+	for (uint32_t c = FirstPreloadedChar; c < FirstPreloadedChar + NumPreloadedChars; ++c)
+	{
+		getGlyph(font, cache, c, true);
+		FontGlyph &glyph = cache->glyphs[cache->glyphIndices[c]];
+		glyph.preloaded = true;
+		preloadedIndices.push_back(glyph.index);
+	}
+	std::sort(preloadedIndices.begin(), preloadedIndices.end());
+	preloadedIndices.erase(std::unique(preloadedIndices.begin(), preloadedIndices.end()), preloadedIndices.end());
+
+	for (int index1 : preloadedIndices)
+	{
+		for (int index2 : preloadedIndices)
+		{
+			int16_t advance = getGlyphKernAdvance(&cache->info, index1, index2);
+			if (advance != 0)
+				cache->kerning.push_back({ (uint32_t)index1 << 16 | (uint32_t)index2, advance });
+		}
+	}
+	std::sort(cache->kerning.begin(), cache->kerning.end(), [](const FontKerning &a, const FontKerning &b) { return a.glyphs < b.glyphs; });
+	return true;
+}
+
+static Font *loadFontAtlas(const char *filename, float sizeInPixels, bool distanceField, bool createAtlasTexture)
+{
+	CPU_PROFILE("load font");
+	Font *font = (Font *)calloc(1, sizeof(Font));
+	font->distanceField = distanceField;
+	font->atlasWidth = GlyphAtlasSize;
+	font->atlasHeight = GlyphAtlasSize;
+
+	GlyphCache *cache = new GlyphCache();
+	font->glyphs = cache;
+	cache->filename = strdup(filename);
+	cache->atlasPixels = (uint8_t *)calloc(GlyphAtlasSize * GlyphAtlasSize, 1);
+
+	uint64_t cacheKey = getFontCacheKey(filename, sizeInPixels, distanceField);
+	if (!cacheKey || !loadCachedFont(cacheKey, font))
+	{
+		if (!preloadGlyphs(font, sizeInPixels))
+		{
+			freeFont(font);
+			return NULL;
+		}
+		if (cacheKey)
+			saveCachedFont(cacheKey, font);
+	}
+
+	// no mipmaps, they would have to be rebuilt with every glyph
+	if (createAtlasTexture)
+		font->atlas = createTexture(cache->atlasPixels, GlyphAtlasSize, GlyphAtlasSize, GL_RED, GL_RED, GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, false);
+	cache->dirtyMinY = GlyphAtlasSize;
+	cache->dirtyMaxY = -1;
+	return font;
+}
+
+Font *loadFont(const char *filename, float sizeInPixels, bool createAtlasTexture)
+{
+	return loadFontAtlas(filename, sizeInPixels, false, createAtlasTexture);
+}
+
+Font *loadDistanceFieldFont(const char *filename, float sizeInPixels, bool createAtlasTexture)
+{
+	return loadFontAtlas(filename, sizeInPixels, true, createAtlasTexture);
+}
+
+void freeFont(Font *font)
+{
+	if (!font)
+		return;
+
+	// drawString()'s layouts of the font
+	for (auto i = textLayoutCache.begin(); i != textLayoutCache.end(); )
+	{
+		if (i->second->font == font)
+		{
+			freeTextLayout(i->second);
+			i = textLayoutCache.erase(i);
+		}
+		else
+			++i;
+	}
+
+	GlyphCache *cache = font->glyphs;
+	free(cache->atlasPixels);
+	free(cache->fontData);
+	free(cache->filename);
+	delete cache;
+	if (font->atlas)
+		glDeleteTextures(1, &font->atlas);
+	free(font);
+}
+
+// Text batching
+// -------------
+// The glyph quads of all strings go into one ring buffer that stays mapped, and are drawn with
+// one draw call per flush, which only happens at flushText(), when the font atlas changes or when
+// the writes cross into the next segment of the ring. Every segment gets a fence when it's left
+// behind, which is waited on before writing into it again, a whole lap later, so the GPU has long
+// finished with it. The quad indices are the same for every segment, they're built once.
+// Without OpenGL 4.4 the ring lives in CPU memory and the flushed part is uploaded instead.
+
+constexpr int TextSegmentQuads = 4096; // glyphs per segment of the ring buffer
+constexpr int TextSegments = 4;
+
+struct TextBatch
+{
+	GpuBuffer vertexBuffer;
+	GpuBuffer indexBuffer;
+	VertexSpecification vertexSpec;
+	ShaderProgram shader;
+	TextVertex *vertices;   // the whole ring, mapped or in CPU memory
+	bool persistent;        // vertices is the mapped vertex buffer
+	int segment;            // the one being written
+	int head;               // the next free quad
+	int batchStart;         // the first quad that isn't drawn yet
+	const Font *font;       // of the quads that aren't drawn yet
+	int screenWidth;        // from beginText(), the globals belong to the main thread
+	int screenHeight;
+	GLsync segmentFences[TextSegments];
+};
+
+static TextBatch textBatch;
+
+static void createTextBatch(TextBatch *batch)
+{
+	constexpr size_t RingBytes = TextSegments * TextSegmentQuads * 4 * sizeof(TextVertex);
+
+	glGenBuffers(1, &batch->vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, batch->vertexBuffer);
+	batch->persistent = glBufferStorage != NULL;
+	if (batch->persistent)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, RingBytes, NULL, flags);
+		batch->vertices = (TextVertex *)glMapBufferRange(GL_ARRAY_BUFFER, 0, RingBytes, flags);
+	}
+	else
+	{
+		glBufferData(GL_ARRAY_BUFFER, RingBytes, NULL, GL_STREAM_DRAW);
+		batch->vertices = (TextVertex *)malloc(RingBytes);
+	}
+
+	uint16_t *indices = (uint16_t *)malloc(TextSegmentQuads * 6 * sizeof(uint16_t));
+	for (int i = 0; i < TextSegmentQuads; ++i)
+	{
+		int base = i * 4;
+		indices[i * 6 + 0] = uint16_t(base + 0);
+		indices[i * 6 + 1] = uint16_t(base + 1);
+		indices[i * 6 + 2] = uint16_t(base + 2);
+		indices[i * 6 + 3] = uint16_t(base + 2);
+		indices[i * 6 + 4] = uint16_t(base + 3);
+		indices[i * 6 + 5] = uint16_t(base + 0);
+	}
+	batch->indexBuffer = createGpuBuffer(indices, TextSegmentQuads * 6 * sizeof(uint16_t), GL_STATIC_DRAW);
+	free(indices);
+
+	glGenVertexArrays(1, &batch->vertexSpec);
+	glBindVertexArray(batch->vertexSpec);
+	glBindBuffer(GL_ARRAY_BUFFER, batch->vertexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch->indexBuffer);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void *)offsetof(TextVertex, pos));
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void *)offsetof(TextVertex, uv));
+	glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void *)offsetof(TextVertex, color));
+	glBindVertexArray(0);
+
+	batch->shader = loadShaderProgram("assets/shaders/text.vert.glsl", "assets/shaders/text.frag.glsl");
+	if (!batch->vertices)
+		fprintf(stderr, "ERROR: failed to map the text vertex buffer\n");
+	glCheckErrors();
+}
+
+static void flushTextBatch(TextBatch *batch)
+{
+	int numQuads = batch->head - batch->batchStart;
+	if (numQuads == 0)
+		return;
+
+	// the segment's first quad is index 0
+	int segmentStart = batch->segment * TextSegmentQuads;
+	int firstIndex = batch->batchStart - segmentStart;
+
+	glBindVertexArray(batch->vertexSpec);
+	if (!batch->persistent)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, batch->vertexBuffer);
+		glBufferSubData(GL_ARRAY_BUFFER, batch->batchStart * 4 * sizeof(TextVertex), numQuads * 4 * sizeof(TextVertex), batch->vertices + batch->batchStart * 4);
+	}
+
+	// the glyphs rasterized while laying out these quads
+	glActiveTexture(GL_TEXTURE0);
+	updateFontAtlas(batch->font);
+
+	mat4 projection = orthoMatLH(0.0f, (float)batch->screenWidth, (float)batch->screenHeight, 0.0f, -1.0f, 1.0f);
+	glUseProgram(batch->shader);
+	glUniformMatrix4fv(0, 1, GL_FALSE, (GLfloat *)&projection);
+	glUniform1i(1, batch->font->distanceField);
+	glBindTexture(GL_TEXTURE_2D, batch->font->atlas);
+	glDrawElementsBaseVertex(GL_TRIANGLES, numQuads * 6, GL_UNSIGNED_SHORT, (void *)(firstIndex * 6 * sizeof(uint16_t)), segmentStart * 4);
+	glBindVertexArray(0);
+
+	batch->batchStart = batch->head;
+	glCheckErrors();
+}
+
+// Room for numQuads more glyphs drawn with the font's atlas.
+static TextVertex *allocateTextQuads(TextBatch *batch, const Font *font, int numQuads)
+{
+	assert(numQuads <= TextSegmentQuads);
+	if (!batch->vertexBuffer)
+		createTextBatch(batch);
+
+	if (font != batch->font)
+	{
+		flushTextBatch(batch);
+		batch->font = font;
+	}
+
+	int segment = batch->segment;
+	if (batch->head + numQuads > (segment + 1) * TextSegmentQuads)
+	{
+		flushTextBatch(batch);
+		if (batch->segmentFences[segment])
+			glDeleteSync(batch->segmentFences[segment]);
+		batch->segmentFences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+		segment = (segment + 1) % TextSegments;
+		if (batch->segmentFences[segment])
+		{
+			glClientWaitSync(batch->segmentFences[segment], GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+			glDeleteSync(batch->segmentFences[segment]);
+			batch->segmentFences[segment] = 0;
+		}
+		batch->segment = segment;
+		batch->head = batch->batchStart = segment * TextSegmentQuads;
+	}
+
+	TextVertex *vertices = batch->vertices + batch->head * 4;
+	batch->head += numQuads;
+	return vertices;
+}
+
+void drawString(
+	const Font *font,
+	const char *string,
+	vec2 position,
+	bool center,
+	vec2 scale,
+	vec4 color,
+	float rotationRadians)
+{
+	uint64_t key = hashBytes(&font, sizeof(font));
+	key = hashBytes(&center, sizeof(center), key);
+	key = hashBytes(&scale, sizeof(scale), key);
+	key = hashBytes(&color, sizeof(color), key);
+	key = hashBytes(string, strlen(string), key);
+
+	auto found = textLayoutCache.find(key);
+	TextLayout *layout = found != textLayoutCache.end() ? found->second : NULL;
+	if (layout && strcmp(layout->string, string) != 0)
+	{
+		// a hash collision, the older string is laid out again when it's back
+		freeTextLayout(layout);
+		textLayoutCache.erase(found);
+		layout = NULL;
+	}
+	if (!layout)
+	{
+		uint64_t &recentKey = recentTextKeys[key % RecentTextKeys];
+		if (recentKey != key || textLayoutCache.size() >= MaxCachedTextLayouts)
+		{
+			recentKey = key;
+			size_t length = strlen(string);
+			if (textScratch.size() < 4 * length)
+				textScratch.resize(4 * length);
+			int numVertices = layoutString(font, string, center, scale, color, textScratch.data());
+			drawTextVertices(font, textScratch.data(), numVertices, position, rotationRadians);
+			return;
+		}
+		layout = createTextLayout(font, center, scale, color);
+		setTextLayoutString(layout, string);
+		textLayoutCache[key] = layout;
+	}
+	layout->lastDrawn = textFrame;
+	drawTextLayout(layout, position, rotationRadians);
+}
+
+void drawTextVertices(const Font *font, const TextVertex *vertices, int numVertices, vec2 position, float rotationRadians)
+{
+	// the batch is drawn with one transform, so the string's is applied here
+	float c = cosf(rotationRadians);
+	float s = sinf(rotationRadians);
+	for (int start = 0; start < numVertices; start += TextSegmentQuads * 4)
+	{
+		int count = min(numVertices - start, TextSegmentQuads * 4);
+		TextVertex *queued = allocateTextQuads(&textBatch, font, count / 4);
+		for (int i = 0; i < count; ++i)
+		{
+			const TextVertex &vertex = vertices[start + i];
+			vec2 pos = vertex.pos;
+			if (rotationRadians != 0)
+				pos = vec2(c * pos.x - s * pos.y, s * pos.x + c * pos.y);
+			queued[i] = { position + pos, vertex.uv, vertex.color };
+		}
+	}
+}
+
+void beginText(int screenWidth, int screenHeight)
+{
+	textBatch.screenWidth = screenWidth;
+	textBatch.screenHeight = screenHeight;
+}
+
+void flushText()
+{
+	flushTextBatch(&textBatch);
+	trimTextLayoutCache();
+	++textFrame;
+}
+
+bool shaderIsValid(ShaderProgram program)
 {
 	GLint status;
 	glValidateProgram(program);
 	glGetProgramiv(program, GL_VALIDATE_STATUS, &status);
 	return status == GL_TRUE;
+}
+
+void transformAABB(vec3 aabbMin, vec3 aabbMax, mat4 matrix, vec3 *outMin, vec3 *outMax)
+{
+	// transform the center and add up how much every column stretches the extents
+	vec3 center = (matrix * vec4(0.5f * (aabbMin + aabbMax), 1)).xyz;
+	vec3 extents = 0.5f * (aabbMax - aabbMin);
+	vec3 newExtents = vec3(0);
+	for (int i = 0; i < 3; ++i)
+	{
+		vec3 column = matrix.col[i].xyz;
+		newExtents += extents[i] * vec3(fabs(column.x), fabs(column.y), fabs(column.z));
+	}
+
+	*outMin = center - newExtents;
+	*outMax = center + newExtents;
+}
+
+bool getVisibleReceiverBounds(
+	mat4 viewProjection,
+	vec3 cameraPos,
+	vec3 sceneMin,
+	vec3 sceneMax,
+	vec3 *receiverMin,
+	vec3 *receiverMax)
+{
+	CPU_PROFILE("cull shadow receivers");
+	// the far plane is usually way outside the scene, nothing past its furthest corner can be seen
+	float maxDist = 0;
+	for (int i = 0; i < 8; ++i)
+	{
+		vec3 corner = vec3(i & 1 ? sceneMax.x : sceneMin.x, i & 2 ? sceneMax.y : sceneMin.y, i & 4 ? sceneMax.z : sceneMin.z);
+		maxDist = max(maxDist, distance(cameraPos, corner));
+	}
+
+	mat4 inverseViewProjection = inverse(viewProjection);
+	vec4 centerNear = inverseViewProjection * vec4(0, 0, -1, 1);
+	vec4 centerFar = inverseViewProjection * vec4(0, 0, +1, 1);
+	vec3 forward = normalize(centerFar.xyz / centerFar.w - centerNear.xyz / centerNear.w);
+
+	vec3 frustumMin = vec3(+Inf);
+	vec3 frustumMax = vec3(-Inf);
+	for (int i = 0; i < 4; ++i)
+	{
+		vec2 ndc = vec2(i & 1 ? +1.0f : -1.0f, i & 2 ? +1.0f : -1.0f);
+		vec4 nearCorner = inverseViewProjection * vec4(ndc, -1, 1);
+		vec4 farCorner = inverseViewProjection * vec4(ndc, +1, 1);
+		vec3 nearPos = nearCorner.xyz / nearCorner.w;
+		vec3 farPos = farCorner.xyz / farCorner.w;
+
+		// cut the corner ray off at a view depth of maxDist
+		float nearDepth = dot(nearPos - cameraPos, forward);
+		float farDepth = dot(farPos - cameraPos, forward);
+		float t = clamp((maxDist - nearDepth) / (farDepth - nearDepth), 0.0f, 1.0f);
+		farPos = nearPos + t * (farPos - nearPos);
+
+		frustumMin = min(frustumMin, min(nearPos, farPos));
+		frustumMax = max(frustumMax, max(nearPos, farPos));
+	}
+
+	*receiverMin = max(frustumMin, sceneMin);
+	*receiverMax = min(frustumMax, sceneMax);
+	return receiverMin->x <= receiverMax->x && receiverMin->y <= receiverMax->y && receiverMin->z <= receiverMax->z;
+}
+
+static bool aabbsOverlap(vec3 minA, vec3 maxA, vec3 minB, vec3 maxB)
+{
+	return minA.x <= maxB.x && minB.x <= maxA.x &&
+		minA.y <= maxB.y && minB.y <= maxA.y &&
+		minA.z <= maxB.z && minB.z <= maxA.z;
+}
+
+bool shadowReachesAABB(vec3 casterMin, vec3 casterMax, vec3 lightPos, vec3 receiverMin, vec3 receiverMax)
+{
+	if (aabbsOverlap(casterMin, casterMax, receiverMin, receiverMax))
+		return true;
+
+	// a light inside the caster shadows in every direction
+	if (aabbsOverlap(casterMin, casterMax, lightPos, lightPos))
+		return true;
+
+	// pushing the corners this far from the light moves them past every receiver
+	float extrudeDist = 0;
+	for (int i = 0; i < 8; ++i)
+	{
+		vec3 corner = vec3(i & 1 ? receiverMax.x : receiverMin.x, i & 2 ? receiverMax.y : receiverMin.y, i & 4 ? receiverMax.z : receiverMin.z);
+		extrudeDist = max(extrudeDist, distance(lightPos, corner));
+	}
+
+	vec3 volumeMin = casterMin;
+	vec3 volumeMax = casterMax;
+	for (int i = 0; i < 8; ++i)
+	{
+		vec3 corner = vec3(i & 1 ? casterMax.x : casterMin.x, i & 2 ? casterMax.y : casterMin.y, i & 4 ? casterMax.z : casterMin.z);
+		vec3 extruded = corner + extrudeDist * normalize(corner - lightPos);
+		volumeMin = min(volumeMin, extruded);
+		volumeMax = max(volumeMax, extruded);
+	}
+
+	return aabbsOverlap(volumeMin, volumeMax, receiverMin, receiverMax);
 }
\ No newline at end of file
@@ -29,8 +29,6 @@
 
 constexpr float NearPlane = 0.01f;
 constexpr float FarPlane = 100.0f;
-constexpr int ReflectionMapResolution = 256;
-constexpr int ShadowMapResolution = 512;
 
 typedef GLuint Texture;
 typedef GLuint CubeMap;
@@ -39,29 +37,27 @@ typedef GLuint ShaderProgram;
 typedef GLuint VertexSpecification;
 typedef GLuint Framebuffer;
 
-struct Font // stores all visible ASCII characters
+struct GlyphCache; // the glyphs rasterized so far, in graphics.cpp
+
+struct Font // any Unicode character, rasterized into the atlas the first time it's drawn
 {
-	Texture atlas;		// the texture in which all characters are packed
+	Texture atlas;		// the texture the glyphs are rasterized into, in rows that get reused when it's full
+	bool distanceField; // the atlas holds signed distances to the glyph edges instead of coverage
 	int atlasWidth;		// width of the atlas in pixels
 	int atlasHeight;	// height of the atlas in pixels
-	int firstChar;		// the first character codepoint stored in the font
-	int numChars;		// the number of characters stored in the font - sequential characters are stored
+	float glyphScale;   // from font units to atlas pixels
 	float ascent;		// highest glyph position over the baseline in pixels
 	float descent;		// lowest glyph position below the baseling in pixels (negative)
 	float lineGap;		// extra distance between 2 lines in pixels
-	float kerningScale; // scale factor for xKerning to convert it into fractional pixels
-	uint16_t x[96];     // [numChars] U coordinate of each character in the atlas - divide by atlasWidth before use!
-	uint16_t y[96];     // [numChars] V coordinate of each character in the atlas - divide by atlasHeight before use!
-	uint16_t w[96];     // [numChars] width of each character in the atlas in pixels
-	uint16_t h[96];     // [numChars] height of each character in the atlas in pixels
-	float xOffset[96];  // [numChars] x-position relative to cursor where to begin drawing each character
-	float yOffset[96];  // [numChars] y-position above the baseline where to begin drawing each character
-
-	// for monospaced fonts:
-	// - xAdvance will always be the same value.
-	// - xKerning will always be 0 for any pair.
-	float xAdvance[96];       // [numChars] how many fractional pixels to advance the cursor after each character
-	int16_t xKerning[96][96]; // [numChars * numChars] additional spacing for each character PAIR - multiply by kerningScale before use!
+	float kerningScale; // scale factor from the font's kerning to fractional pixels
+	GlyphCache *glyphs;
+};
+
+struct TextVertex
+{
+	vec2 pos;
+	vec2 uv;
+	vec4 color;
 };
 
 struct Vertex
@@ -78,29 +74,101 @@ struct Transform
 	vec3 pos      = vec3(0);
 	vec3 scale    = vec3(1);
 	quat rotation = quat(0, 0, 0, 1);
-	Transform *parent = NULL;
 
-	constexpr inline mat4 getLocalMatrix() const
+	inline mat4 getLocalMatrix() const
 	{
 		return translationMat(pos) * quatToMat(rotation) * scaleMat(scale);
 	}
 
-	constexpr inline mat4 getMatrix() const
-	{
-		mat4 matrix = getLocalMatrix();
-		
-		if (parent != NULL)
-			return parent->getMatrix() * matrix;
-		else
-			return matrix;
-	}
-
 	inline void rotate(vec3 axis, float angleRadians)
 	{
 		rotation = rotationQuat(axis, angleRadians) * rotation;
 	}
 };
 
+// Transform hierarchy
+// -------------------
+// Every transform in the scene is a node of one hierarchy, stored as parallel arrays indexed by
+// node. A parent is always added before its children, so walking the arrays front to back is a
+// topological order and updateTransforms() gets every world matrix right in a single pass.
+// Changing a local transform only marks the node dirty, the next updateTransforms() (once per
+// frame) recomputes its world matrix and the ones below it, everything else keeps its cached
+// matrix. Models refer to their nodes by index. Big hierarchies are updated one depth at a time
+// with the nodes of each depth split across the job system.
+
+constexpr uint8_t TransformDirty   = 1 << 0; // the local transform changed since the last update
+constexpr uint8_t TransformChanged = 1 << 1; // the world matrix was recomputed by the last update
+constexpr int TransformJobGrainSize = 4096; // nodes per job in the parallel update
+
+struct TransformHierarchy
+{
+	int numNodes;
+	int capacity;
+	int *parents;        // -1 for roots, always smaller than the node itself
+	int *depths;         // 0 for roots
+	int maxDepth;
+	vec3 *positions;     // the local transforms, relative to the parent
+	vec3 *scales;
+	quat *rotations;
+	mat4 *worldMatrices; // up to date for every node that isn't dirty
+	uint8_t *flags;
+	int numUpdated;      // world matrices recomputed by the last update
+};
+
+TransformHierarchy *createTransformHierarchy(int initialCapacity = 64);
+// Returns the new node, its parent has to exist already (or be -1).
+int addTransform(TransformHierarchy *hierarchy, int parent, const Transform &local = Transform());
+// Recomputes the world matrix of every dirty node and of everything below them.
+void updateTransforms(TransformHierarchy *hierarchy);
+
+inline Transform getLocalTransform(const TransformHierarchy *hierarchy, int node)
+{
+	Transform local;
+	local.pos = hierarchy->positions[node];
+	local.scale = hierarchy->scales[node];
+	local.rotation = hierarchy->rotations[node];
+	return local;
+}
+
+inline void setLocalTransform(TransformHierarchy *hierarchy, int node, const Transform &local)
+{
+	hierarchy->positions[node] = local.pos;
+	hierarchy->scales[node] = local.scale;
+	hierarchy->rotations[node] = local.rotation;
+	hierarchy->flags[node] |= TransformDirty;
+}
+
+inline void setTransformPos(TransformHierarchy *hierarchy, int node, vec3 pos)
+{
+	hierarchy->positions[node] = pos;
+	hierarchy->flags[node] |= TransformDirty;
+}
+
+inline void setTransformScale(TransformHierarchy *hierarchy, int node, vec3 scale)
+{
+	hierarchy->scales[node] = scale;
+	hierarchy->flags[node] |= TransformDirty;
+}
+
+inline void setTransformRotation(TransformHierarchy *hierarchy, int node, quat rotation)
+{
+	hierarchy->rotations[node] = rotation;
+	hierarchy->flags[node] |= TransformDirty;
+}
+
+// Only valid once updateTransforms() ran after the last change to the node.
+inline mat4 getWorldMatrix(const TransformHierarchy *hierarchy, int node)
+{
+	assert(!(hierarchy->flags[node] & TransformDirty));
+	return hierarchy->worldMatrices[node];
+}
+
+// True if the world matrix of the node changed in the last update.
+inline bool transformChanged(const TransformHierarchy *hierarchy, int node)
+{
+	return (hierarchy->flags[node] & TransformChanged) != 0;
+}
+
 struct Mesh
 {
 	VertexSpecification vertexSpecification;
@@ -123,20 +191,20 @@ struct Model
 {
 	Mesh mesh;
 	Material material;
-	Transform transform;
+	int transform; // node in the TransformHierarchy
 	vec3 minAABB;
 	vec3 maxAABB;
 };
 
 struct CompositeModel
 {
-	Transform transform;
+	int transform; // root node in the TransformHierarchy, the parent of all the local transforms
 	int numMaterials;
 	Material *materials;
 	int numModels;
 	Mesh *meshes;
 	int *materialIndices;
-	Transform *localTransforms;
+	int *localTransforms;
 	vec3 minAABB;
 	vec3 maxAABB;
 	vec3 *minAABBs;
@@ -163,9 +231,9 @@ struct CompositeModel
 		return model;
 	}
 
-	inline vec3 getCenter() const
+	inline vec3 getCenter(const TransformHierarchy *hierarchy) const
 	{
-		return (transform.getMatrix() * vec4(0.5f * (minAABB + maxAABB), 1)).xyz;
+		return (getWorldMatrix(hierarchy, transform) * vec4(0.5f * (minAABB + maxAABB), 1)).xyz;
 	}
 };
 
@@ -201,17 +269,46 @@ struct Spotlight
 	float quadraticAttenuation = 1;
 	float innerCutoffRadians   = Pi / 4;
 	float outerCutoffRadians   = Pi / 4;
+	float range                = FarPlane; // the light is faded out completely at this distance
+
+	// shadows are rendered into a tile of the shared shadow atlas - see lighting.h
+	bool castsShadows = false;
+	int shadowTile    = -1;     // quadtree node of the tile in the atlas, -1 if the light doesn't have one
+	int shadowAge     = 0;      // frames since the tile was last rendered
+	size_t shadowKey  = 0;      // hash of the state the tile was last rendered with, 0 if it was never rendered
+	mat4 shadowMatrix = mat4(1); // world space -> clip space of the light
+};
 
-	Texture shadowMapTex    = 0;
-	Framebuffer shadowMapFb = 0;
+// The contents of a .model file, before anything is uploaded to the GPU.
+// The vertices only have positions and normals, each object has its own index list.
+struct ModelData
+{
+	int numVertices = 0;
+	Vertex *vertices = NULL;
+	int numMaterials = 0;
+	Material *materials = NULL;
+	int numObjects = 0;
+	int *materialIndices = NULL; // [numObjects]
+	vec3 *minAABBs = NULL;       // [numObjects]
+	vec3 *maxAABBs = NULL;       // [numObjects]
+	int *numIndices = NULL;      // [numObjects]
+	uint **indices = NULL;       // [numObjects][numIndices[i]]
+	vec3 minAABB = vec3(0);
+	vec3 maxAABB = vec3(0);
 };
 
-CompositeModel *loadModel(const char *filename);
-CompositeModel *loadModelObj(const char *objFilename);
+bool readModelData(const char *filename, ModelData *data);
+bool writeModelData(const char *filename, const ModelData *data);
+void freeModelData(ModelData *data);
+
+// The models add their transforms to the hierarchy, a root node for the whole model with
+// one child per object.
+CompositeModel *loadModel(const char *filename, TransformHierarchy *hierarchy);
+CompositeModel *loadModelObj(const char *objFilename, TransformHierarchy *hierarchy);
 void convertObjToModel(const char *objFilename, const char *outFilename);
-CompositeModel *copyModel(const CompositeModel *model);
+CompositeModel *copyModel(const CompositeModel *model, TransformHierarchy *hierarchy);
 
-Model createModel(const Vertex *vertices, int numVertices, const uint *indices, int numIndices);
+Model createModel(const Vertex *vertices, int numVertices, const uint *indices, int numIndices, TransformHierarchy *hierarchy);
 
 void drawMesh(Mesh mesh);
 
@@ -227,6 +324,14 @@ Mesh createMesh(
 	const uint *indices,
 	int numIndices);
 
+constexpr int FontDistanceFieldPadding = 4; // pixels around each glyph of a distance field atlas
+constexpr int GlyphAtlasSize = 512;         // pixels per side of a font's atlas, all the memory its glyphs get
+
+// drawString() and drawTextVertices() only queue the glyphs, they're drawn all at once by
+// flushText() with the OpenGL state at that point. Call it once per frame after all the text.
+// The text is positioned in pixels of the framebuffer size given to beginText(), call that
+// first with the size the frame renders at.
+void beginText(int screenWidth, int screenHeight);
 void drawString(
 	const Font *font,
 	const char *string,
@@ -236,7 +341,41 @@ void drawString(
 	vec4 color = vec4(1),
 	float rotationRadians = 0);
 
-Font *loadFont(const char *filename, float sizeInPixels);
+// Strings are UTF-8. Printable ASCII is rasterized while loading and comes from the font cache
+// after the first launch, everything else as it's drawn. The atlas is one GlyphAtlasSize page,
+// glyphs that weren't drawn for a while make room for new ones when it's full.
+// Without createAtlasTexture only the glyphs are loaded, which doesn't need an OpenGL context.
+Font *loadFont(const char *filename, float sizeInPixels, bool createAtlasTexture = true);
+// Same, but the atlas stores distance fields: the edge is at 0.5 and the field fades out over
+// FontDistanceFieldPadding atlas pixels to both sides. The text shader finds the edge at any
+// scale and rotation, so the one atlas stays crisp at every size drawString() is used with.
+Font *loadDistanceFieldFont(const char *filename, float sizeInPixels, bool createAtlasTexture = true);
+void freeFont(Font *font);
+
+// Size of the string's glyph boxes in pixels, unscaled.
+vec2 getStringSize(const Font *font, const char *string);
+
+// The quads drawString() draws, relative to the string's position, at most 4 vertices per
+// character (there are none for whitespace). '\n' starts a new line, centering centers every
+// line on its own and all of them vertically. Returns the number of vertices written.
+int layoutString(const Font *font, const char *string, bool center, vec2 scale, vec4 color, TextVertex *vertices);
+// Queues what layoutString() wrote, so the layout can happen anywhere (on any thread) beforehand.
+void drawTextVertices(const Font *font, const TextVertex *vertices, int numVertices, vec2 position, float rotationRadians = 0);
+// Draws everything queued since the last flush, in one draw call per font atlas.
+void flushText();
+
+// A string laid out once and drawn as often as needed, for labels that rarely change. Setting the
+// same string again costs a strcmp, drawing it just queues the quads. drawString() keeps one of
+// these per string it draws more than once, text that changes often is better off with one of its
+// own that's set to each new string. Layouts have to be freed before their font.
+struct TextLayout; // in graphics.cpp
+
+TextLayout *createTextLayout(const Font *font, bool center = false, vec2 scale = vec2(1), vec4 color = vec4(1));
+// Returns whether the string changed, and with it the layout.
+bool setTextLayoutString(TextLayout *layout, const char *string);
+vec2 getTextLayoutSize(const TextLayout *layout);
+void drawTextLayout(TextLayout *layout, vec2 position, float rotationRadians = 0);
+void freeTextLayout(TextLayout *layout);
 
 Texture loadTexture(
 	const char *filename,
@@ -356,20 +495,76 @@ LightProbe createShadowProbe(
 	int faceWidth,
 	int faceHeight);
 
+void freeLightProbe(LightProbe *probe);
+
 Spotlight createSpotlight(
 	vec3 pos,
 	vec3 dir,
 	vec3 color = vec3(1),
-	int shadowMapResolution=ShadowMapResolution);
+	float innerCutoffRadians = Pi / 8, // full intensity inside, has to be less than the outer cutoff
+	float outerCutoffRadians = Pi / 4,
+	vec3 attenuation = vec3(1, 0, 1), // constant, linear, quadratic
+	bool castsShadows = false);
 
 Framebuffer createFramebuffer(Texture colorAttachment = 0, Texture depthAttachment = 0);
 
 ShaderProgram loadShaderProgram(const char *vertFilename, const char *fragFilename);
 
+ShaderProgram loadComputeShaderProgram(const char *filename);
+
+// The defines are inserted right after the #version line of every source.
 ShaderProgram createShaderProgram(
 	const GLenum *types,
 	const char *const *sources,
-	int numSources);
+	int numSources,
+	const char *const *defines = NULL,
+	int numDefines = 0);
+
+constexpr int MaxShaderDefines = 8;
+
+// A vertex and fragment shader pair compiled with different sets of #defines, so features
+// can be switched off at compile time instead of branching on uniforms.
+// Bit i of a variant key turns on defines[i]. Each variant is compiled once, when it's first used.
+struct ShaderVariants
+{
+	char *vertSrc;
+	char *fragSrc;
+	int numDefines;
+	const char *defines[MaxShaderDefines];
+	ShaderProgram programs[1 << MaxShaderDefines];
+};
+
+// The define strings aren't copied and must stay around. If a file can't be read every variant
+// is program 0, the same as loadShaderProgram() returns.
+ShaderVariants *loadShaderVariants(
+	const char *vertFilename,
+	const char *fragFilename,
+	const char *const *defines,
+	int numDefines);
+
+ShaderProgram getShaderVariant(ShaderVariants *variants, uint32_t key);
+
+struct ShaderVariantRef
+{
+	ShaderVariants *variants;
+	uint32_t key;
+};
+
+// Compiles all the variants in one go, which lets drivers with GL_KHR_parallel_shader_compile
+// work on them at the same time, and finishes each as soon as the driver reports it complete.
+// Use it to build everything a frame needs up front.
+void compileShaderVariants(const ShaderVariantRef *refs, int numRefs);
+
+struct ShaderCacheStats
+{
+	int numPrograms;       // programs created so far
+	int numCacheHits;      // of those, how many were loaded from the program binary cache
+	double compileSeconds; // wall clock time spent compiling the rest from source, overlapping compiles count once
+	double savedSeconds;   // how long the cache hits took to compile when they were first built
+	bool parallelCompile;  // whether the driver compiles in parallel
+};
+
+extern ShaderCacheStats shaderCacheStats;
 
 GpuBuffer createGpuBuffer(
 	const void *data,
@@ -408,34 +603,82 @@ inline constexpr vec4 gray(float intensity)
 	return rgb(intensity, intensity, intensity);
 }
 
-// TODO: This doesn't work for all cases! 
-// If the clip box is enclosed inside the bounding box this will incorrectly cull.
-// But hey, it works for now :)
-inline bool frustumCullAABB(vec3 aabbMin, vec3 aabbMax, mat4 mvpMatrix)
+// Planes pointing inwards: dot(plane.xyz, point) + plane.w >= 0 for points inside.
+// They are in whatever space the matrix passed to getFrustum() transforms from,
+// so a model-view-projection matrix gives model space planes.
+struct Frustum
 {
-	vec3 points[8] = {
-		vec3(aabbMin.x, aabbMin.y, aabbMin.z),
-		vec3(aabbMin.x, aabbMin.y, aabbMax.z),
-		vec3(aabbMin.x, aabbMax.y, aabbMin.z),
-		vec3(aabbMin.x, aabbMax.y, aabbMax.z),
-		vec3(aabbMax.x, aabbMin.y, aabbMin.z),
-		vec3(aabbMax.x, aabbMin.y, aabbMax.z),
-		vec3(aabbMax.x, aabbMax.y, aabbMin.z),
-		vec3(aabbMax.x, aabbMax.y, aabbMax.z),
-	};
+	vec4 planes[6];
+};
 
-	for (int i = 0; i < 8; ++i)
+inline Frustum getFrustum(mat4 viewProjection)
+{
+	// Gribb & Hartmann - Fast Extraction of Viewing Frustum Planes from the World-View-Projection Matrix
+	vec4 rows[4];
+	for (int i = 0; i < 4; ++i)
+		rows[i] = vec4(viewProjection.col[0][i], viewProjection.col[1][i], viewProjection.col[2][i], viewProjection.col[3][i]);
+
+	Frustum frustum;
+	frustum.planes[0] = rows[3] + rows[0]; // left
+	frustum.planes[1] = rows[3] - rows[0]; // right
+	frustum.planes[2] = rows[3] + rows[1]; // bottom
+	frustum.planes[3] = rows[3] - rows[1]; // top
+	frustum.planes[4] = rows[3] + rows[2]; // near
+	frustum.planes[5] = rows[3] - rows[2]; // far
+	for (int i = 0; i < 6; ++i)
+		frustum.planes[i] /= length(frustum.planes[i].xyz);
+
+	return frustum;
+}
+
+inline bool frustumCullSphere(const Frustum &frustum, vec3 center, float radius)
+{
+	for (int i = 0; i < 6; ++i)
 	{
-		vec4 clip = mvpMatrix * vec4(points[i], 1);
-		vec3 p = clip.xyz / clip.w;
+		if (dot(frustum.planes[i].xyz, center) + frustum.planes[i].w < -radius)
+			return true;
+	}
 
-		if (p.x >= -1 && p.x <= +1 &&
-			p.y >= -1 && p.y <= +1 &&
-			p.z >= -1 && p.z <= +1)
-		{
-			return false;
-		}
+	return false;
+}
+
+inline bool frustumCullAABB(const Frustum &frustum, vec3 aabbMin, vec3 aabbMax)
+{
+	// the box is outside if its corner furthest along a plane's normal is still behind that plane
+	for (int i = 0; i < 6; ++i)
+	{
+		vec4 plane = frustum.planes[i];
+		vec3 furthest = vec3(
+			plane.x >= 0 ? aabbMax.x : aabbMin.x,
+			plane.y >= 0 ? aabbMax.y : aabbMin.y,
+			plane.z >= 0 ? aabbMax.z : aabbMin.z);
+
+		if (dot(plane.xyz, furthest) + plane.w < 0)
+			return true;
 	}
 
-	return true;
-}
\ No newline at end of file
+	return false;
+}
+
+inline bool frustumCullAABB(vec3 aabbMin, vec3 aabbMax, mat4 mvpMatrix)
+{
+	return frustumCullAABB(getFrustum(mvpMatrix), aabbMin, aabbMax);
+}
+
+// Bounding box of the box after transforming it by the matrix.
+void transformAABB(vec3 aabbMin, vec3 aabbMax, mat4 matrix, vec3 *outMin, vec3 *outMax);
+
+// Bounding box of everything the camera can see, given that all receivers are inside the scene bounds.
+// Returns false if the camera doesn't see any of the scene.
+bool getVisibleReceiverBounds(
+	mat4 viewProjection,
+	vec3 cameraPos,
+	vec3 sceneMin,
+	vec3 sceneMax,
+	vec3 *receiverMin,
+	vec3 *receiverMax);
+
+// Whether the shadow a point light casts from the caster (world space AABB) can fall on the
+// receiver box. The shadow volume is approximated by the caster box extruded away from the
+// light until it's past the receivers.
+bool shadowReachesAABB(vec3 casterMin, vec3 casterMax, vec3 lightPos, vec3 receiverMin, vec3 receiverMax);
\ No newline at end of file
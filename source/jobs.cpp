@@ -0,0 +1,159 @@
+#include "jobs.h"
+#include "profiler.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+struct JobQueue
+{
+	std::mutex mutex;
+	std::deque<Job> jobs;
+};
+
+struct JobSystem
+{
+	JobQueue queues[MaxJobThreads]; // [0] belongs to the main thread
+	int numWorkers = 0;
+	std::atomic<int> numThreads{1}; // the ones with a deque
+	std::atomic<int> numQueuedJobs{0};
+
+	// idle workers sleep until there's something to steal
+	std::mutex sleepMutex;
+	std::condition_variable wakeUp;
+
+	char threadNames[MaxJobThreads][16];
+};
+
+// never freed, the workers are detached and keep sleeping on it until the process exits
+static JobSystem *jobSystem = new JobSystem();
+static thread_local int jobThreadIndex = 0;
+
+static bool popJob(Job *job)
+{
+	JobQueue &queue = jobSystem->queues[jobThreadIndex];
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.jobs.empty())
+		return false;
+
+	*job = queue.jobs.back();
+	queue.jobs.pop_back();
+	--jobSystem->numQueuedJobs;
+	return true;
+}
+
+static bool stealJob(Job *job)
+{
+	// start with the next thread over so that the thieves don't all go for the same deque
+	int numThreads = jobSystem->numThreads;
+	for (int i = 1; i < numThreads; ++i)
+	{
+		JobQueue &queue = jobSystem->queues[(jobThreadIndex + i) % numThreads];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.jobs.empty())
+			continue;
+
+		*job = queue.jobs.front();
+		queue.jobs.pop_front();
+		--jobSystem->numQueuedJobs;
+		return true;
+	}
+	return false;
+}
+
+static void runJob(const Job &job)
+{
+	job.function(job.context, job.begin, job.end);
+	job.counter->numPending.fetch_sub(1, std::memory_order_release);
+}
+
+static void runWorker(int index)
+{
+	jobThreadIndex = index;
+	nameCpuProfilerThread(jobSystem->threadNames[index]);
+
+	for (;;)
+	{
+		Job job;
+		if (popJob(&job) || stealJob(&job))
+		{
+			runJob(job);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(jobSystem->sleepMutex);
+		jobSystem->wakeUp.wait(lock, [] { return jobSystem->numQueuedJobs.load() > 0; });
+	}
+}
+
+void initJobSystem(int numWorkers)
+{
+	assert(jobSystem->numThreads == 1 && "the job system is already running or threads registered too early");
+
+	if (numWorkers < 0)
+		numWorkers = (int)std::thread::hardware_concurrency() - 1;
+	numWorkers = clamp(numWorkers, 0, MaxJobThreads - 1);
+
+	jobSystem->numWorkers = numWorkers;
+	jobSystem->numThreads = numWorkers + 1;
+	for (int i = 1; i <= numWorkers; ++i)
+	{
+		snprintf(jobSystem->threadNames[i], sizeof(jobSystem->threadNames[i]), "worker %d", i);
+		std::thread(runWorker, i).detach();
+	}
+}
+
+int getNumJobThreads()
+{
+	return jobSystem->numWorkers + 1;
+}
+
+void registerJobThread()
+{
+	int index = jobSystem->numThreads++;
+	assert(index < MaxJobThreads);
+	jobThreadIndex = index;
+}
+
+void queueJobs(int count, int grainSize, JobFunction *function, const void *context, JobCounter *counter)
+{
+	if (count <= 0)
+		return;
+
+	grainSize = max(grainSize, 1);
+	int numJobs = (count + grainSize - 1) / grainSize;
+	counter->numPending.fetch_add(numJobs, std::memory_order_relaxed);
+
+	JobQueue &queue = jobSystem->queues[jobThreadIndex];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		for (int begin = 0; begin < count; begin += grainSize)
+			queue.jobs.push_back({ function, context, begin, min(begin + grainSize, count), counter });
+	}
+	jobSystem->numQueuedJobs += numJobs;
+
+	if (jobSystem->numWorkers > 0)
+	{
+		// taking the lock makes sure a worker that's about to sleep sees the new jobs first
+		{
+			std::lock_guard<std::mutex> lock(jobSystem->sleepMutex);
+		}
+		if (numJobs > 1)
+			jobSystem->wakeUp.notify_all();
+		else
+			jobSystem->wakeUp.notify_one();
+	}
+}
+
+void waitForCounter(JobCounter *counter)
+{
+	while (counter->numPending.load(std::memory_order_acquire) > 0)
+	{
+		Job job;
+		if (popJob(&job) || stealJob(&job))
+			runJob(job);
+		else
+			std::this_thread::yield();
+	}
+}
\ No newline at end of file
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "common.h"
+#include <atomic>
+
+// Job system
+// ----------
+// A pool of worker threads, one per core besides the main thread. Every thread that runs jobs,
+// the main thread included, has its own deque: it pushes and pops its own jobs at the back, and
+// once it runs dry it steals from the front of somebody else's, so work spreads out without one
+// queue that everybody fights over. The deques are only locked for a single push or pop, so
+// each one just has its own mutex.
+//
+// Every job belongs to a JobCounter of unfinished jobs, whatever depends on them waits for the
+// counter to reach zero. Waiting runs other jobs instead of blocking, so the waiting thread does
+// its share, jobs can wait for jobs they started themselves, and with no workers at all (one
+// core, or initJobSystem was never called) everything just runs on the thread that waits.
+// Threads besides the main thread and the workers that start jobs register to get a deque of
+// their own, otherwise they share the main thread's.
+
+constexpr int MaxJobThreads = 64;
+
+// Runs the items [begin, end) of whatever the context describes.
+typedef void JobFunction(const void *context, int begin, int end);
+
+struct JobCounter
+{
+	std::atomic<int> numPending{0};
+};
+
+struct Job
+{
+	JobFunction *function;
+	const void *context;
+	int begin;
+	int end;
+	JobCounter *counter;
+};
+
+// Starts the workers, with numWorkers < 0 one per core besides the calling thread.
+void initJobSystem(int numWorkers = -1);
+// The workers plus the main thread.
+int getNumJobThreads();
+// Gives the calling thread a deque of its own.
+void registerJobThread();
+
+// Splits [0, count) into ranges of grainSize items and queues a job for each of them on the
+// calling thread's deque, the counter goes up by the number of jobs.
+void queueJobs(int count, int grainSize, JobFunction *function, const void *context, JobCounter *counter);
+// Runs jobs until the counter is zero.
+void waitForCounter(JobCounter *counter);
+
+// Same as queueJobs with a lambda or function object, body(begin, end). The body is not copied,
+// it has to stay alive until the counter is zero.
+template <typename Body>
+inline void runJobs(int count, int grainSize, const Body &body, JobCounter *counter)
+{
+	queueJobs(count, grainSize, [](const void *context, int begin, int end) { (*(const Body *)context)(begin, end); }, &body, counter);
+}
+
+// Runs body(begin, end) over [0, count) in chunks of grainSize and returns once all of them are done.
+template <typename Body>
+inline void parallelFor(int count, int grainSize, const Body &body)
+{
+	JobCounter counter;
+	runJobs(count, grainSize, body, &counter);
+	waitForCounter(&counter);
+}
\ No newline at end of file
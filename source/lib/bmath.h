@@ -36,7 +36,7 @@
   - arbitrary vector swizzles
   - complete set of operators for matrices and quaternions
   - functions which are FORCED to be inlined (with something like __forceinline for example)
-  - SIMD optimization
+  - SIMD optimization, except for a few float mat4/vec4/quat functions (see B_MATH_SIMD)
 
   All types and most functions are implemented as templates in order to reduce
   code duplication, although typedefs are provided for float, double, int, uint,
@@ -69,6 +69,12 @@
 
   #define B_MATH_NO_CPP11
   - Don't use C++ 11 features: constexpr and log2, exp2 from <cmath>
+
+  #define B_MATH_SIMD
+  - Use SSE for mat4 * mat4, mat4 * vec4, inverse(mat4), quatToMat and normalize of
+    float vec4 and quat, and AVX for mat4 * mat4 when the compiler targets it (-mavx, /arch:AVX).
+    The results are the same as without it. These versions aren't constexpr. Without
+    SSE2 (x86 only) this does nothing
 */
 
 #pragma once
@@ -77,6 +83,16 @@
 
 #include <cmath>
 
+#ifdef B_MATH_SIMD
+#	if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#		define B_MATH_SIMD_SSE
+#		include <immintrin.h>
+#	endif
+#	if defined(B_MATH_SIMD_SSE) && defined(__AVX__)
+#		define B_MATH_SIMD_AVX
+#	endif
+#endif
+
 #ifdef B_MATH_NAMESPACE
 #	define B_MATH_BEGIN namespace B_MATH_NAMESPACE {
 #	define B_MATH_END }
@@ -3465,6 +3481,178 @@ inline quaternion<T> matToQuat(matrix<T, 4, 4> m) {
 	}
 }
 
+/*
+ * --- SIMD Specializations ---
+ */
+
+/* These are plain overloads for the float types, so they win against the templates above
+   without touching any call sites. Every lane does exactly the same operations in the same
+   order as the generic code does for that element, so the results are bit-for-bit the same.
+   The exception is when the compiler fuses the generic code's multiplies and adds into FMAs
+   (-mfma with -ffp-contract=fast), then they can differ in the last bit. */
+
+#ifdef B_MATH_SIMD_SSE
+
+inline __m128 bLoad(vector<float, 4> v) {
+	return _mm_loadu_ps(v.elem);
+}
+
+inline vector<float, 4> bStore(__m128 v) {
+	vector<float, 4> result;
+	_mm_storeu_ps(result.elem, v);
+	return result;
+}
+
+#define B_SPLAT(v, i) _mm_shuffle_ps(v, v, _MM_SHUFFLE(i, i, i, i))
+
+/* x + y + z + w in that order, in the lowest lane */
+inline __m128 bSumInOrder(__m128 v) {
+	__m128 sum = _mm_add_ss(v, B_SPLAT(v, 1));
+	sum = _mm_add_ss(sum, B_SPLAT(v, 2));
+	return _mm_add_ss(sum, B_SPLAT(v, 3));
+}
+
+inline __m128 bMulMat4Vec4(__m128 col0, __m128 col1, __m128 col2, __m128 col3, __m128 v) {
+	__m128 result = _mm_mul_ps(col0, B_SPLAT(v, 0));
+	result = _mm_add_ps(result, _mm_mul_ps(col1, B_SPLAT(v, 1)));
+	result = _mm_add_ps(result, _mm_mul_ps(col2, B_SPLAT(v, 2)));
+	return _mm_add_ps(result, _mm_mul_ps(col3, B_SPLAT(v, 3)));
+}
+
+inline vector<float, 4> operator *(matrix<float, 4, 4> left, vector<float, 4> right) {
+	return bStore(bMulMat4Vec4(bLoad(left.col[0]), bLoad(left.col[1]), bLoad(left.col[2]), bLoad(left.col[3]), bLoad(right)));
+}
+
+#ifdef B_MATH_SIMD_AVX
+/* columns i and i + 1 of the product */
+inline __m256 bMulMat4Columns(__m256 l0, __m256 l1, __m256 l2, __m256 l3, __m256 r) {
+	__m256 result = _mm256_mul_ps(l0, _mm256_shuffle_ps(r, r, _MM_SHUFFLE(0, 0, 0, 0)));
+	result = _mm256_add_ps(result, _mm256_mul_ps(l1, _mm256_shuffle_ps(r, r, _MM_SHUFFLE(1, 1, 1, 1))));
+	result = _mm256_add_ps(result, _mm256_mul_ps(l2, _mm256_shuffle_ps(r, r, _MM_SHUFFLE(2, 2, 2, 2))));
+	return _mm256_add_ps(result, _mm256_mul_ps(l3, _mm256_shuffle_ps(r, r, _MM_SHUFFLE(3, 3, 3, 3))));
+}
+#endif
+
+inline matrix<float, 4, 4> operator *(matrix<float, 4, 4> left, matrix<float, 4, 4> right) {
+	matrix<float, 4, 4> result;
+#ifdef B_MATH_SIMD_AVX
+	__m256 l0 = _mm256_set_m128(bLoad(left.col[0]), bLoad(left.col[0]));
+	__m256 l1 = _mm256_set_m128(bLoad(left.col[1]), bLoad(left.col[1]));
+	__m256 l2 = _mm256_set_m128(bLoad(left.col[2]), bLoad(left.col[2]));
+	__m256 l3 = _mm256_set_m128(bLoad(left.col[3]), bLoad(left.col[3]));
+	__m256 r01 = _mm256_loadu_ps(right.col[0].elem);
+	__m256 r23 = _mm256_loadu_ps(right.col[2].elem);
+	_mm256_storeu_ps(result.col[0].elem, bMulMat4Columns(l0, l1, l2, l3, r01));
+	_mm256_storeu_ps(result.col[2].elem, bMulMat4Columns(l0, l1, l2, l3, r23));
+#else
+	__m128 l0 = bLoad(left.col[0]);
+	__m128 l1 = bLoad(left.col[1]);
+	__m128 l2 = bLoad(left.col[2]);
+	__m128 l3 = bLoad(left.col[3]);
+	_mm_storeu_ps(result.col[0].elem, bMulMat4Vec4(l0, l1, l2, l3, bLoad(right.col[0])));
+	_mm_storeu_ps(result.col[1].elem, bMulMat4Vec4(l0, l1, l2, l3, bLoad(right.col[1])));
+	_mm_storeu_ps(result.col[2].elem, bMulMat4Vec4(l0, l1, l2, l3, bLoad(right.col[2])));
+	_mm_storeu_ps(result.col[3].elem, bMulMat4Vec4(l0, l1, l2, l3, bLoad(right.col[3])));
+#endif
+	return result;
+}
+
+/* one lane per cofactor: (m2.p * m3.q - m3.p * m2.q) twice, (m1.p * m3.q - m3.p * m1.q), (m1.p * m2.q - m2.p * m1.q) */
+template<int P, int Q>
+inline __m128 bInverseFactor(__m128 m1, __m128 m2, __m128 m3) {
+	__m128 q32 = _mm_shuffle_ps(m3, m2, _MM_SHUFFLE(Q, Q, Q, Q));
+	__m128 p32 = _mm_shuffle_ps(m3, m2, _MM_SHUFFLE(P, P, P, P));
+	__m128 a = _mm_shuffle_ps(m2, m1, _MM_SHUFFLE(P, P, P, P));
+	__m128 b = _mm_shuffle_ps(q32, q32, _MM_SHUFFLE(2, 0, 0, 0));
+	__m128 c = _mm_shuffle_ps(p32, p32, _MM_SHUFFLE(2, 0, 0, 0));
+	__m128 d = _mm_shuffle_ps(m2, m1, _MM_SHUFFLE(Q, Q, Q, Q));
+	return _mm_sub_ps(_mm_mul_ps(a, b), _mm_mul_ps(c, d));
+}
+
+/* (m1.i, m0.i, m0.i, m0.i) */
+template<int I>
+inline __m128 bInverseColumn(__m128 m0, __m128 m1) {
+	__m128 t = _mm_shuffle_ps(m1, m0, _MM_SHUFFLE(I, I, I, I));
+	return _mm_shuffle_ps(t, t, _MM_SHUFFLE(2, 2, 2, 0));
+}
+
+inline matrix<float, 4, 4> inverse(matrix<float, 4, 4> m) {
+	__m128 m0 = bLoad(m.col[0]);
+	__m128 m1 = bLoad(m.col[1]);
+	__m128 m2 = bLoad(m.col[2]);
+	__m128 m3 = bLoad(m.col[3]);
+
+	__m128 f0 = bInverseFactor<2, 3>(m1, m2, m3);
+	__m128 f1 = bInverseFactor<1, 3>(m1, m2, m3);
+	__m128 f2 = bInverseFactor<1, 2>(m1, m2, m3);
+	__m128 f3 = bInverseFactor<0, 3>(m1, m2, m3);
+	__m128 f4 = bInverseFactor<0, 2>(m1, m2, m3);
+	__m128 f5 = bInverseFactor<0, 1>(m1, m2, m3);
+
+	__m128 v0 = bInverseColumn<0>(m0, m1);
+	__m128 v1 = bInverseColumn<1>(m0, m1);
+	__m128 v2 = bInverseColumn<2>(m0, m1);
+	__m128 v3 = bInverseColumn<3>(m0, m1);
+
+	__m128 signA = _mm_setr_ps(+1, -1, +1, -1);
+	__m128 signB = _mm_setr_ps(-1, +1, -1, +1);
+	__m128 inverse0 = _mm_mul_ps(_mm_add_ps(_mm_sub_ps(_mm_mul_ps(v1, f0), _mm_mul_ps(v2, f1)), _mm_mul_ps(v3, f2)), signA);
+	__m128 inverse1 = _mm_mul_ps(_mm_add_ps(_mm_sub_ps(_mm_mul_ps(v0, f0), _mm_mul_ps(v2, f3)), _mm_mul_ps(v3, f4)), signB);
+	__m128 inverse2 = _mm_mul_ps(_mm_add_ps(_mm_sub_ps(_mm_mul_ps(v0, f1), _mm_mul_ps(v1, f3)), _mm_mul_ps(v3, f5)), signA);
+	__m128 inverse3 = _mm_mul_ps(_mm_add_ps(_mm_sub_ps(_mm_mul_ps(v0, f2), _mm_mul_ps(v1, f4)), _mm_mul_ps(v2, f5)), signB);
+
+	__m128 row01 = _mm_shuffle_ps(inverse0, inverse1, _MM_SHUFFLE(0, 0, 0, 0));
+	__m128 row23 = _mm_shuffle_ps(inverse2, inverse3, _MM_SHUFFLE(0, 0, 0, 0));
+	__m128 row0 = _mm_shuffle_ps(row01, row23, _MM_SHUFFLE(2, 0, 2, 0));
+	__m128 det = B_SPLAT(bSumInOrder(_mm_mul_ps(m0, row0)), 0);
+
+	return matrix<float, 4, 4>(
+		bStore(_mm_div_ps(inverse0, det)),
+		bStore(_mm_div_ps(inverse1, det)),
+		bStore(_mm_div_ps(inverse2, det)),
+		bStore(_mm_div_ps(inverse3, det)));
+}
+
+/* 2 * (a * b + sign * c * d), then scale * that + offset - see the generic quatToMat */
+inline __m128 bQuatToMatColumn(__m128 a, __m128 b, __m128 c, __m128 d, __m128 sign, __m128 scale, __m128 offset) {
+	__m128 sum = _mm_add_ps(_mm_mul_ps(a, b), _mm_mul_ps(_mm_mul_ps(c, d), sign));
+	__m128 twice = _mm_mul_ps(_mm_set1_ps(2), sum);
+	return _mm_add_ps(_mm_mul_ps(twice, scale), offset);
+}
+
+#define B_QSHUF(q, x, y, z) _mm_shuffle_ps(q, q, _MM_SHUFFLE(3, z, y, x))
+
+inline matrix<float, 4, 4> quatToMat(quaternion<float> quat) {
+	__m128 q = bLoad(quat.xyzw);
+	/* x = 0, y = 1, z = 2, w = 3 */
+	__m128 col0 = bQuatToMatColumn(
+		B_QSHUF(q, 1, 0, 0), B_QSHUF(q, 1, 1, 2), B_QSHUF(q, 2, 3, 3), B_QSHUF(q, 2, 2, 1),
+		_mm_setr_ps(1, 1, -1, 0), _mm_setr_ps(-1, 1, 1, 0), _mm_setr_ps(1, 0, 0, 0));
+	__m128 col1 = bQuatToMatColumn(
+		B_QSHUF(q, 0, 0, 1), B_QSHUF(q, 1, 0, 2), B_QSHUF(q, 3, 2, 3), B_QSHUF(q, 2, 2, 0),
+		_mm_setr_ps(-1, 1, 1, 0), _mm_setr_ps(1, -1, 1, 0), _mm_setr_ps(0, 1, 0, 0));
+	__m128 col2 = bQuatToMatColumn(
+		B_QSHUF(q, 0, 1, 0), B_QSHUF(q, 2, 2, 0), B_QSHUF(q, 3, 3, 1), B_QSHUF(q, 1, 0, 1),
+		_mm_setr_ps(1, -1, 1, 0), _mm_setr_ps(1, 1, -1, 0), _mm_setr_ps(0, 0, 1, 0));
+	return matrix<float, 4, 4>(bStore(col0), bStore(col1), bStore(col2), vector<float, 4>(0, 0, 0, 1));
+}
+
+inline vector<float, 4> normalize(vector<float, 4> v) {
+	__m128 x = bLoad(v);
+	__m128 length = _mm_sqrt_ss(bSumInOrder(_mm_mul_ps(x, x)));
+	return bStore(_mm_div_ps(x, B_SPLAT(length, 0)));
+}
+
+inline quaternion<float> normalize(quaternion<float> q) {
+	vector<float, 4> v = normalize(q.xyzw);
+	return quaternion<float>(v.x, v.y, v.z, v.w);
+}
+
+#undef B_QSHUF
+#undef B_SPLAT
+
+#endif /* B_MATH_SIMD_SSE */
+
 B_MATH_END
 
 #undef B_MATH_BEGIN
@@ -3472,6 +3660,8 @@ B_MATH_END
 #undef B_MATH_HAS_CONSTEXPR
 #undef B_MATH_HAS_EXP2_LOG2
 #undef B_MATH_HAS_DEFAULT_CONSTRUCTOR
+#undef B_MATH_SIMD_SSE
+#undef B_MATH_SIMD_AVX
 
 #endif /* !B_MATH */
 
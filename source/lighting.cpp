@@ -0,0 +1,456 @@
+#include "lighting.h"
+#include "profiler.h"
+
+#include <string.h>
+#include <vector>
+
+static_assert(NumClusters % 64 == 0, "light-cull.comp.glsl expects whole work groups of 64 clusters");
+
+static vec4 getSpotlightBoundingSphere(const Spotlight &light)
+{
+	// tightest sphere around the light cone: https://bartwronski.com/2017/04/13/cull-that-cone/
+	float angle = light.outerCutoffRadians;
+	if (angle > Pi / 4)
+		return vec4(light.pos + light.range * cos(angle) * light.dir, light.range * sin(angle));
+	else
+	{
+		float radius = light.range / (2 * cos(angle));
+		return vec4(light.pos + radius * light.dir, radius);
+	}
+}
+
+static int getLevelStart(int level)
+{
+	return ((1 << (2 * level)) - 1) / 3;
+}
+
+static int getNodeLevel(int node)
+{
+	int level = 0;
+	while (node >= getLevelStart(level + 1))
+		++level;
+	return level;
+}
+
+static int getFirstChild(int node, int level)
+{
+	return getLevelStart(level + 1) + 4 * (node - getLevelStart(level));
+}
+
+static int getParent(int node, int level)
+{
+	return getLevelStart(level - 1) + (node - getLevelStart(level)) / 4;
+}
+
+static int getShadowTileSize(float screenDiameter)
+{
+	int size = MinShadowTileSize;
+	while (size < MaxShadowTileSize && size < screenDiameter)
+		size *= 2;
+	return size;
+}
+
+static ShadowAtlas createShadowAtlas()
+{
+	ShadowAtlas atlas;
+	atlas.depthMap = createTexture(NULL, ShadowAtlasResolution, ShadowAtlasResolution, GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT24, GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, false);
+	glBindTexture(GL_TEXTURE_2D, atlas.depthMap);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+
+	atlas.framebuffer = createFramebuffer(0, atlas.depthMap);
+	glBindFramebuffer(GL_FRAMEBUFFER, atlas.framebuffer);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	memset(atlas.nodes, ShadowNodeFree, sizeof(atlas.nodes));
+	atlas.numUpdates = 0;
+	glCheckErrors();
+	return atlas;
+}
+
+LightGrid createLightGrid()
+{
+	LightGrid grid;
+	grid.lightBuffer = createGpuBuffer(NULL, MaxLights * sizeof(GpuLight), GL_DYNAMIC_DRAW);
+	grid.clusterBuffer = createGpuBuffer(NULL, NumClusters * (1 + MaxLightsPerCluster) * sizeof(uint), GL_DYNAMIC_COPY);
+	grid.cullShader = loadComputeShaderProgram("assets/shaders/light-cull.comp.glsl");
+	grid.shadowAtlas = createShadowAtlas();
+	grid.numLights = 0;
+	grid.view = mat4(1);
+	grid.screenSize = vec2(1);
+	grid.depthParams = vec2(0);
+	return grid;
+}
+
+void uploadLights(LightGrid *grid, const Spotlight *lights, int numLights)
+{
+	CPU_PROFILE("upload lights");
+	if (numLights > MaxLights)
+	{
+		fprintf(stderr, "too many lights (%d), only the first %d will be used\n", numLights, MaxLights);
+		numLights = MaxLights;
+	}
+
+	GpuLight gpuLights[MaxLights];
+	for (int i = 0; i < numLights; ++i)
+	{
+		const Spotlight &light = lights[i];
+		gpuLights[i].posRange = vec4(light.pos, light.range);
+		gpuLights[i].dirCosOuter = vec4(normalize(light.dir), cos(light.outerCutoffRadians));
+		gpuLights[i].colorCosInner = vec4(light.color, cos(light.innerCutoffRadians));
+		gpuLights[i].attenuation = vec4(light.constantAttenuation, light.linearAttenutation, light.quadraticAttenuation, 0);
+		gpuLights[i].boundingSphere = getSpotlightBoundingSphere(light);
+
+		if (light.castsShadows && light.shadowTile >= 0 && light.shadowKey != 0)
+		{
+			// clip space -> uv of the tile, done before the perspective divide so it can go into the same matrix
+			vec4 rect = vec4(getShadowTileRect(light.shadowTile)) / (float)ShadowAtlasResolution;
+			mat4 clipToTile = mat4(1);
+			clipToTile.col[0].x = 0.5f * rect.z;
+			clipToTile.col[1].y = 0.5f * rect.w;
+			clipToTile.col[3].x = rect.x + 0.5f * rect.z;
+			clipToTile.col[3].y = rect.y + 0.5f * rect.w;
+			gpuLights[i].shadowMatrix = clipToTile * light.shadowMatrix;
+
+			// keep filtering from reading texels of neighbouring tiles
+			float halfTexel = 0.5f / ShadowAtlasResolution;
+			gpuLights[i].shadowRect = vec4(rect.x + halfTexel, rect.y + halfTexel, rect.x + rect.z - halfTexel, rect.y + rect.w - halfTexel);
+		}
+		else
+		{
+			gpuLights[i].shadowMatrix = mat4(1);
+			gpuLights[i].shadowRect = vec4(0);
+		}
+	}
+
+	grid->numLights = numLights;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid->lightBuffer);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, (GLsizeiptr)(numLights * sizeof(GpuLight)), gpuLights);
+	glCheckErrors();
+}
+
+void cullLights(LightGrid *grid, mat4 view, mat4 projection, int screenWidth, int screenHeight)
+{
+	CPU_PROFILE("dispatch light culling");
+	// exponential depth slices: slice = log(z / near) / log(far / near) * numSlices
+	float logDepthRange = log(ClusterFar / ClusterNear);
+	grid->view = view;
+	grid->screenSize = vec2((float)screenWidth, (float)screenHeight);
+	grid->depthParams.x = ClusterGridZ / logDepthRange;
+	grid->depthParams.y = -ClusterGridZ * log(ClusterNear) / logDepthRange;
+
+	// view space ray direction = ndc * projScale (with z = 1) for a symmetric perspective projection
+	vec2 projScale = vec2(1 / projection.col[0].x, 1 / projection.col[1].y);
+
+	glUseProgram(grid->cullShader);
+	setUniform(0, view);
+	glUniform2f(1, projScale.x, projScale.y);
+	glUniform2f(2, ClusterNear, ClusterFar);
+	glUniform1i(3, grid->numLights);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, grid->lightBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, grid->clusterBuffer);
+	glDispatchCompute(NumClusters / 64, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	glCheckErrors();
+}
+
+void bindLightGrid(const LightGrid *grid)
+{
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, grid->lightBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, grid->clusterBuffer);
+	setUniform(40, grid->view);
+	glUniform2f(41, grid->screenSize.x, grid->screenSize.y);
+	glUniform2f(42, grid->depthParams.x, grid->depthParams.y);
+	glUniform1i(43, grid->numLights);
+	bindUniformTexture(45, 3, grid->shadowAtlas.depthMap);
+}
+
+ivec4 getShadowTileRect(int node)
+{
+	int level = getNodeLevel(node);
+	int index = node - getLevelStart(level);
+	int size = ShadowAtlasResolution >> level;
+
+	// the index within a level is a morton code of the tile coordinates
+	int x = 0, y = 0;
+	for (int bit = 0; bit < level; ++bit)
+	{
+		x |= ((index >> (2 * bit + 0)) & 1) << bit;
+		y |= ((index >> (2 * bit + 1)) & 1) << bit;
+	}
+
+	return ivec4(x * size, y * size, size, size);
+}
+
+static int allocShadowNode(ShadowAtlas *atlas, int node, int level, int targetLevel)
+{
+	uint8_t state = atlas->nodes[node];
+	if (state == ShadowNodeUsed)
+		return -1;
+
+	if (level == targetLevel)
+	{
+		if (state != ShadowNodeFree)
+			return -1;
+
+		atlas->nodes[node] = ShadowNodeUsed;
+		return node;
+	}
+
+	atlas->nodes[node] = ShadowNodeSplit;
+
+	// fill up nodes that are already split before breaking up free ones
+	int firstChild = getFirstChild(node, level);
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		uint8_t wantedState = pass == 0 ? ShadowNodeSplit : ShadowNodeFree;
+		for (int i = 0; i < 4; ++i)
+		{
+			if (atlas->nodes[firstChild + i] != wantedState)
+				continue;
+
+			int result = allocShadowNode(atlas, firstChild + i, level + 1, targetLevel);
+			if (result >= 0)
+				return result;
+		}
+	}
+
+	atlas->nodes[node] = state;
+	return -1;
+}
+
+int allocShadowTile(ShadowAtlas *atlas, int size)
+{
+	int level = 0;
+	while ((ShadowAtlasResolution >> level) > size && level < ShadowAtlasLevels - 1)
+		++level;
+
+	return allocShadowNode(atlas, 0, 0, level);
+}
+
+void freeShadowTile(ShadowAtlas *atlas, int node)
+{
+	assert(atlas->nodes[node] == ShadowNodeUsed);
+	atlas->nodes[node] = ShadowNodeFree;
+
+	// merge parents whose children are all free again
+	int level = getNodeLevel(node);
+	while (level > 0)
+	{
+		node = getParent(node, level);
+		int firstChild = getFirstChild(node, level - 1);
+		for (int i = 0; i < 4; ++i)
+		{
+			if (atlas->nodes[firstChild + i] != ShadowNodeFree)
+				return;
+		}
+
+		atlas->nodes[node] = ShadowNodeFree;
+		--level;
+	}
+}
+
+static size_t getShadowKey(const Spotlight &light, size_t casterHash)
+{
+	struct ShadowState
+	{
+		vec3 pos;
+		vec3 dir;
+		float outerCutoffRadians;
+		float range;
+		int tile;
+		size_t casterHash;
+	};
+
+	ShadowState state;
+	memset(&state, 0, sizeof(state)); // padding is hashed too
+	state.pos = light.pos;
+	state.dir = light.dir;
+	state.outerCutoffRadians = light.outerCutoffRadians;
+	state.range = light.range;
+	state.tile = light.shadowTile;
+	state.casterHash = casterHash;
+
+	size_t key = hashBytes(&state, sizeof(state));
+	return key != 0 ? key : 1; // 0 means never rendered
+}
+
+void updateShadowAtlas(
+	ShadowAtlas *atlas,
+	Spotlight *lights,
+	int numLights,
+	ShaderProgram shadowShader,
+	mat4 view,
+	mat4 projection,
+	int screenHeight,
+	size_t casterHash,
+	const std::function<void(mat4 lightViewProjection)> &drawCasters)
+{
+	CPU_PROFILE("update shadow atlas");
+	struct ShadowRequest { int light; int size; int looseSize; float screenDiameter; };
+	std::vector<ShadowRequest> requests;
+
+	Frustum frustum = getFrustum(projection * view);
+	float pixelsPerUnit = 0.5f * screenHeight * projection.col[1].y; // at a view distance of 1
+
+	for (int i = 0; i < numLights; ++i)
+	{
+		Spotlight &light = lights[i];
+		if (!light.castsShadows)
+			continue;
+
+		// lights that can't affect anything on screen give their tile back
+		vec4 sphere = getSpotlightBoundingSphere(light);
+		if (frustumCullSphere(frustum, sphere.xyz, sphere.w))
+		{
+			if (light.shadowTile >= 0)
+				freeShadowTile(atlas, light.shadowTile);
+			light.shadowTile = -1;
+			light.shadowKey = 0;
+			continue;
+		}
+
+		// tiles get about as many texels as the light's bounding sphere covers pixels on screen
+		float viewZ = (view * vec4(sphere.xyz, 1)).z;
+		float screenDiameter = viewZ > sphere.w ? 2 * sphere.w * pixelsPerUnit / viewZ : (float)screenHeight;
+		requests.push_back({ i, (int)screenDiameter, (int)(1.5f * screenDiameter), min(screenDiameter, (float)screenHeight) });
+	}
+
+	// scale everything down uniformly until the tiles fit, leaving some slack for fragmentation
+	int totalArea;
+	for (int shift = 0; ; ++shift)
+	{
+		totalArea = 0;
+		for (ShadowRequest &request : requests)
+		{
+			int size = getShadowTileSize((float)(request.size >> shift));
+			totalArea += size * size;
+		}
+
+		if (totalArea <= 3 * (ShadowAtlasResolution / 2) * (ShadowAtlasResolution / 2) || shift >= ShadowAtlasLevels)
+		{
+			for (ShadowRequest &request : requests)
+			{
+				request.size = getShadowTileSize((float)(request.size >> shift));
+				request.looseSize = getShadowTileSize((float)(request.looseSize >> shift));
+			}
+			break;
+		}
+	}
+
+	// grow right away, but only shrink once the light is clearly smaller than its tile
+	// so that lights near a threshold don't reallocate every frame
+	for (ShadowRequest &request : requests)
+	{
+		Spotlight &light = lights[request.light];
+		if (light.shadowTile >= 0 && request.looseSize < getShadowTileRect(light.shadowTile).z)
+		{
+			freeShadowTile(atlas, light.shadowTile);
+			light.shadowTile = -1;
+		}
+	}
+	for (ShadowRequest &request : requests)
+	{
+		Spotlight &light = lights[request.light];
+		if (light.shadowTile >= 0 && request.size > getShadowTileRect(light.shadowTile).z)
+		{
+			// keep the old tile if there's no room for a bigger one
+			int tile = allocShadowTile(atlas, request.size);
+			if (tile >= 0)
+			{
+				freeShadowTile(atlas, light.shadowTile);
+				light.shadowTile = tile;
+				light.shadowKey = 0;
+			}
+		}
+	}
+
+	// place the biggest new tiles first, that packs the quadtree best
+	qsort(requests.data(), requests.size(), sizeof(ShadowRequest), [](const void *left, const void *right)
+	{
+		const ShadowRequest *lr = (const ShadowRequest *)left;
+		const ShadowRequest *rr = (const ShadowRequest *)right;
+		return rr->size - lr->size;
+	});
+	for (ShadowRequest &request : requests)
+	{
+		Spotlight &light = lights[request.light];
+		if (light.shadowTile < 0)
+		{
+			// settle for a smaller tile if the atlas is crowded
+			for (int size = request.size; size >= MinShadowTileSize && light.shadowTile < 0; size /= 2)
+				light.shadowTile = allocShadowTile(atlas, size);
+
+			light.shadowKey = 0;
+			light.shadowAge = 0;
+		}
+	}
+
+	struct ShadowUpdate { int light; size_t key; float priority; mat4 lightViewProjection; };
+	std::vector<ShadowUpdate> updates;
+
+	for (ShadowRequest &request : requests)
+	{
+		Spotlight &light = lights[request.light];
+		if (light.shadowTile < 0)
+			continue; // no room left, the light goes without a shadow
+
+		vec3 up = fabs(light.dir.y) < 0.99f ? vec3(0, 1, 0) : vec3(1, 0, 0);
+		float fov = min(2 * light.outerCutoffRadians + radians(2.0f), radians(170.0f));
+		mat4 lightView = lookAtMatLH(light.pos, light.dir, up);
+		mat4 lightProjection = perspectiveMatLH(fov, 1.0f, 0.05f, light.range);
+
+		++light.shadowAge;
+		size_t key = getShadowKey(light, casterHash);
+		if (key != light.shadowKey)
+		{
+			// tiles that were never rendered come first, then the ones that waited longest weighted
+			// by how much of the screen they can cover, so the lights that matter catch up first
+			float priority = (float)light.shadowAge * request.screenDiameter * request.screenDiameter;
+			if (light.shadowKey == 0)
+				priority += 1e9f;
+			updates.push_back({ request.light, key, priority, lightProjection * lightView });
+		}
+	}
+
+	qsort(updates.data(), updates.size(), sizeof(ShadowUpdate), [](const void *left, const void *right)
+	{
+		const ShadowUpdate *lu = (const ShadowUpdate *)left;
+		const ShadowUpdate *ru = (const ShadowUpdate *)right;
+		return lu->priority < ru->priority ? +1 : (lu->priority > ru->priority ? -1 : 0);
+	});
+
+	atlas->numUpdates = min((int)updates.size(), MaxShadowUpdatesPerFrame);
+	if (atlas->numUpdates == 0)
+		return;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, atlas->framebuffer);
+	glUseProgram(shadowShader);
+	glEnable(GL_SCISSOR_TEST);
+
+	for (int i = 0; i < atlas->numUpdates; ++i)
+	{
+		Spotlight &light = lights[updates[i].light];
+		ivec4 rect = getShadowTileRect(light.shadowTile);
+		glViewport(rect.x, rect.y, rect.z, rect.w);
+		glScissor(rect.x, rect.y, rect.z, rect.w);
+		glClear(GL_DEPTH_BUFFER_BIT);
+
+		// same linear distance encoding as the point light shadows, scaled by the light's range
+		setUniform(20, light.pos);
+		glUniform1f(21, light.range);
+		drawCasters(updates[i].lightViewProjection);
+
+		// lights that didn't make the budget keep the matrix their tile was rendered with
+		light.shadowMatrix = updates[i].lightViewProjection;
+		light.shadowKey = updates[i].key;
+		light.shadowAge = 0;
+	}
+
+	glDisable(GL_SCISSOR_TEST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glCheckErrors();
+}
\ No newline at end of file
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "graphics.h"
+
+#include <functional>
+
+// Clustered forward lighting
+// --------------------------
+// All spotlights live in one shader storage buffer. Every frame a compute pass splits the
+// camera frustum into a 3D grid of "froxels" (screen tiles x exponential depth slices) and
+// records which lights touch each of them. The lit shaders then only loop over the lights
+// in the cluster their fragment falls into.
+//
+// NOTE: the grid dimensions are duplicated in the shaders, keep them in sync!
+//
+// Spotlight shadows
+// -----------------
+// Shadowed spotlights render into tiles of one big depth texture instead of a texture per light.
+// The tiles are handed out by a quadtree: every node is either free, split into 4 children or
+// used by a light. Tiles are sized by how much of the screen the light can affect and are only
+// re-rendered when the light or the shadow casters changed, at most MaxShadowUpdatesPerFrame per
+// frame - lights that don't make the cut keep their slightly stale shadow for another frame. The
+// ones covering the most of the screen go first, weighted by how many frames they've waited.
+// A light that moves every frame is stale every frame, so only lights that mostly hold still
+// should cast shadows.
+
+constexpr int MaxLights = 256;
+constexpr int MaxLightsPerCluster = 64;
+constexpr int ClusterGridX = 16;
+constexpr int ClusterGridY = 9;
+constexpr int ClusterGridZ = 24;
+constexpr int NumClusters = ClusterGridX * ClusterGridY * ClusterGridZ;
+constexpr float ClusterNear = 0.5f; // everything closer than this falls into the first depth slice
+constexpr float ClusterFar = FarPlane; // the camera's far plane, lights are only culled up to it
+
+constexpr int ShadowAtlasResolution = 4096;
+constexpr int ShadowAtlasLevels = 6;   // tile sizes 4096, 2048, ..., 128
+constexpr int ShadowAtlasNodes = (1 << (2 * ShadowAtlasLevels)) / 3; // 1 + 4 + ... + 4^(levels - 1)
+constexpr int MaxShadowTileSize = 1024;
+constexpr int MinShadowTileSize = ShadowAtlasResolution >> (ShadowAtlasLevels - 1);
+constexpr int MaxShadowUpdatesPerFrame = 16;
+
+enum ShadowAtlasNodeState : uint8_t
+{
+	ShadowNodeFree,
+	ShadowNodeSplit,
+	ShadowNodeUsed,
+};
+
+struct ShadowAtlas
+{
+	Texture depthMap; // depth texture with comparison mode on, sample it with a sampler2DShadow
+	Framebuffer framebuffer;
+	uint8_t nodes[ShadowAtlasNodes]; // ShadowAtlasNodeState, level by level starting with the root
+	int numUpdates; // tiles rendered during the last updateShadowAtlas()
+};
+
+struct GpuLight // matches the std430 Light struct in the shaders
+{
+	vec4 posRange;       // xyz = world position, w = range after which the light is completely cut off
+	vec4 dirCosOuter;    // xyz = normalized direction, w = cos(outer cutoff)
+	vec4 colorCosInner;  // rgb = color, w = cos(inner cutoff)
+	vec4 attenuation;    // x = constant, y = linear, z = quadratic
+	vec4 boundingSphere; // xyz = world center, w = radius of a sphere enclosing the light cone
+	mat4 shadowMatrix;   // world space -> shadow atlas uv (after the perspective divide)
+	vec4 shadowRect;     // uv bounds of the light's atlas tile (min.xy, max.xy), all 0 for no shadow
+};
+
+struct LightGrid
+{
+	GpuBuffer lightBuffer;   // [MaxLights] GpuLight
+	GpuBuffer clusterBuffer; // [NumClusters] light counts followed by [NumClusters * MaxLightsPerCluster] light indices
+	ShaderProgram cullShader;
+	ShadowAtlas shadowAtlas;
+	int numLights;
+
+	// camera parameters of the most recent cullLights()
+	mat4 view;
+	vec2 screenSize;
+	vec2 depthParams; // slice = log(viewZ) * x + y
+};
+
+LightGrid createLightGrid();
+
+// Uploads the lights to the GPU. Shadowed lights must have gone through updateShadowAtlas() first.
+void uploadLights(LightGrid *grid, const Spotlight *lights, int numLights);
+
+// Bins the uploaded lights into the clusters of the given camera.
+// The lit shaders can use the result after this returns.
+void cullLights(LightGrid *grid, mat4 view, mat4 projection, int screenWidth, int screenHeight);
+
+// Binds the light buffers and sets the clustering uniforms (locations 40-43) of the current program.
+// Also binds the shadow atlas to texture unit 3 (location 45).
+// Shaders compiled without LIGHT_CLUSTERS loop over all lights instead - use those when rendering
+// from a viewpoint other than the one passed to cullLights(), like the reflection probe.
+void bindLightGrid(const LightGrid *grid);
+
+// Returns the atlas pixel rectangle (x, y, width, height) of a quadtree node.
+ivec4 getShadowTileRect(int node);
+
+// Allocates a size x size tile (power of 2), returns its node or -1 if the atlas is full.
+int allocShadowTile(ShadowAtlas *atlas, int size);
+void freeShadowTile(ShadowAtlas *atlas, int node);
+
+// Assigns atlas tiles to the shadowed lights visible from the camera and re-renders the ones that
+// are out of date, within the per-frame budget. casterHash must change whenever any shadow caster
+// moves. drawCasters is called with the shadow shader bound (Model at 0, MVP at 1) and the tile
+// set up as the viewport, it should draw everything that casts shadows.
+void updateShadowAtlas(
+	ShadowAtlas *atlas,
+	Spotlight *lights,
+	int numLights,
+	ShaderProgram shadowShader,
+	mat4 view,
+	mat4 projection,
+	int screenHeight,
+	size_t casterHash,
+	const std::function<void(mat4 lightViewProjection)> &drawCasters);
\ No newline at end of file
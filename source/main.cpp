@@ -3,8 +3,8 @@
 	---------------------
 	[+] make gamma correction work on Intel.. oh intel...
 	[ ] finish stage lights
-	 ->  [ ] attach spot lights
-	 ->  [ ] shadow map the spot lights
+	 ->  [+] attach spot lights
+	 ->  [+] shadow map the spot lights
 	 ->  [ ] animate the spot lights
 	[ ] add smoke to the room - billboards? volume?
 	 ->  [ ] animate the smoke
@@ -19,8 +19,27 @@
 
 #include "system.h"
 #include "graphics.h"
+#include "lighting.h"
+#include "profiler.h"
+#include "benchmark.h"
+#include "options.h"
+#include "quality.h"
+#include "regression.h"
+#include "resolution.h"
+#include "jobs.h"
 #include <vector>
 
+// a wide shot, close-ups of the lit and the reflective parts of the car, and a low angle into the rig lights
+const RegressionPose RegressionPoses[] = {
+	{ "overview", radians(45.0f), radians(180.0f), 16, 0.0 },
+	{ "front", radians(15.0f), radians(150.0f), 8, 1.5 },
+	{ "side", radians(25.0f), radians(270.0f), 10, 3.0 },
+	{ "low", radians(5.0f), radians(20.0f), 12, 4.5 },
+};
+
+constexpr const char *ShadowPassNames[6] = { "shadow +x", "shadow -x", "shadow +y", "shadow -y", "shadow +z", "shadow -z" };
+constexpr const char *ReflectionPassNames[6] = { "reflection +x", "reflection -x", "reflection +y", "reflection -y", "reflection +z", "reflection -z" };
+
 constexpr vec3 CubeDirections[6] = {
 	vec3(+1, 0, 0),
 	vec3(-1, 0, 0),
@@ -82,23 +101,128 @@ constexpr vec3 StageLightColor = vec3(0.9, 0.9, 1.0);
 const float StageLightCosOuterCutoff = cos(radians(27.5f));
 const float StageLightCosInnerCutoff = cos(radians(15.0f));
 
+// headlights relative to the car
+constexpr vec3 HeadlightOffsets[2] = { vec3(-1.9891f, 1.8f, 4.8f), vec3(+1.9891f, 1.8f, 4.8f) };
+constexpr vec3 HeadlightDirections[2] = { vec3(-0.1f, 0, 1), vec3(+0.1f, 0, 1) };
+
+// a grid of small sweeping spotlights hanging from a rig under the ceiling
+constexpr int NumRigLightsX = 8;
+constexpr int NumRigLightsZ = 8;
+constexpr float RigHeight = 16;
+constexpr float RigSpacing = 4;
+constexpr float RigSweep = 0.5f;      // how far the beams swing sideways, per unit down
+constexpr int RigShadowSpacing = 2;   // every other light in both directions casts shadows, those hold still
+constexpr vec3 RigLightColors[4] = { vec3(1.2f, 0.4f, 0.3f), vec3(0.3f, 0.6f, 1.2f), vec3(1.2f, 1.0f, 0.4f), vec3(0.8f, 0.4f, 1.2f) };
+
+// the two headlights, the two stage lights and the rig
+constexpr int NumSpotlights = 4 + NumRigLightsX * NumRigLightsZ;
+
+static bool isRigLightShadowed(int x, int z)
+{
+	return x % RigShadowSpacing == 0 && z % RigShadowSpacing == 0;
+}
+
+// variant key bits of the car and garage shaders, in the same order as LitShaderDefines
+enum LitShaderFeature : uint32_t
+{
+	LitRenderNormals   = 1 << 0,
+	LitGammaCorrection = 1 << 1,
+	LitSpotlights      = 1 << 2,
+	LitLightClusters   = 1 << 3,
+	LitNormalMapping   = 1 << 4,
+	LitSoftShadows     = 1 << 5,
+	LitTemporalAA      = 1 << 6,
+};
+const char *const LitShaderDefines[] = {
+	"RENDER_NORMALS",
+	"GAMMA_CORRECTION",
+	"SPOTLIGHTS",
+	"LIGHT_CLUSTERS",
+	"NORMAL_MAPPING",
+	"SOFT_SHADOWS",
+	"TEMPORAL_AA",
+};
+
+constexpr uint32_t SceneShaderVariant = LitGammaCorrection | LitSpotlights | LitLightClusters | LitNormalMapping | LitSoftShadows;
+// the reflection probe is blurry and only seen in reflections, so it gets by without the expensive stuff
+constexpr uint32_t ProbeShaderVariant = 0;
+
+constexpr int CullJobGrainSize = 256; // models per culling job
+
 //NOTE: Dont forget cube maps use right handed coordinates!
 const mat4 cubeProjection = perspectiveMatRH(radians(90.0f), 1.0f, NearPlane, FarPlane);
 
-void drawModel(const Model &model, mat4 viewProjection)
+// Everything the render thread needs to draw one frame, filled in by the simulation. The draw
+// functions index the packet's copy of the world matrices with the models' transform nodes.
+struct FramePacket
+{
+	int frame;
+	double deltaTime;
+	int width, height;
+	RenderMode renderMode;
+	QualityTier quality;
+	bool temporalAA;
+	bool showProfiler;
+
+	vec3 cameraPos, cameraDir;
+	mat4 view, projection, viewProjection;
+
+	vec3 lightPos;
+	mat4 cubeViewProjections[6];
+	bool receiversVisible;
+	vec3 receiverMin, receiverMax;
+	vec3 carCenter;
+	size_t shadowCasterHash;
+
+	std::vector<vec3> spotlightPositions;
+	std::vector<vec3> spotlightDirections;
+	std::vector<mat4> worldMatrices;
+
+	// what the camera sees, the transparent parts sorted back to front
+	std::vector<Model> opaqueCarModels;
+	std::vector<Model> stageLightModels;
+	std::vector<Model> transparentModels;
+	std::vector<Model> shadowCasters;
+	std::vector<uint8_t> casterVisible; // [face * shadowCasters.size() + caster]
+};
+
+// Without previousWorldMatrices the shader doesn't get the transform of the last frame,
+// only the temporal AA variants have it.
+void drawModel(const mat4 *worldMatrices, const Model &model, mat4 viewProjection, const mat4 *previousWorldMatrices = NULL, mat4 previousViewProjection = mat4())
 {
-	mat4 modelMatrix = model.transform.getMatrix();
+	mat4 modelMatrix = worldMatrices[model.transform];
 	setUniform(0, modelMatrix);
 	setUniform(1, viewProjection * modelMatrix);
+	if (previousWorldMatrices)
+		setUniform(2, previousViewProjection * previousWorldMatrices[model.transform]);
 	setUniform(6, model.material.ambientColor);
 	setUniform(7, model.material.diffuseColor);
 	setUniform(8, model.material.specularColor);
 	glUniform1f(9, model.material.specularExponent);
 	glUniform1f(10, model.material.alpha);
-	glUniform1ui(11, renderMode == RenderNormals);
 	drawMesh(model.mesh);
 }
 
+uint32_t getSceneShaderVariant(const QualitySettings &quality, bool temporalAA)
+{
+	uint32_t variant = SceneShaderVariant;
+	if (quality.shadowTaps <= 1)
+		variant &= ~LitSoftShadows;
+	if (temporalAA)
+		variant |= LitTemporalAA;
+	return variant;
+}
+
+// (Re)allocates everything the quality tier sizes.
+void createQualityTargets(const QualitySettings &quality, LightProbe *reflectionProbe, LightProbe *shadowProbe, DynamicResolution *resolution)
+{
+	freeLightProbe(reflectionProbe);
+	freeLightProbe(shadowProbe);
+	*reflectionProbe = createReflectionProbe(quality.reflectionMapResolution, quality.reflectionMapResolution, quality.reflectionFormat);
+	*shadowProbe = createShadowProbe(quality.shadowMapResolution, quality.shadowMapResolution);
+	setDynamicResolutionSamples(resolution, quality.msaaSamples);
+}
+
 void controlPositionAndRotation(Transform *transform, float deltaTime)
 {
 	bool upPressed = glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS;
@@ -153,41 +277,98 @@ void controlPositionAndRotation(Transform *transform, float deltaTime)
 	transform->rotate(vec3(1, 0, 0), rotateSpeed * rotateX);
 }
 
-void drawModelToShadowMap(const CompositeModel *model, mat4 viewProjection)
+// Without cull the caller already knows the model is in view.
+void drawModelToShadowMap(const mat4 *worldMatrices, const Model &model, mat4 viewProjection, bool cull = true)
+{
+	mat4 modelMatrix = worldMatrices[model.transform];
+	mat4 modelViewProjection = viewProjection * modelMatrix;
+	if (!cull || !frustumCullAABB(model.minAABB, model.maxAABB, modelViewProjection))
+	{
+		setUniform(0, modelMatrix);
+		setUniform(1, modelViewProjection);
+		drawMesh(model.mesh);
+	}
+}
+
+void drawModelToShadowMap(const mat4 *worldMatrices, const CompositeModel *model, mat4 viewProjection)
+{
+	for (int i = 0; i < model->numModels; ++i)
+	{
+		Model m = model->getModel(i);
+		if (m.material.alpha > 0.95f)
+			drawModelToShadowMap(worldMatrices, m, viewProjection);
+	}
+}
+
+// Collects the opaque parts of the model whose shadow from the light can land on the receivers.
+void addShadowCasters(std::vector<Model> *casters, const TransformHierarchy *transforms, const CompositeModel *model, vec3 lightPos, vec3 receiverMin, vec3 receiverMax)
 {
+	CPU_PROFILE("cull shadow casters");
 	for (int i = 0; i < model->numModels; ++i)
 	{
 		Model m = model->getModel(i);
 		if (m.material.alpha > 0.95f)
 		{
-			mat4 modelMatrix = m.transform.getMatrix();
-			mat4 modelViewProjection = viewProjection * modelMatrix;
-			if (!frustumCullAABB(m.minAABB, m.maxAABB, modelViewProjection))
-			{
-				setUniform(0, modelMatrix);
-				setUniform(1, modelViewProjection);
-				drawMesh(m.mesh);
-			}
+			vec3 casterMin, casterMax;
+			transformAABB(m.minAABB, m.maxAABB, getWorldMatrix(transforms, m.transform), &casterMin, &casterMax);
+			if (shadowReachesAABB(casterMin, casterMax, lightPos, receiverMin, receiverMax))
+				casters->push_back(m);
 		}
 	}
 }
 
-int main()
+int main(int argc, char **argv)
 {
 	//convertObjToModel("assets/models/stage-light.obj", "assets/models/stage-light.model");
 
-	initSystem();
-
-	Font *segoeUi = loadFont("assets/fonts/segoeui.ttf", 32);
+	RunOptions runOptions;
+	BenchmarkOptions benchmarkOptions;
+	if (!parseCommandLine(argc, argv, &runOptions, &benchmarkOptions))
+		return 1;
+
+	SystemBackend backend = benchmarkOptions.headless ? BackendHeadlessEgl : BackendWindow;
+	if (benchmarkOptions.enabled)
+		initSystem(backend, benchmarkOptions.width, benchmarkOptions.height);
+	else if (benchmarkOptions.regress)
+		initSystem(backend, RegressionWidth, RegressionHeight);
+	else
+		initSystem();
+
+	Font *segoeUi = loadDistanceFieldFont("assets/fonts/segoeui.ttf", 32);
+	TextLayout *statusText = createTextLayout(segoeUi, false, vec2(0.5));
+
+	if (runOptions.quality >= 0)
+		qualityTier = (QualityTier)runOptions.quality;
+	else if (benchmarkOptions.enabled || benchmarkOptions.regress)
+		qualityTier = QualityHigh;
+	else
+	{
+		float gigapixelsPerSecond;
+		qualityTier = detectQualityTier(&gigapixelsPerSecond);
+		printf("%s quality (detected, %.2f gigapixels/s)\n", QualityTiers[qualityTier].name, gigapixelsPerSecond);
+	}
+	QualityTier appliedQuality = qualityTier;
+	temporalAA = runOptions.temporalAA;
+	uint32_t sceneShaderVariant = getSceneShaderVariant(QualityTiers[appliedQuality], temporalAA);
 
-	ShaderProgram carShader = loadShaderProgram("assets/shaders/common.vert.glsl", "assets/shaders/car.frag.glsl");
+	ShaderVariants *carShaders = loadShaderVariants("assets/shaders/common.vert.glsl", "assets/shaders/car.frag.glsl", LitShaderDefines, countof(LitShaderDefines));
 	//ShaderProgram stagelightShader = loadShaderProgram("assets/shaders/common.vert.glsl", "assets/shaders/stage-light.frag.glsl");
 	ShaderProgram shadowShader = loadShaderProgram("assets/shaders/shadow.vert.glsl", "assets/shaders/shadow.frag.glsl");
-	ShaderProgram garageShader = loadShaderProgram("assets/shaders/garage.vert.glsl", "assets/shaders/garage.frag.glsl");
+	ShaderVariants *garageShaders = loadShaderVariants("assets/shaders/garage.vert.glsl", "assets/shaders/garage.frag.glsl", LitShaderDefines, countof(LitShaderDefines));
+
+	// compile the variants every frame uses up front so the first frame doesn't stall
+	ShaderVariantRef frameShaders[] = {
+		{ carShaders, sceneShaderVariant },
+		{ garageShaders, sceneShaderVariant },
+		{ garageShaders, ProbeShaderVariant },
+	};
+	compileShaderVariants(frameShaders, countof(frameShaders));
+
+	TransformHierarchy *transforms = createTransformHierarchy();
 
-	Model garageModel = createModel(CubeVertices, countof(CubeVertices), CubeIndices, countof(CubeIndices));	
-	garageModel.transform.scale = vec3(20, 10, 20);
-	garageModel.transform.pos.y = garageModel.transform.scale.y;
+	Model garageModel = createModel(CubeVertices, countof(CubeVertices), CubeIndices, countof(CubeIndices), transforms);	
+	setTransformScale(transforms, garageModel.transform, vec3(20, 10, 20));
+	setTransformPos(transforms, garageModel.transform, vec3(0, 10, 0));
 
 	CubeMap garageDiffuse = loadCubeMap(
 		"assets/textures/brick-diffuse.png",
@@ -204,56 +385,139 @@ int main()
 		"assets/textures/brick-norm.png",
 		"assets/textures/brick-norm.png");
 
-	LightProbe garageReflection = createReflectionProbe(ReflectionMapResolution, ReflectionMapResolution, GL_RGB);
-	LightProbe shadowProbe = createShadowProbe(ShadowMapResolution, ShadowMapResolution);
-
-	CompositeModel *carModel = loadModel("assets/models/car.model");
-	//carModel->transform.scale *= 3.0f;
-	//carModel->transform.pos.x = 5.0f;
-
-	CompositeModel *stageLight1 = loadModel("assets/models/stage-light.model");
-	stageLight1->transform.scale = vec3(5);
-	stageLight1->transform.pos = vec3(-8, 9, -10);
-	stageLight1->transform.rotation = quat(0, 0, 0, 1);
+	LightProbe garageReflection, shadowProbe;
+	LightGrid lightGrid = createLightGrid();
+	GpuProfiler *gpuProfiler = createGpuProfiler();
+	Benchmark *benchmark = benchmarkOptions.enabled ? createBenchmark(benchmarkOptions) : NULL;
+	RegressionSuite *regression = benchmarkOptions.regress ? createRegressionSuite(RegressionPoses, countof(RegressionPoses), benchmarkOptions.updateGoldens) : NULL;
+	// the benchmark and the regression suite have to render the same images every time
+	DynamicResolution *dynamicResolution = createDynamicResolution(benchmark || regression ? 0 : runOptions.targetGpuMs);
+	createQualityTargets(QualityTiers[appliedQuality], &garageReflection, &shadowProbe, dynamicResolution);
+	setTemporalAA(dynamicResolution, temporalAA);
+
+	// the transforms of the frame the render thread drew last, for the velocity of temporal AA
+	std::vector<mat4> previousWorldMatrices;
+	mat4 previousViewProjection;
+
+	printf("%d shader programs, %d from the binary cache: %.0f ms compiling, about %.0f ms saved%s\n",
+		shaderCacheStats.numPrograms,
+		shaderCacheStats.numCacheHits,
+		1000 * shaderCacheStats.compileSeconds,
+		1000 * shaderCacheStats.savedSeconds,
+		shaderCacheStats.parallelCompile ? " (compiled in parallel)" : "");
+
+	CompositeModel *carModel = loadModel("assets/models/car.model", transforms);
+	//setTransformScale(transforms, carModel->transform, vec3(3));
+	//setTransformPos(transforms, carModel->transform, vec3(5, 0, 0));
+
+	CompositeModel *stageLight1 = loadModel("assets/models/stage-light.model", transforms);
+	setTransformScale(transforms, stageLight1->transform, vec3(5));
+	setTransformPos(transforms, stageLight1->transform, vec3(-8, 9, -10));
+	setTransformRotation(transforms, stageLight1->transform, quat(0, 0, 0, 1));
+
+	CompositeModel *stageLight2 = copyModel(stageLight1, transforms);
+	setTransformPos(transforms, stageLight2->transform, vec3(8, 9, -10));
+	updateTransforms(transforms);
+
+	// positions and directions of the lights are updated every frame
+	std::vector<Spotlight> spotlights;
+	for (int i = 0; i < 2; ++i)
+		spotlights.push_back(createSpotlight(vec3(0), vec3(0, 0, 1), vec3(20), radians(12.5f), radians(37.5f), vec3(1, 0, 0.25f)));
+	for (int i = 0; i < 2; ++i)
+		spotlights.push_back(createSpotlight(vec3(0), vec3(0, 0, 1), 20.0f * StageLightColor, acos(StageLightCosInnerCutoff), acos(StageLightCosOuterCutoff), vec3(1, 0, 0.25f), true));
+	for (int i = 0; i < NumRigLightsX * NumRigLightsZ; ++i)
+	{
+		bool castsShadows = isRigLightShadowed(i % NumRigLightsX, i / NumRigLightsX);
+		Spotlight rigLight = createSpotlight(vec3(0), vec3(0, -1, 0), RigLightColors[i % countof(RigLightColors)], radians(10.0f), radians(20.0f), vec3(1, 0, 0.02f), castsShadows);
 
-	CompositeModel *stageLight2 = copyModel(stageLight1);
-	stageLight2->transform.pos.x = -stageLight1->transform.pos.x;
+		// the beams end at the floor long before they fade out
+		float maxTilt = atanf(RigSweep * sqrtf(2.0f)) + rigLight.outerCutoffRadians;
+		rigLight.range = min(rigLight.range, RigHeight / cosf(maxTilt));
+		spotlights.push_back(rigLight);
+	}
 
 	float cameraRotX = radians(45.0f);
 	float cameraRotY = radians(180.0f);
 	float cameraDist = 10;
 
 	vec3 lightPos = vec3(0, 10, 0);
+	double time = 0;
 
 	struct TransparentModel { Model model; float distToCamera; };
 	std::vector<TransparentModel> transparentModels;
 
-	glfwSwapInterval(0); // turn on vsync
+	// the culling results of a frame, per model in sceneModels or per face and caster in the packet's shadowCasters
+	std::vector<Model> sceneModels;
+	std::vector<uint8_t> cameraVisible;
+	std::vector<float> cameraDistances;
+
 	glEnable(GL_MULTISAMPLE);
+	framePacing = runOptions.pacing;
+
+	FramePacket packets[NumFramePackets];
 
-	startGameLoop([&](double deltaTime)
+	int frame = 0;
+	int numFrames = benchmark ? benchmarkOptions.numWarmupFrames + benchmarkOptions.numFrames : 0;
+	double fixedDeltaTime = benchmark ? benchmarkOptions.frameTime : 0;
+	if (regression)
 	{
+		numFrames = getRegressionNumFrames(regression);
+		fixedDeltaTime = benchmarkOptions.frameTime; // only for the fps counter, time is frozen at every pose
+	}
+
+	auto simulate = [&](double deltaTime, int packetIndex)
+	{
+		FramePacket &packet = packets[packetIndex];
+		packet.frame = frame++;
+		packet.deltaTime = deltaTime;
+		packet.width = windowWidth;
+		packet.height = windowHeight;
+		packet.renderMode = renderMode;
+		packet.quality = qualityTier;
+		packet.temporalAA = temporalAA;
+		packet.showProfiler = showProfiler;
+
+		time += deltaTime;
+
 		cameraDist = clamp(cameraDist - (20.0f * (float)deltaTime) * mouseWheelDelta, 8.0f, 20.0f);
-		if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT))
+		if (window && glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT))
 		{
 			cameraRotX += 0.01f * mouseDeltaY;
 			cameraRotY += 0.01f * mouseDeltaX;
 			cameraRotX = clamp(cameraRotX, 0.05f, +0.499f * Pi);
 			//cameraRotX = clamp(cameraRotX, -0.499f * Pi, +0.499f * Pi);
 		}
+		if (benchmark)
+		{
+			// one slow orbit around the car that dips low and zooms in and out
+			float orbit = (float)(time / (benchmarkOptions.numFrames * benchmarkOptions.frameTime));
+			cameraRotY = radians(180.0f) + 2 * Pi * orbit;
+			cameraRotX = radians(30.0f) + radians(25.0f) * sin(2 * Pi * orbit);
+			cameraDist = 14 + 6 * cos(4 * Pi * orbit);
+		}
+		if (regression)
+		{
+			const RegressionPose &pose = getRegressionPose(regression, packet.frame);
+			cameraRotX = pose.cameraRotX;
+			cameraRotY = pose.cameraRotY;
+			cameraDist = pose.cameraDist;
+			time = pose.time;
+		}
 
-		//controlPositionAndRotation(&stageLight1->transform, (float)deltaTime);
-		//stageLight2->transform = stageLight1->transform;
-		//stageLight2->transform.pos.x = -stageLight1->transform.pos.x;
+		//Transform light1Transform = getLocalTransform(transforms, stageLight1->transform);
+		//controlPositionAndRotation(&light1Transform, (float)deltaTime);
+		//setLocalTransform(transforms, stageLight1->transform, light1Transform);
+		//light1Transform.pos.x = -light1Transform.pos.x;
+		//setLocalTransform(transforms, stageLight2->transform, light1Transform);
 
-		float t = (float)glfwGetTime();
+		float t = (float)time;
 		lightPos.x = 8 * cos(t);
 		lightPos.z = 10 * sin(t);
 		lightPos.y = 10 + 2 * cos(0.2f * t);
 
-		vec3 carCenter = carModel->getCenter();
-		vec3 light1Center = stageLight1->getCenter();
-		vec3 light2Center = stageLight2->getCenter();
+		vec3 carCenter = carModel->getCenter(transforms);
+		vec3 light1Center = stageLight1->getCenter(transforms);
+		vec3 light2Center = stageLight2->getCenter(transforms);
 		vec3 light1Dir = carCenter - light1Center;
 		vec3 light2Dir = carCenter - light2Center;
 		float light1XRotBase = atan2(light1Dir.y, light1Dir.z);
@@ -263,193 +527,453 @@ int main()
 		quat light1XRot = rotationQuat(vec3(1, 0, 0), light1XRotBase);
 		quat light2XRot = rotationQuat(vec3(1, 0, 0), light2XRotBase);
 
-		stageLight1->transform.rotation = rotationQuat(vec3(0, 1, 0), light1YRotBase);
-		stageLight2->transform.rotation = rotationQuat(vec3(0, 1, 0), light2YRotBase);
-		stageLight1->localTransforms[4].rotation = light1XRot;
-		stageLight1->localTransforms[5].rotation = light1XRot;
-		stageLight2->localTransforms[4].rotation = light2XRot;
-		stageLight2->localTransforms[5].rotation = light2XRot;
-		
-		vec3 stageLight1Dir = rotate(vec3(0, 0, -1), stageLight1->transform.rotation);
-		vec3 stageLight2Dir = rotate(vec3(0, 0, -1), stageLight2->transform.rotation);
-		stageLight1Dir = normalize(rotate(stageLight1Dir, stageLight1->localTransforms[4].rotation));
-		stageLight2Dir = normalize(rotate(stageLight2Dir, stageLight2->localTransforms[4].rotation));
+		quat light1YRot = rotationQuat(vec3(0, 1, 0), light1YRotBase);
+		quat light2YRot = rotationQuat(vec3(0, 1, 0), light2YRotBase);
+		setTransformRotation(transforms, stageLight1->transform, light1YRot);
+		setTransformRotation(transforms, stageLight2->transform, light2YRot);
+		setTransformRotation(transforms, stageLight1->localTransforms[4], light1XRot);
+		setTransformRotation(transforms, stageLight1->localTransforms[5], light1XRot);
+		setTransformRotation(transforms, stageLight2->localTransforms[4], light2XRot);
+		setTransformRotation(transforms, stageLight2->localTransforms[5], light2XRot);
+
+		vec3 stageLight1Dir = rotate(vec3(0, 0, -1), light1YRot);
+		vec3 stageLight2Dir = rotate(vec3(0, 0, -1), light2YRot);
+		stageLight1Dir = normalize(rotate(stageLight1Dir, light1XRot));
+		stageLight2Dir = normalize(rotate(stageLight2Dir, light2XRot));
+
+		// everything that moves has moved, bring the world matrices up to date once for the whole frame
+		{
+			CPU_PROFILE("update transforms");
+			updateTransforms(transforms);
+		}
 
 		vec3 cameraPos = vec3(0, 0, -cameraDist);
 		cameraPos = rotate(cameraPos, vec3(1, 0, 0), cameraRotX);
 		cameraPos = rotate(cameraPos, vec3(0, 1, 0), cameraRotY);
 		vec3 cameraDir = normalize(-cameraPos);
+		mat4 view = lookAtMatLH(cameraPos, cameraDir, vec3(0, 1, 0));
+		// the light grid's depth slices end at FarPlane too, so nothing is drawn past the last one
+		mat4 projection = perspectiveMatLH(radians(60.0f), (float)packet.width / packet.height, 0.001f, FarPlane);
+		mat4 viewProjection = projection * view;
+
+		mat4 carMatrix = getWorldMatrix(transforms, carModel->transform);
+		std::vector<vec3> &lightPositions = packet.spotlightPositions;
+		std::vector<vec3> &lightDirections = packet.spotlightDirections;
+		lightPositions.resize(NumSpotlights);
+		lightDirections.resize(NumSpotlights);
+		for (int i = 0; i < 2; ++i)
+		{
+			lightPositions[i] = (carMatrix * vec4(HeadlightOffsets[i], 1)).xyz;
+			lightDirections[i] = normalize((carMatrix * vec4(HeadlightDirections[i], 0)).xyz);
+		}
+		lightPositions[2] = light1Center;
+		lightDirections[2] = stageLight1Dir;
+		lightPositions[3] = light2Center;
+		lightDirections[3] = stageLight2Dir;
+		for (int z = 0; z < NumRigLightsZ; ++z)
+		{
+			for (int x = 0; x < NumRigLightsX; ++x)
+			{
+				int i = z * NumRigLightsX + x;
+				float phase = 0.7f * i;
+				vec3 pos = vec3(RigSpacing * (x - 0.5f * (NumRigLightsX - 1)), RigHeight, RigSpacing * (z - 0.5f * (NumRigLightsZ - 1)));
+				lightPositions[4 + i] = pos;
+
+				// a moving light would need its shadow rendered again every frame, so only the others sweep
+				if (isRigLightShadowed(x, z))
+					lightDirections[4 + i] = normalize(vec3(-RigSweep * pos.x / RigHeight, -1, -RigSweep * pos.z / RigHeight));
+				else
+					lightDirections[4 + i] = normalize(vec3(RigSweep * sin(0.7f * t + phase), -1, RigSweep * cos(0.9f * t + phase)));
+			}
+		}
+
+		// only shadows that fall on something the camera sees matter, everything is inside the garage.
+		// The reflection probe sees all of the garage from the car though, so as long as the car is
+		// on screen all of it is a receiver
+		vec3 garageMin, garageMax, receiverMin, receiverMax;
+		transformAABB(vec3(-1), vec3(1), getWorldMatrix(transforms, garageModel.transform), &garageMin, &garageMax);
+		bool receiversVisible = true;
+		if (!frustumCullAABB(carModel->minAABB, carModel->maxAABB, viewProjection * carMatrix))
+		{
+			receiverMin = garageMin;
+			receiverMax = garageMax;
+		}
+		else
+			receiversVisible = getVisibleReceiverBounds(viewProjection, cameraPos, garageMin, garageMax, &receiverMin, &receiverMax);
+
+		std::vector<Model> &shadowCasters = packet.shadowCasters;
+		shadowCasters.clear();
+		if (receiversVisible)
+			addShadowCasters(&shadowCasters, transforms, carModel, lightPos, receiverMin, receiverMax);
+
+		mat4 cubeViewProjections[6];
+		for (int i = 0; i < 6; ++i)
+			cubeViewProjections[i] = cubeProjection * lookAtMatRH(lightPos, CubeDirections[i], CubeUpVectors[i]);
+
+		// the car parts first, then the stage lights
+		sceneModels.clear();
+		for (const CompositeModel *model : { carModel, stageLight1, stageLight2 })
+		{
+			for (int i = 0; i < model->numModels; ++i)
+				sceneModels.push_back(model->getModel(i));
+		}
+
+		// culling for the camera and the point light's six cube faces, and the sort keys of the
+		// transparent parts, are spread over the job system
+		int numSceneModels = (int)sceneModels.size();
+		int numCasters = (int)shadowCasters.size();
+		cameraVisible.resize(numSceneModels);
+		cameraDistances.resize(numSceneModels);
+		packet.casterVisible.resize(6 * numCasters);
+		auto cullForCamera = [&](int begin, int end)
+		{
+			for (int i = begin; i < end; ++i)
+			{
+				const Model &model = sceneModels[i];
+				mat4 modelMatrix = getWorldMatrix(transforms, model.transform);
+				cameraVisible[i] = !frustumCullAABB(model.minAABB, model.maxAABB, viewProjection * modelMatrix);
 
-		if (renderMode == RenderWireframe)
+				vec3 center = 0.5f * (model.minAABB + model.maxAABB);
+				center = (modelMatrix * vec4(center, 1)).xyz;
+				cameraDistances[i] = lengthSq(cameraPos - center);
+			}
+		};
+		auto cullForPointLight = [&](int begin, int end)
+		{
+			for (int i = begin; i < end; ++i)
+			{
+				const Model &caster = shadowCasters[i % numCasters];
+				mat4 modelMatrix = getWorldMatrix(transforms, caster.transform);
+				packet.casterVisible[i] = !frustumCullAABB(caster.minAABB, caster.maxAABB, cubeViewProjections[i / numCasters] * modelMatrix);
+			}
+		};
+		JobCounter cullingDone;
+		runJobs(numSceneModels, CullJobGrainSize, cullForCamera, &cullingDone);
+		runJobs(6 * numCasters, CullJobGrainSize, cullForPointLight, &cullingDone);
+
+		// the renderer gets its own copy of the world matrices, the hierarchy keeps changing under it
+		packet.worldMatrices.assign(transforms->worldMatrices, transforms->worldMatrices + transforms->numNodes);
+
+		{
+			CPU_PROFILE("wait for culling");
+			waitForCounter(&cullingDone);
+		}
+
+		packet.opaqueCarModels.clear();
+		packet.stageLightModels.clear();
+		transparentModels.clear();
+		for (int i = 0; i < carModel->numModels; ++i)
+		{
+			const Model &model = sceneModels[i];
+			if (!cameraVisible[i])
+				continue;
+
+			if (model.material.alpha > 0.95)
+				packet.opaqueCarModels.push_back(model);
+			else
+				transparentModels.push_back({ model, cameraDistances[i] });
+		}
+		for (int i = carModel->numModels; i < numSceneModels; ++i)
+		{
+			if (cameraVisible[i])
+				packet.stageLightModels.push_back(sceneModels[i]);
+		}
+
+		{
+			CPU_PROFILE("sort transparent");
+			qsort(transparentModels.data(), transparentModels.size(), sizeof(transparentModels[0]), [](const void *left, const void *right)
+			{
+				const TransparentModel *lm = (const TransparentModel *)left;
+				const TransparentModel *rm = (const TransparentModel *)right;
+				return lm->distToCamera < rm->distToCamera ? +1 : -1; // farthest first, for blending
+			});
+		}
+		packet.transparentModels.clear();
+		for (const TransparentModel &trans : transparentModels)
+			packet.transparentModels.push_back(trans.model);
+
+		packet.cameraPos = cameraPos;
+		packet.cameraDir = cameraDir;
+		packet.view = view;
+		packet.projection = projection;
+		packet.viewProjection = viewProjection;
+		packet.lightPos = lightPos;
+		for (int i = 0; i < 6; ++i)
+			packet.cubeViewProjections[i] = cubeViewProjections[i];
+		packet.receiversVisible = receiversVisible;
+		packet.receiverMin = receiverMin;
+		packet.receiverMax = receiverMax;
+		packet.carCenter = carCenter;
+		// only the car and the garage cast shadows, and only the car can move
+		packet.shadowCasterHash = hashBytes(&carMatrix, sizeof(carMatrix));
+	};
+
+	auto render = [&](int packetIndex)
+	{
+		const FramePacket &packet = packets[packetIndex];
+		const mat4 *worldMatrices = packet.worldMatrices.data();
+		const std::vector<Model> &shadowCasters = packet.shadowCasters;
+		int numCasters = (int)shadowCasters.size();
+		vec3 cameraPos = packet.cameraPos;
+		vec3 cameraDir = packet.cameraDir;
+		vec3 lightPos = packet.lightPos;
+		mat4 viewProjection = packet.viewProjection;
+
+		// the shadow tiles of the lights belong to the render thread, only where they are comes from the packet
+		for (int i = 0; i < NumSpotlights; ++i)
+		{
+			spotlights[i].pos = packet.spotlightPositions[i];
+			spotlights[i].dir = packet.spotlightDirections[i];
+		}
+
+		if (packet.quality != appliedQuality)
+		{
+			appliedQuality = packet.quality;
+			createQualityTargets(QualityTiers[appliedQuality], &garageReflection, &shadowProbe, dynamicResolution);
+		}
+		const QualitySettings &quality = QualityTiers[appliedQuality];
+		bool softShadows = quality.shadowTaps > 1;
+		setTemporalAA(dynamicResolution, packet.temporalAA);
+
+		// nothing moved before the first frame
+		if (previousWorldMatrices.size() != packet.worldMatrices.size())
+		{
+			previousWorldMatrices = packet.worldMatrices;
+			previousViewProjection = viewProjection;
+		}
+		const mat4 *previousMatrices = packet.temporalAA ? previousWorldMatrices.data() : NULL;
+
+		if (packet.renderMode == RenderWireframe)
 			glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 		else
 			glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-		
+
 		glEnable(GL_DEPTH_TEST);
 		glDisable(GL_BLEND);
 		//glDisable(GL_FRAMEBUFFER_SRGB);
-		
+
+		beginGpuFrame(gpuProfiler);
+		updateDynamicResolution(dynamicResolution, gpuProfiler, packet.width, packet.height);
+
+		beginGpuPass(gpuProfiler, "spot shadows");
+		updateShadowAtlas(&lightGrid.shadowAtlas, &spotlights[0], (int)spotlights.size(), shadowShader, packet.view, packet.projection, packet.height, packet.shadowCasterHash, [&](mat4 lightViewProjection)
+		{
+			drawModelToShadowMap(worldMatrices, carModel, lightViewProjection);
+
+			mat4 modelMatrix = worldMatrices[garageModel.transform];
+			setUniform(0, modelMatrix);
+			setUniform(1, lightViewProjection * modelMatrix);
+			drawMesh(garageModel.mesh);
+		});
+		endGpuPass(gpuProfiler);
+
+		beginGpuPass(gpuProfiler, "light culling");
+		uploadLights(&lightGrid, &spotlights[0], (int)spotlights.size());
+		cullLights(&lightGrid, packet.view, packet.projection, dynamicResolution->width, dynamicResolution->height);
+		endGpuPass(gpuProfiler);
+
 		glUseProgram(shadowShader);
 		setUniform(20, lightPos);
 		glUniform1f(21, FarPlane);
-		glViewport(0, 0, ShadowMapResolution, ShadowMapResolution);
+		glViewport(0, 0, quality.shadowMapResolution, quality.shadowMapResolution);
 
 		for (int i = 0; i < 6; ++i)
 		{
-			mat4 cubeView = lookAtMatRH(lightPos, CubeDirections[i], CubeUpVectors[i]);
-			mat4 cubeViewProjection = cubeProjection * cubeView;
+			mat4 cubeViewProjection = packet.cubeViewProjections[i];
+
+			// skipped faces still get their (tiny) pass so the overlay doesn't jump around
+			beginGpuPass(gpuProfiler, ShadowPassNames[i]);
 
+			// faces that don't see any visible receiver are just cleared to "no shadow", the
+			// reflection probe only reads them while the car is off screen and nobody sees it
 			glBindFramebuffer(GL_FRAMEBUFFER, shadowProbe.framebuffers[i]);
 			glClear(GL_DEPTH_BUFFER_BIT);
-			drawModelToShadowMap(carModel, cubeViewProjection);
-			
+			if (!packet.receiversVisible || frustumCullAABB(packet.receiverMin, packet.receiverMax, cubeViewProjection))
+			{
+				endGpuPass(gpuProfiler);
+				continue;
+			}
+
+			for (int caster = 0; caster < numCasters; ++caster)
+			{
+				if (packet.casterVisible[i * numCasters + caster])
+					drawModelToShadowMap(worldMatrices, shadowCasters[caster], cubeViewProjection, false);
+			}
+
 			//TODO: put these back after you remove the point light
 			// right now the stage lights just levitate and cast flying shadows
-			// 
-			//drawModelToShadowMap(stageLight1, cubeViewProjection);
-			//drawModelToShadowMap(stageLight2, cubeViewProjection);
+			//
+			//drawModelToShadowMap(worldMatrices, stageLight1, cubeViewProjection);
+			//drawModelToShadowMap(worldMatrices, stageLight2, cubeViewProjection);
 
-			mat4 modelMatrix = garageModel.transform.getMatrix();
+			mat4 modelMatrix = worldMatrices[garageModel.transform];
 			mat4 modelViewProjection = cubeViewProjection * modelMatrix;
 			setUniform(0, modelMatrix);
 			setUniform(1, modelViewProjection);
 			drawMesh(garageModel.mesh);
+			endGpuPass(gpuProfiler);
 		}
 
-		glUseProgram(garageShader);
-		mat4 garageModelMatrix = garageModel.transform.getMatrix();
+		uint32_t sceneVariant = getSceneShaderVariant(quality, packet.temporalAA);
+		if (packet.renderMode == RenderNormals)
+			sceneVariant |= LitRenderNormals;
+		ShaderProgram carShader = getShaderVariant(carShaders, sceneVariant);
+		ShaderProgram garageShader = getShaderVariant(garageShaders, sceneVariant);
+
+		glUseProgram(getShaderVariant(garageShaders, ProbeShaderVariant));
+		mat4 garageModelMatrix = worldMatrices[garageModel.transform];
 		setUniform(0, garageModelMatrix);
 		setUniform(4, cameraPos);
 		setUniform(6, garageModel.material.ambientColor);
-		glUniform1ui(11, 0);
 		setUniform(20, lightPos);
 		glUniform1f(21, FarPlane);
-		glUniform1i(12, 0);
-		glUniform1i(13, 1);
-		glUniform1i(14, 2);
-		glUniform1i(22, 0);
-		glUniform1i(23, 0);
 		bindUniformCubeMap(12, 0, garageDiffuse);
-		bindUniformCubeMap(13, 1, garageNormal);
 		bindUniformCubeMap(14, 2, shadowProbe.depthMap);
-		//setUniform(30, stageLight1->transform.pos);
-		//setUniform(31, stageLight1Dir);
-		//setUniform(32, StageLightColor);
 
-		glViewport(0, 0, ReflectionMapResolution, ReflectionMapResolution);
+		glViewport(0, 0, quality.reflectionMapResolution, quality.reflectionMapResolution);
 
 		for (int i = 0; i < 6; ++i)
 		{
 			vec3 dir = CubeDirections[i];
-			mat4 cubeView = lookAtMatRH(carCenter, dir, CubeUpVectors[i]);
+			mat4 cubeView = lookAtMatRH(packet.carCenter, dir, CubeUpVectors[i]);
 			setUniform(1, cubeProjection * cubeView * garageModelMatrix);
 			setUniform(5, dir);
+			beginGpuPass(gpuProfiler, ReflectionPassNames[i]);
 			glBindFramebuffer(GL_FRAMEBUFFER, garageReflection.framebuffers[i]);
 			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 			drawMesh(garageModel.mesh);
+			endGpuPass(gpuProfiler);
 		}
 
 		glEnable(GL_BLEND);
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		bindScaledScene(dynamicResolution);
 		//glEnable(GL_FRAMEBUFFER_SRGB);
-		glViewport(0, 0, windowWidth, windowHeight);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		if (packet.temporalAA)
+		{
+			// the velocity is written as is, transparent surfaces included
+			const float noMotion[4] = {};
+			glClearBufferfv(GL_COLOR, 1, noMotion);
+			glDisablei(GL_BLEND, 1);
+		}
 
+		beginGpuPass(gpuProfiler, "car opaque");
 		glUseProgram(carShader);
-		mat4 view = lookAtMatLH(cameraPos, cameraDir, vec3(0, 1, 0));
-		mat4 projection = perspectiveMatLH(radians(60.0f), (float)windowWidth / windowHeight, 0.001f, 1000.0f);
-		mat4 viewProjection = projection * view;
 		setUniform(4, cameraPos);
 		setUniform(5, cameraDir);
+		if (packet.temporalAA)
+			glUniform2f(3, dynamicResolution->jitter.x, dynamicResolution->jitter.y);
 		glUniform1f(13, 0.2f);
 		setUniform(20, lightPos);
 		glUniform1f(21, FarPlane);
-		glUniform1i(12, 0);
-		glUniform1i(14, 1);
-		glUniform1i(23, 1);
+		if (softShadows)
+			glUniform1i(22, quality.shadowTaps);
 		bindUniformCubeMap(12, 0, garageReflection.colorMap);
 		bindUniformCubeMap(14, 1, shadowProbe.depthMap);
+		bindLightGrid(&lightGrid);
 
-		transparentModels.clear();
-
-		for (int i = 0; i < carModel->numModels; ++i)
-		{
-			Model model = carModel->getModel(i);
-			if (model.material.alpha > 0.95)
-				drawModel(model, viewProjection);
-			else
-			{
-				vec3 center = 0.5f * (model.minAABB + model.maxAABB);
-				center = (model.transform.getMatrix() * vec4(center, 1)).xyz;
-				float dist = lengthSq(cameraPos - center);
-				transparentModels.push_back({ model, dist });
-			}
-		}
+		for (const Model &model : packet.opaqueCarModels)
+			drawModel(worldMatrices, model, viewProjection, previousMatrices, previousViewProjection);
 
 		glUniform1f(13, 0.0f);
-		//for (int i = 0; i < stageLight1->numModels; ++i)
-		//	drawModel(stageLight1->getModel(i), viewProjection);
-		//for (int i = 0; i < stageLight2->numModels; ++i)
-		//	drawModel(stageLight2->getModel(i), viewProjection);
-		
+		for (const Model &model : packet.stageLightModels)
+			drawModel(worldMatrices, model, viewProjection, previousMatrices, previousViewProjection);
+		endGpuPass(gpuProfiler);
+
+		beginGpuPass(gpuProfiler, "garage");
 		glUseProgram(garageShader);
 		setUniform(0, garageModelMatrix);
 		setUniform(1, viewProjection * garageModelMatrix);
+		if (packet.temporalAA)
+			setUniform(2, previousViewProjection * previousMatrices[garageModel.transform]);
+		if (packet.temporalAA)
+			glUniform2f(3, dynamicResolution->jitter.x, dynamicResolution->jitter.y);
 		setUniform(20, lightPos);
 		glUniform1f(21, FarPlane);
+		if (softShadows)
+			glUniform1i(22, quality.shadowTaps);
 		setUniform(4, cameraPos);
 		setUniform(5, cameraDir);
 		setUniform(6, garageModel.material.ambientColor);
-		glUniform1ui(11, renderMode == RenderNormals);
 		bindUniformCubeMap(12, 0, garageDiffuse);
 		bindUniformCubeMap(13, 1, garageNormal);
 		bindUniformCubeMap(14, 2, shadowProbe.depthMap);
-		glUniform1i(22, 1);
-		glUniform1i(23, 1);
+		bindLightGrid(&lightGrid);
 		drawMesh(garageModel.mesh);
+		endGpuPass(gpuProfiler);
 
+		beginGpuPass(gpuProfiler, "transparent");
 		glUseProgram(carShader);
 		setUniform(4, cameraPos);
 		setUniform(5, cameraDir);
+		if (packet.temporalAA)
+			glUniform2f(3, dynamicResolution->jitter.x, dynamicResolution->jitter.y);
 		setUniform(20, lightPos);
 		glUniform1f(13, 0.2f);
 		glUniform1f(21, FarPlane);
-		glUniform1i(23, 1);
+		if (softShadows)
+			glUniform1i(22, quality.shadowTaps);
 		bindUniformCubeMap(12, 0, garageReflection.colorMap);
 		bindUniformCubeMap(14, 1, shadowProbe.depthMap);
-		
-		qsort(&transparentModels[0], transparentModels.size(), sizeof(transparentModels[0]), [](const void *left, const void *right)
-		{
-			const TransparentModel *lm = (const TransparentModel *)left;
-			const TransparentModel *rm = (const TransparentModel *)right;
-			return lm->distToCamera > rm->distToCamera ? +1 : -1;
-		});
-		for (const TransparentModel &trans : transparentModels)
-			drawModel(trans.model, viewProjection);
+		bindLightGrid(&lightGrid);
+		for (const Model &model : packet.transparentModels)
+			drawModel(worldMatrices, model, viewProjection, previousMatrices, previousViewProjection);
+		endGpuPass(gpuProfiler);
+
+		beginGpuPass(gpuProfiler, "resolve");
+		resolveScene(dynamicResolution);
+		endGpuPass(gpuProfiler);
+
+		// the text is drawn on top at native resolution
+		beginGpuPass(gpuProfiler, "upscale");
+		upscaleScene(dynamicResolution, backbuffer, packet.width, packet.height);
+		endGpuPass(gpuProfiler);
+		glEnable(GL_BLEND);
 
 		glDisable(GL_DEPTH_TEST);
 
+		beginGpuPass(gpuProfiler, "text");
+		beginText(packet.width, packet.height);
 		char string[256];
-		sprintf(string, "%.1lf fps", 1 / deltaTime);
-		drawString(segoeUi, string, vec2(10, 20), false, vec2(0.5));
+		if (packet.showProfiler)
+			sprintf(string, "%.1lf fps, %.1lf ms input latency, %.0f%% resolution%s", 1 / packet.deltaTime, getInputLatencyMs(), 100 * dynamicResolution->scale, packet.temporalAA ? ", TAA" : "");
+		else
+			sprintf(string, "%.1lf fps", 1 / packet.deltaTime);
+		setTextLayoutString(statusText, string);
+		drawTextLayout(statusText, vec2(10, 20));
+		if (packet.showProfiler)
+			drawGpuProfiler(gpuProfiler, segoeUi, vec2(10, 40));
 		//sprintf(string, "camera = [%.1f %.1f %.1f]", cameraPos.x, cameraPos.y, cameraPos.z);
 		//drawString(segoeUi, string, vec2(10, 40), false, vec2(0.5));
 		//sprintf(string, "light = [%.1f %.1f %.1f]", lightPos.x, lightPos.y, lightPos.z);
 		//drawString(segoeUi, string, vec2(10, 60), false, vec2(0.5));
-		//
-		//vec3 dir = rotate(vec3(0, 0, 1), stageLight1->transform.rotation);
-		//sprintf(string, "pos = [%.4f %.4f %.4f]", stageLight1->transform.pos.x, stageLight1->transform.pos.y, stageLight1->transform.pos.z);
-		//drawString(segoeUi, string, vec2(10, 100), false, vec2(0.5));
-		//sprintf(string, "dir = [%.4f %.4f %.4f]", dir.x, dir.y, dir.z);
-		//drawString(segoeUi, string, vec2(10, 120), false, vec2(0.5));
-		//sprintf(string, "rot = [%.4f %.4f %.4f %.4f]", stageLight1->transform.rotation.x, stageLight1->transform.rotation.y, stageLight1->transform.rotation.z, stageLight1->transform.rotation.w);
-		//drawString(segoeUi, string, vec2(10, 140), false, vec2(0.5));
+		flushText();
+		endGpuPass(gpuProfiler);
+
+		previousWorldMatrices = packet.worldMatrices;
+		previousViewProjection = viewProjection;
 
 		glCheckErrors();
-		glfwSwapBuffers(window);
-	});
+		if (benchmark)
+			endBenchmarkFrame(benchmark, gpuProfiler);
+		else if (regression)
+			endRegressionFrame(regression, packet.frame, packet.width, packet.height, gpuProfiler);
+		else
+		{
+			CPU_PROFILE("swap buffers");
+			glfwSwapBuffers(window);
+		}
+	};
+
+	startGameLoop(simulate, render, numFrames, fixedDeltaTime);
+
+	if (benchmark && !finishBenchmark(benchmark, gpuProfiler))
+		return 1;
+	if (regression && !finishRegressionSuite(regression, gpuProfiler))
+		return 1;
 
+	writeCpuTrace(CpuTraceFilename);
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,85 @@
+#include "options.h"
+#include "quality.h"
+
+#include <string.h>
+
+// Returns how many arguments the option at argv[i] took, 0 if it isn't one of these, -1 for a bad value.
+static int parseRunOption(int argc, char **argv, int i, RunOptions *options)
+{
+	const char *arg = argv[i];
+	const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+	if (strcmp(arg, "--fps") == 0 && value)
+	{
+		options->pacing.maxFrameRate = atof(value);
+		return 2;
+	}
+	if (strcmp(arg, "--no-vsync") == 0)
+	{
+		options->pacing.vsync = false;
+		return 1;
+	}
+	if (strcmp(arg, "--max-queued-frames") == 0 && value)
+	{
+		options->pacing.maxQueuedFrames = atoi(value);
+		return 2;
+	}
+	if (strcmp(arg, "--target-gpu-ms") == 0 && value)
+	{
+		options->targetGpuMs = (float)atof(value);
+		return 2;
+	}
+	if (strcmp(arg, "--quality") == 0 && value)
+	{
+		QualityTier tier;
+		if (!parseQualityTier(value, &tier))
+		{
+			fprintf(stderr, "ERROR: expected --quality low, medium, high or ultra, got '%s'\n", value);
+			return -1;
+		}
+		options->quality = tier;
+		return 2;
+	}
+	if (strcmp(arg, "--taa") == 0)
+	{
+		options->temporalAA = true;
+		return 1;
+	}
+	return 0;
+}
+
+static bool checkRunOptions(const RunOptions *options)
+{
+	if (options->pacing.maxFrameRate < 0 || options->pacing.maxQueuedFrames < 1 || options->pacing.maxQueuedFrames > MaxQueuedFrames)
+	{
+		fprintf(stderr, "ERROR: --fps can't be negative and --max-queued-frames has to be 1 to %d\n", MaxQueuedFrames);
+		return false;
+	}
+	if (options->targetGpuMs < 0)
+	{
+		fprintf(stderr, "ERROR: --target-gpu-ms can't be negative\n");
+		return false;
+	}
+	return true;
+}
+
+bool parseCommandLine(int argc, char **argv, RunOptions *runOptions, BenchmarkOptions *benchmarkOptions)
+{
+	for (int i = 1; i < argc; )
+	{
+		int numArgs = parseRunOption(argc, argv, i, runOptions);
+		if (numArgs == 0)
+			numArgs = parseBenchmarkOption(argc, argv, i, benchmarkOptions);
+
+		if (numArgs < 0)
+			return false;
+		if (numArgs == 0)
+		{
+			fprintf(stderr, "ERROR: unknown argument '%s'\n", argv[i]);
+			return false;
+		}
+		i += numArgs;
+	}
+
+	return checkRunOptions(runOptions) && checkBenchmarkOptions(benchmarkOptions);
+}
\ No newline at end of file
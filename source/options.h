@@ -0,0 +1,30 @@
+#pragma once
+
+#include "benchmark.h"
+#include "resolution.h"
+
+// Command line
+// ------------
+// Options of every run, benchmark or not:
+//
+//   car-demo [--fps N] [--no-vsync] [--max-queued-frames N] [--target-gpu-ms N] [--quality TIER] [--taa]
+//
+// --target-gpu-ms is the GPU frame time dynamic resolution aims for, 0 turns it off.
+// The benchmark and the regression suite always render at full resolution.
+// --quality is low, medium, high or ultra. Without it a normal run detects the tier at startup
+// and the benchmark and the regression suite use high.
+// --taa starts with temporal anti-aliasing instead of the tier's MSAA (F6 toggles it).
+//
+// The benchmark and the regression suite have options of their own, see benchmark.h.
+
+struct RunOptions
+{
+	FramePacing pacing;
+	float targetGpuMs = DefaultTargetGpuMs;
+	int quality = -1; // QualityTier, -1 if not given
+	bool temporalAA = false;
+};
+
+// Fills in both kinds of options. Returns false for unknown arguments and values that don't
+// make sense, after printing what's wrong.
+bool parseCommandLine(int argc, char **argv, RunOptions *runOptions, BenchmarkOptions *benchmarkOptions);
\ No newline at end of file
@@ -0,0 +1,307 @@
+#include "profiler.h"
+#include "jobs.h"
+
+#include <string.h>
+#include <vector>
+
+static std::atomic<CpuMarkerRing *> markerRings;
+static std::atomic<int> numMarkerRings;
+static uint64_t referenceTicks;
+static uint64_t referenceTimer;
+
+void initCpuProfiler()
+{
+	referenceTicks = getCpuTicks();
+	referenceTimer = getTimerValue();
+	nameCpuProfilerThread("main");
+}
+
+CpuMarkerRing *getThreadMarkerRing()
+{
+	static thread_local CpuMarkerRing *ring = NULL;
+	if (!ring)
+	{
+		// rings are never freed, a thread that exits leaves its markers in the trace
+		ring = (CpuMarkerRing *)calloc(1, sizeof(CpuMarkerRing));
+		ring->threadId = numMarkerRings++;
+		ring->next = markerRings.load();
+		while (!markerRings.compare_exchange_weak(ring->next, ring));
+	}
+	return ring;
+}
+
+void nameCpuProfilerThread(const char *name)
+{
+	getThreadMarkerRing()->threadName = name;
+}
+
+bool writeCpuTrace(const char *filename)
+{
+	FILE *file = fopen(filename, "wb");
+	if (!file)
+	{
+		fprintf(stderr, "ERROR: failed to open '%s' for writing the CPU trace\n", filename);
+		return false;
+	}
+
+	// measure the tick rate over everything since startup, that's precise enough for rdtsc
+	uint64_t ticks = getCpuTicks() - referenceTicks;
+	uint64_t timer = getTimerValue() - referenceTimer;
+	double microsecondsPerTick = timer > 0 && ticks > 0 ? 1e6 * timer / getTimerFrequency() / ticks : 1e6 / getTimerFrequency();
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"Car Demo\"}}");
+
+	int numMarkers = 0;
+	std::vector<CpuMarker> markers;
+	for (CpuMarkerRing *ring = markerRings.load(); ring; ring = ring->next)
+	{
+		if (ring->threadName)
+			fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", ring->threadId, ring->threadName);
+
+		// the owning thread keeps writing while we copy, so anything it could have overwritten
+		// in the meantime (including the slot it may be writing right now) is thrown away
+		uint32_t end = ring->numWritten.load(std::memory_order_acquire);
+		uint32_t begin = end > CpuMarkerRingSize ? end - CpuMarkerRingSize : 0;
+		markers.clear();
+		for (uint32_t i = begin; i != end; ++i)
+			markers.push_back(ring->markers[i & (CpuMarkerRingSize - 1)]);
+		uint32_t lapped = ring->numWritten.load(std::memory_order_acquire) - CpuMarkerRingSize;
+		
+		for (uint32_t i = begin; i != end; ++i)
+		{
+			if ((int32_t)(i - lapped) <= 0)
+				continue;
+
+			const CpuMarker &marker = markers[i - begin];
+			double start = (double)(int64_t)(marker.beginTicks - referenceTicks) * microsecondsPerTick;
+			double duration = (double)(marker.endTicks - marker.beginTicks) * microsecondsPerTick;
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				marker.name, ring->threadId, start, duration);
+			++numMarkers;
+		}
+	}
+
+	fprintf(file, "\n]}\n");
+	fclose(file);
+
+	printf("wrote %d CPU markers to '%s'\n", numMarkers, filename);
+	return true;
+}
+
+GpuProfiler *createGpuProfiler()
+{
+	GpuProfiler *profiler = (GpuProfiler *)calloc(1, sizeof(GpuProfiler));
+	glGenQueries(GpuProfilerLatency * MaxGpuPasses * 2, &profiler->queries[0][0][0]);
+	profiler->currentPass = -1;
+	glCheckErrors();
+	return profiler;
+}
+
+void beginGpuFrame(GpuProfiler *profiler)
+{
+	assert(profiler->currentPass == -1);
+
+	++profiler->frame;
+	int slot = profiler->frame % GpuProfilerLatency;
+
+	for (int pass = 0; pass < profiler->numPasses; ++pass)
+	{
+		if (!profiler->issued[slot][pass])
+			continue;
+		profiler->issued[slot][pass] = false;
+
+		// should practically always be there by now, but drop the sample rather than wait for it
+		GLuint available = 0;
+		glGetQueryObjectuiv(profiler->queries[slot][pass][1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			continue;
+
+		GLuint64 begin, end;
+		glGetQueryObjectui64v(profiler->queries[slot][pass][0], GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(profiler->queries[slot][pass][1], GL_QUERY_RESULT, &end);
+
+		int pos = profiler->historyPos[pass];
+		profiler->history[pass][pos] = (float)((double)(end - begin) * 1e-6);
+		profiler->historyPos[pass] = (pos + 1) % GpuProfilerHistory;
+		profiler->historySize[pass] = min(profiler->historySize[pass] + 1, GpuProfilerHistory);
+		++profiler->numSamplesTotal[pass];
+	}
+
+	glCheckErrors();
+}
+
+void flushGpuProfiler(GpuProfiler *profiler)
+{
+	glFinish();
+	for (int i = 0; i < GpuProfilerLatency; ++i)
+		beginGpuFrame(profiler);
+}
+
+int findGpuPass(const GpuProfiler *profiler, const char *name)
+{
+	for (int i = 0; i < profiler->numPasses; ++i)
+	{
+		if (profiler->passNames[i] == name || strcmp(profiler->passNames[i], name) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+void beginGpuPass(GpuProfiler *profiler, const char *name)
+{
+	assert(profiler->currentPass == -1);
+
+	int pass = findGpuPass(profiler, name);
+	if (pass < 0)
+	{
+		if (profiler->numPasses == MaxGpuPasses)
+			return;
+
+		pass = profiler->numPasses++;
+		profiler->passNames[pass] = name;
+	}
+
+	int slot = profiler->frame % GpuProfilerLatency;
+	glQueryCounter(profiler->queries[slot][pass][0], GL_TIMESTAMP);
+	profiler->currentPass = pass;
+	profiler->passBeginTicks = getCpuTicks();
+}
+
+void endGpuPass(GpuProfiler *profiler)
+{
+	if (profiler->currentPass < 0)
+		return;
+
+	int slot = profiler->frame % GpuProfilerLatency;
+	glQueryCounter(profiler->queries[slot][profiler->currentPass][1], GL_TIMESTAMP);
+	profiler->issued[slot][profiler->currentPass] = true;
+	recordCpuMarker(profiler->passNames[profiler->currentPass], profiler->passBeginTicks, getCpuTicks());
+	profiler->currentPass = -1;
+}
+
+TimingStats getTimingStats(float *samplesMs, int numSamples)
+{
+	TimingStats stats = {};
+	if (numSamples == 0)
+		return stats;
+
+	qsort(samplesMs, numSamples, sizeof(float), [](const void *left, const void *right)
+	{
+		float l = *(const float *)left;
+		float r = *(const float *)right;
+		return l < r ? -1 : (l > r ? +1 : 0);
+	});
+
+	double sum = 0;
+	for (int i = 0; i < numSamples; ++i)
+		sum += samplesMs[i];
+
+	stats.minMs = samplesMs[0];
+	stats.avgMs = (float)(sum / numSamples);
+	stats.p50Ms = samplesMs[min(numSamples - 1, (int)(0.50f * numSamples))];
+	stats.p95Ms = samplesMs[min(numSamples - 1, (int)(0.95f * numSamples))];
+	stats.p99Ms = samplesMs[min(numSamples - 1, (int)(0.99f * numSamples))];
+	stats.numSamples = numSamples;
+	return stats;
+}
+
+TimingStats getGpuPassStats(const GpuProfiler *profiler, int pass)
+{
+	float samples[GpuProfilerHistory];
+	memcpy(samples, profiler->history[pass], profiler->historySize[pass] * sizeof(float));
+	return getTimingStats(samples, profiler->historySize[pass]);
+}
+
+float getGpuPassSample(const GpuProfiler *profiler, int pass, int age)
+{
+	assert(age >= 0 && age < profiler->historySize[pass]);
+	int pos = (profiler->historyPos[pass] - 1 - age + GpuProfilerHistory) % GpuProfilerHistory;
+	return profiler->history[pass][pos];
+}
+
+void collectGpuPassSamples(GpuPassSamples *samples, const GpuProfiler *profiler, bool keep)
+{
+	for (int pass = 0; pass < profiler->numPasses; ++pass)
+	{
+		// at most a few new samples per frame, they can't have fallen out of the history yet
+		uint32_t numNew = profiler->numSamplesTotal[pass] - samples->numSeen[pass];
+		for (int age = (int)numNew - 1; age >= 0 && keep; --age)
+			samples->samplesMs[pass].push_back(getGpuPassSample(profiler, pass, age));
+		samples->numSeen[pass] = profiler->numSamplesTotal[pass];
+	}
+}
+
+struct OverlayLabel
+{
+	char text[64];
+	vec2 position;
+	vec4 color;
+	int numVertices;
+	TextVertex vertices[4 * 64];
+};
+
+static void addOverlayLabel(std::vector<OverlayLabel> *labels, const char *text, vec2 position, vec4 color = vec4(1))
+{
+	labels->emplace_back();
+	OverlayLabel &label = labels->back();
+	snprintf(label.text, sizeof(label.text), "%s", text);
+	label.position = position;
+	label.color = color;
+}
+
+float drawGpuProfiler(const GpuProfiler *profiler, const Font *font, vec2 position, vec2 scale)
+{
+	// the font isn't monospaced, so every column is a label of its own
+	const float columnX[] = { 0, 220, 300, 380 };
+	float lineHeight = 40 * scale.y;
+	vec4 headerColor = vec4(1, 1, 0.5f, 1);
+
+	static std::vector<OverlayLabel> labels;
+	labels.clear();
+
+	const char *headers[] = { "GPU pass", "min", "avg", "p99" };
+	for (int i = 0; i < 4; ++i)
+		addOverlayLabel(&labels, headers[i], position + vec2(columnX[i] * scale.x * 2, 0), headerColor);
+
+	float total[3] = {};
+	char string[64];
+	for (int pass = 0; pass < profiler->numPasses; ++pass)
+	{
+		TimingStats stats = getGpuPassStats(profiler, pass);
+		float values[] = { stats.minMs, stats.avgMs, stats.p99Ms };
+		vec2 linePos = position + vec2(0, (pass + 1) * lineHeight);
+
+		addOverlayLabel(&labels, profiler->passNames[pass], linePos);
+		for (int i = 0; i < 3; ++i)
+		{
+			sprintf(string, "%.2f", values[i]);
+			addOverlayLabel(&labels, string, linePos + vec2(columnX[i + 1] * scale.x * 2, 0));
+			total[i] += values[i];
+		}
+	}
+
+	// the per pass percentiles don't add up to the frame's, but the sum is still a useful ballpark
+	vec2 totalPos = position + vec2(0, (profiler->numPasses + 1) * lineHeight);
+	addOverlayLabel(&labels, "total", totalPos, headerColor);
+	for (int i = 0; i < 3; ++i)
+	{
+		sprintf(string, "%.2f", total[i]);
+		addOverlayLabel(&labels, string, totalPos + vec2(columnX[i + 1] * scale.x * 2, 0), headerColor);
+	}
+
+	// the layout is spread over the job system, only the draws have to stay on this thread
+	{
+		CPU_PROFILE("layout profiler text");
+		parallelFor((int)labels.size(), 16, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; ++i)
+				labels[i].numVertices = layoutString(font, labels[i].text, false, scale, labels[i].color, labels[i].vertices);
+		});
+	}
+	for (const OverlayLabel &label : labels)
+		drawTextVertices(font, label.vertices, label.numVertices, label.position);
+
+	return (profiler->numPasses + 2) * lineHeight;
+}
\ No newline at end of file
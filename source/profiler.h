@@ -0,0 +1,157 @@
+#pragma once
+
+#include "system.h"
+#include "graphics.h"
+#include <atomic>
+#include <vector>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define CPU_PROFILER_RDTSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CPU_PROFILER_RDTSC
+#endif
+
+// CPU profiler
+// ------------
+// Scoped markers record their begin and end ticks into a ring buffer that belongs to the
+// current thread, so recording never takes a lock and costs two timer reads and a store.
+// Ticks come straight from rdtsc where there is one, and are converted to real time against
+// getTimerValue only when the trace is written. Old markers are overwritten once the
+// ring is full, the trace always holds the most recent CpuMarkerRingSize markers per thread.
+// The trace is Chrome's JSON trace event format, which both chrome://tracing and
+// ui.perfetto.dev can open.
+
+constexpr int CpuMarkerRingSize = 1 << 16; // has to be a power of 2
+constexpr const char *CpuTraceFilename = "cpu-trace.json";
+
+struct CpuMarker
+{
+	const char *name;
+	uint64_t beginTicks;
+	uint64_t endTicks;
+};
+
+struct CpuMarkerRing
+{
+	CpuMarker markers[CpuMarkerRingSize];
+	std::atomic<uint32_t> numWritten; // only ever written by the owning thread
+	int threadId;
+	const char *threadName;
+	CpuMarkerRing *next;
+};
+
+inline uint64_t getCpuTicks()
+{
+#ifdef CPU_PROFILER_RDTSC
+	return __rdtsc();
+#else
+	return getTimerValue();
+#endif
+}
+
+// Has to be called once the timer works, initSystem does that.
+void initCpuProfiler();
+CpuMarkerRing *getThreadMarkerRing();
+// The name shows up in the trace viewer, the string has to stay around.
+void nameCpuProfilerThread(const char *name);
+// Writes every thread's markers as a Chrome trace, can be called from any thread at any time.
+bool writeCpuTrace(const char *filename);
+
+inline void recordCpuMarker(const char *name, uint64_t beginTicks, uint64_t endTicks)
+{
+	static thread_local CpuMarkerRing *ring = getThreadMarkerRing();
+	uint32_t index = ring->numWritten.load(std::memory_order_relaxed);
+	ring->markers[index & (CpuMarkerRingSize - 1)] = { name, beginTicks, endTicks };
+	ring->numWritten.store(index + 1, std::memory_order_release);
+}
+
+struct CpuProfileScope
+{
+	const char *name;
+	uint64_t beginTicks;
+
+	CpuProfileScope(const char *name) : name(name), beginTicks(getCpuTicks()) {}
+	~CpuProfileScope() { recordCpuMarker(name, beginTicks, getCpuTicks()); }
+};
+
+#define CPU_PROFILE_CONCAT2(a, b) a##b
+#define CPU_PROFILE_CONCAT(a, b) CPU_PROFILE_CONCAT2(a, b)
+// Times the rest of the enclosing scope, the name has to be a string literal (or live just as long).
+#define CPU_PROFILE(name) CpuProfileScope CPU_PROFILE_CONCAT(cpuProfileScope, __LINE__)(name)
+
+// GPU profiler
+// ------------
+// Every pass is bracketed by two GL_TIMESTAMP queries. The queries of a frame are only read
+// back GpuProfilerLatency frames later, by which time the GPU has long finished them, so
+// profiling never stalls the pipeline. The per pass times of the last GpuProfilerHistory frames
+// are kept around for the min/avg/p99 overlay.
+
+constexpr int MaxGpuPasses = 32;
+constexpr int GpuProfilerLatency = 3; // frames between issuing the queries and reading them back
+constexpr int GpuProfilerHistory = 128;
+
+struct TimingStats
+{
+	float minMs;
+	float avgMs;
+	float p50Ms;
+	float p95Ms;
+	float p99Ms;
+	int numSamples;
+};
+
+// Sorts the samples in place.
+TimingStats getTimingStats(float *samplesMs, int numSamples);
+
+struct GpuProfiler
+{
+	int numPasses;
+	const char *passNames[MaxGpuPasses];
+
+	// [frame % GpuProfilerLatency][pass][begin, end]
+	GLuint queries[GpuProfilerLatency][MaxGpuPasses][2];
+	bool issued[GpuProfilerLatency][MaxGpuPasses];
+	int frame;
+	int currentPass; // -1 if no pass is open
+	uint64_t passBeginTicks; // every pass is a CPU marker as well
+
+	float history[MaxGpuPasses][GpuProfilerHistory]; // ring buffer of pass times in milliseconds
+	int historySize[MaxGpuPasses];
+	int historyPos[MaxGpuPasses];
+	uint32_t numSamplesTotal[MaxGpuPasses]; // ever, so others can tell which samples are new
+};
+
+GpuProfiler *createGpuProfiler();
+
+// Call once at the start of every frame, reads back the results of an earlier frame.
+void beginGpuFrame(GpuProfiler *profiler);
+
+// Passes are identified by name, the string has to stay around (a literal is best).
+// Passes can't be nested. The CPU time spent submitting the pass is recorded as a CPU marker.
+void beginGpuPass(GpuProfiler *profiler, const char *name);
+void endGpuPass(GpuProfiler *profiler);
+
+// Returns -1 if there's no pass with that name.
+int findGpuPass(const GpuProfiler *profiler, const char *name);
+TimingStats getGpuPassStats(const GpuProfiler *profiler, int pass);
+// Returns the time of the pass from 'age' samples ago, 0 being the latest. Older samples
+// than GpuProfilerHistory are gone.
+float getGpuPassSample(const GpuProfiler *profiler, int pass, int age);
+// Waits for the GPU and reads back everything still in flight, call after the last frame.
+void flushGpuProfiler(GpuProfiler *profiler);
+
+// Every sample of every pass over a whole run, which the rolling history can't hold.
+struct GpuPassSamples
+{
+	std::vector<float> samplesMs[MaxGpuPasses];
+	uint32_t numSeen[MaxGpuPasses];
+};
+
+// Call once per frame after beginGpuFrame, adds (or with keep = false skips) the samples that
+// arrived since the last call. The samples read back in a frame are from GpuProfilerLatency frames ago.
+void collectGpuPassSamples(GpuPassSamples *samples, const GpuProfiler *profiler, bool keep = true);
+
+// Draws a table of all passes with their rolling min/avg/p99 in milliseconds, returns the height it took.
+float drawGpuProfiler(const GpuProfiler *profiler, const Font *font, vec2 position, vec2 scale = vec2(0.5f));
\ No newline at end of file
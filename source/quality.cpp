@@ -0,0 +1,92 @@
+#include "quality.h"
+#include "profiler.h"
+
+#include <string.h>
+
+const QualitySettings QualityTiers[NumQualityTiers] = {
+	//  name      shadow  reflection  format       msaa  taps
+	{ "low",      256,    128,        GL_RGB565,   0,    1 },
+	{ "medium",   512,    128,        GL_RGB,      2,    8 },
+	{ "high",     512,    256,        GL_RGB,      4,    MaxShadowTaps },
+	{ "ultra",    1024,   512,        GL_RGB16F,   8,    MaxShadowTaps },
+};
+
+const float QualityTierThresholds[NumQualityTiers] = { 0, 1, 4, 16 };
+
+constexpr int DetectionSize = 1024; // pixels per side of the detection pass
+constexpr int DetectionPasses = 16; // timed, after one more to warm up
+
+bool parseQualityTier(const char *name, QualityTier *tier)
+{
+	for (int i = 0; i < NumQualityTiers; ++i)
+	{
+		if (strcmp(name, QualityTiers[i].name) == 0)
+		{
+			*tier = (QualityTier)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+QualityTier detectQualityTier(float *gigapixelsPerSecond)
+{
+	CPU_PROFILE("detect quality tier");
+
+	// the upscale filter is a fair stand-in for a fullscreen pass: five texture taps and some math per pixel
+	ShaderProgram shader = loadShaderProgram("assets/shaders/upscale.vert.glsl", "assets/shaders/upscale.frag.glsl");
+	Texture source = createTexture(NULL, DetectionSize, DetectionSize, GL_RGBA, GL_RGBA8, GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, false);
+	Texture target = createTexture(NULL, DetectionSize, DetectionSize, GL_RGBA, GL_RGBA8, GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, false);
+	Framebuffer framebuffer = createFramebuffer(target);
+	VertexSpecification emptyVertexSpec;
+	glGenVertexArrays(1, &emptyVertexSpec);
+	GLuint query;
+	glGenQueries(1, &query);
+
+	glViewport(0, 0, DetectionSize, DetectionSize);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_BLEND);
+	glUseProgram(shader);
+	bindUniformTexture(0, 0, source);
+	glUniform2f(1, 1, 1);
+	glUniform2f(2, 1.0f / DetectionSize, 1.0f / DetectionSize);
+	glUniform2f(3, DetectionSize, DetectionSize);
+	glUniform1f(4, 1);
+	glBindVertexArray(emptyVertexSpec);
+
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glFinish();
+
+	uint64_t startTime = getTimerValue();
+	glBeginQuery(GL_TIME_ELAPSED, query);
+	for (int i = 0; i < DetectionPasses; ++i)
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+	glEndQuery(GL_TIME_ELAPSED);
+	glFinish();
+	double wallNs = 1e9 * getDeltaTime(startTime, getTimerValue());
+
+	// software renderers rasterize lazily and only time the submission, the wall clock catches that
+	GLuint64 queryNs = 0;
+	glGetQueryObjectui64v(query, GL_QUERY_RESULT, &queryNs);
+	float elapsedNs = (float)max((double)queryNs, wallNs);
+
+	glBindVertexArray(0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteQueries(1, &query);
+	glDeleteVertexArrays(1, &emptyVertexSpec);
+	glDeleteFramebuffers(1, &framebuffer);
+	glDeleteTextures(1, &target);
+	glDeleteTextures(1, &source);
+	glDeleteProgram(shader);
+	glCheckErrors();
+
+	float pixels = (float)DetectionPasses * DetectionSize * DetectionSize;
+	float throughput = pixels / max(elapsedNs, 1.0f); // pixels per ns are gigapixels per second
+	if (gigapixelsPerSecond)
+		*gigapixelsPerSecond = throughput;
+
+	int tier = 0;
+	while (tier + 1 < NumQualityTiers && throughput >= QualityTierThresholds[tier + 1])
+		++tier;
+	return (QualityTier)tier;
+}
\ No newline at end of file
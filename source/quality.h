@@ -0,0 +1,42 @@
+#pragma once
+
+#include "system.h"
+#include "graphics.h"
+
+// Quality tiers
+// -------------
+// Everything that trades image quality for GPU time, one row per tier. High is what the demo
+// always used to render with, the benchmark and the regression suite stick to it unless told
+// otherwise. Everything in here can change while running (F5 cycles through the tiers), the
+// render thread reallocates the probes and the scene target when the tier changes.
+//
+// Without --quality the tier is picked at startup by timing a few fullscreen filter passes,
+// which says roughly how many pixels per second the GPU gets through. The thresholds are
+// heuristics, not calibrated against measurements on real GPUs: medium from one gigapixel per
+// second, then four times as much for every tier above. Only llvmpipe (about 0.03, low) has
+// actually been measured, so pass --quality when the guess is off.
+
+struct QualitySettings
+{
+	const char *name;
+	int shadowMapResolution;     // faces of the point light's shadow cube map
+	int reflectionMapResolution; // faces of the reflection probe
+	GLenum reflectionFormat;
+	int msaaSamples;             // of the scene target, 0 for none
+	int shadowTaps;              // point light shadow lookups per fragment, 1 turns all shadow filtering off
+};
+
+constexpr int MaxShadowTaps = 20; // the length of ShadowSampleOffsets in the shaders
+
+extern const QualitySettings QualityTiers[NumQualityTiers];
+
+// Minimum measured throughput for each tier, in gigapixels per second of the detection pass.
+// Rough guesses, see above.
+extern const float QualityTierThresholds[NumQualityTiers];
+
+// Returns false for anything but "low", "medium", "high" and "ultra".
+bool parseQualityTier(const char *name, QualityTier *tier);
+
+// Times the detection pass and picks the highest tier the GPU is fast enough for.
+// Needs a current OpenGL context, takes a few milliseconds on a real GPU.
+QualityTier detectQualityTier(float *gigapixelsPerSecond = NULL);
\ No newline at end of file
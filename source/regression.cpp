@@ -0,0 +1,250 @@
+#include "regression.h"
+#include "lib/stb_image.h"
+
+#include <string.h>
+#include <math.h>
+
+static bool writeTga(const char *filename, const uint8_t *rgb, int width, int height)
+{
+	// uncompressed true color, top row first
+	uint8_t header[18] = {};
+	header[2] = 2;
+	header[12] = (uint8_t)width;
+	header[13] = (uint8_t)(width >> 8);
+	header[14] = (uint8_t)height;
+	header[15] = (uint8_t)(height >> 8);
+	header[16] = 24;
+	header[17] = 0x20;
+
+	size_t size = sizeof(header) + 3 * (size_t)width * height;
+	uint8_t *contents = (uint8_t *)malloc(size);
+	memcpy(contents, header, sizeof(header));
+	uint8_t *bgr = contents + sizeof(header);
+	for (int i = 0; i < width * height; ++i)
+	{
+		bgr[3 * i + 0] = rgb[3 * i + 2];
+		bgr[3 * i + 1] = rgb[3 * i + 1];
+		bgr[3 * i + 2] = rgb[3 * i + 0];
+	}
+
+	bool ok = writeWholeFile(filename, contents, size);
+	free(contents);
+	return ok;
+}
+
+static vec3 srgbToLab(const uint8_t *rgb)
+{
+	float linear[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		float c = rgb[i] / 255.0f;
+		linear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+	}
+
+	// D65 white point
+	float x = (0.4124f * linear[0] + 0.3576f * linear[1] + 0.1805f * linear[2]) / 0.9505f;
+	float y = (0.2126f * linear[0] + 0.7152f * linear[1] + 0.0722f * linear[2]);
+	float z = (0.0193f * linear[0] + 0.1192f * linear[1] + 0.9505f * linear[2]) / 1.0890f;
+
+	auto f = [](float t) { return t > 0.008856f ? cbrtf(t) : 7.787f * t + 16.0f / 116; };
+	float fx = f(x), fy = f(y), fz = f(z);
+	return vec3(116 * fy - 16, 500 * (fx - fy), 200 * (fy - fz));
+}
+
+static void blurLab(const uint8_t *rgb, vec3 *lab, int width, int height)
+{
+	vec3 *unblurred = (vec3 *)malloc(width * height * sizeof(vec3));
+	for (int i = 0; i < width * height; ++i)
+		unblurred[i] = srgbToLab(&rgb[3 * i]);
+
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			vec3 sum = vec3(0);
+			int n = 0;
+			for (int dy = max(y - 1, 0); dy <= min(y + 1, height - 1); ++dy)
+			{
+				for (int dx = max(x - 1, 0); dx <= min(x + 1, width - 1); ++dx)
+				{
+					sum += unblurred[dy * width + dx];
+					++n;
+				}
+			}
+			lab[y * width + x] = sum / (float)n;
+		}
+	}
+
+	free(unblurred);
+}
+
+// Returns the fraction of pixels that differ, writes a red-on-gray difference image into diff.
+static float compareImages(const uint8_t *actual, const uint8_t *golden, uint8_t *diff, int width, int height, float *outMeanDeltaE)
+{
+	int numPixels = width * height;
+	vec3 *actualLab = (vec3 *)malloc(numPixels * sizeof(vec3));
+	vec3 *goldenLab = (vec3 *)malloc(numPixels * sizeof(vec3));
+	blurLab(actual, actualLab, width, height);
+	blurLab(golden, goldenLab, width, height);
+
+	int numDifferent = 0;
+	double sumDeltaE = 0;
+	for (int i = 0; i < numPixels; ++i)
+	{
+		float deltaE = length(actualLab[i] - goldenLab[i]);
+		sumDeltaE += deltaE;
+
+		uint8_t gray = (uint8_t)(golden[3 * i + 1] / 4);
+		if (deltaE > RegressionMaxDeltaE)
+		{
+			++numDifferent;
+			diff[3 * i + 0] = (uint8_t)min(255.0f, 128 + 4 * deltaE);
+			diff[3 * i + 1] = gray;
+			diff[3 * i + 2] = gray;
+		}
+		else diff[3 * i + 0] = diff[3 * i + 1] = diff[3 * i + 2] = gray;
+	}
+
+	free(actualLab);
+	free(goldenLab);
+	*outMeanDeltaE = (float)(sumDeltaE / numPixels);
+	return (float)numDifferent / numPixels;
+}
+
+RegressionSuite *createRegressionSuite(const RegressionPose *poses, int numPoses, bool updateGoldens)
+{
+	RegressionSuite *suite = new RegressionSuite();
+	suite->poses = poses;
+	suite->numPoses = numPoses;
+	suite->updateGoldens = updateGoldens;
+	suite->pixels = (uint8_t *)malloc(3 * RegressionWidth * RegressionHeight);
+	return suite;
+}
+
+int getRegressionNumFrames(const RegressionSuite *suite)
+{
+	return suite->numPoses * RegressionFramesPerPose;
+}
+
+const RegressionPose &getRegressionPose(const RegressionSuite *suite, int frame)
+{
+	return suite->poses[min(frame / RegressionFramesPerPose, suite->numPoses - 1)];
+}
+
+void endRegressionFrame(RegressionSuite *suite, int frame, int width, int height, const GpuProfiler *gpuProfiler)
+{
+	// only time the second half of every pose, the first frames at a new pose re-render the shadow atlas
+	int sampleFrame = frame - GpuProfilerLatency;
+	collectGpuPassSamples(&suite->gpuPassSamples, gpuProfiler, sampleFrame >= 0 && sampleFrame % RegressionFramesPerPose >= RegressionFramesPerPose / 2);
+
+	if (frame % RegressionFramesPerPose != RegressionFramesPerPose - 1)
+		return;
+
+	assert(width == RegressionWidth && height == RegressionHeight);
+	const RegressionPose &pose = getRegressionPose(suite, frame);
+	readBackbuffer(suite->pixels, width, height);
+
+	char goldenFilename[256];
+	snprintf(goldenFilename, sizeof(goldenFilename), "%s/%s.tga", RegressionDirectory, pose.name);
+
+	if (suite->updateGoldens)
+	{
+		if (writeTga(goldenFilename, suite->pixels, RegressionWidth, RegressionHeight))
+			printf("regression: updated '%s'\n", goldenFilename);
+		else
+		{
+			fprintf(stderr, "ERROR: failed to write '%s'\n", goldenFilename);
+			++suite->numFailures;
+		}
+		return;
+	}
+
+	// the texture loaders flip everything for OpenGL, the goldens are compared top row first
+	int goldenWidth, goldenHeight, channels;
+	stbi_set_flip_vertically_on_load(0);
+	uint8_t *golden = stbi_load(goldenFilename, &goldenWidth, &goldenHeight, &channels, 3);
+	if (!golden || goldenWidth != RegressionWidth || goldenHeight != RegressionHeight)
+	{
+		printf("FAIL %s: no %dx%d golden image '%s', run with --update-goldens to make one\n", pose.name, RegressionWidth, RegressionHeight, goldenFilename);
+		++suite->numFailures;
+		stbi_image_free(golden);
+		return;
+	}
+
+	uint8_t *diff = (uint8_t *)malloc(3 * RegressionWidth * RegressionHeight);
+	float meanDeltaE;
+	float different = compareImages(suite->pixels, golden, diff, RegressionWidth, RegressionHeight, &meanDeltaE);
+	bool passed = different <= RegressionMaxDifferentPixels;
+
+	printf("%s image %s: %.3f%% of pixels differ (%.3f%% allowed), mean difference %.2f\n",
+		passed ? "PASS" : "FAIL", pose.name, 100 * different, 100 * RegressionMaxDifferentPixels, meanDeltaE);
+
+	// leave the evidence in the working directory
+	if (!passed)
+	{
+		char filename[256];
+		snprintf(filename, sizeof(filename), "regression-%s-actual.tga", pose.name);
+		writeTga(filename, suite->pixels, RegressionWidth, RegressionHeight);
+		snprintf(filename, sizeof(filename), "regression-%s-diff.tga", pose.name);
+		writeTga(filename, diff, RegressionWidth, RegressionHeight);
+		++suite->numFailures;
+	}
+
+	free(diff);
+	stbi_image_free(golden);
+}
+
+// One "<pass name> <milliseconds>" per line, # starts a comment.
+static int checkGpuBudgets(const RegressionSuite *suite, const GpuProfiler *gpuProfiler)
+{
+	char *budgets = readWholeFile(RegressionBudgetsFile);
+	if (!budgets)
+	{
+		printf("FAIL: couldn't read the GPU budgets from '%s'\n", RegressionBudgetsFile);
+		return 1;
+	}
+
+	int numFailures = 0;
+	for (char *line = strtok(budgets, "\r\n"); line; line = strtok(NULL, "\r\n"))
+	{
+		char *separator = strrchr(line, ' ');
+		if (line[0] == '#' || !separator)
+			continue;
+
+		*separator = 0;
+		float budgetMs = (float)atof(separator + 1);
+		int pass = findGpuPass(gpuProfiler, line);
+		if (pass < 0)
+		{
+			// a pass that was renamed or removed would otherwise silently lose its budget
+			printf("FAIL budget %s: there's no such GPU pass\n", line);
+			++numFailures;
+			continue;
+		}
+
+		std::vector<float> samples = suite->gpuPassSamples.samplesMs[pass];
+		TimingStats stats = getTimingStats(samples.data(), (int)samples.size());
+		bool passed = stats.numSamples > 0 && stats.p50Ms <= budgetMs;
+		printf("%s budget %s: median %.3f ms, budget %.3f ms\n", passed ? "PASS" : "FAIL", line, stats.p50Ms, budgetMs);
+		if (!passed)
+			++numFailures;
+	}
+
+	free(budgets);
+	return numFailures;
+}
+
+bool finishRegressionSuite(RegressionSuite *suite, GpuProfiler *gpuProfiler)
+{
+	flushGpuProfiler(gpuProfiler);
+	collectGpuPassSamples(&suite->gpuPassSamples, gpuProfiler);
+
+	if (!suite->updateGoldens)
+		suite->numFailures += checkGpuBudgets(suite, gpuProfiler);
+
+	if (suite->numFailures > 0)
+		printf("regression: %d FAILED\n", suite->numFailures);
+	else
+		printf("regression: all passed\n");
+	return suite->numFailures == 0;
+}
\ No newline at end of file
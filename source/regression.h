@@ -0,0 +1,55 @@
+#pragma once
+
+#include "profiler.h"
+
+// Regression suite
+// ----------------
+// Renders a fixed set of poses offscreen and compares each one against a golden image in
+// RegressionDirectory, and checks the median GPU time of every profiler pass against the
+// budgets in RegressionBudgetsFile. Every pose is rendered for a few frames before it's
+// captured so that the budgeted shadow atlas updates have caught up, and so that there are
+// enough GPU samples for the budgets.
+//
+// Images are compared in CIELAB after a 3x3 blur, so that a single pixel of aliasing
+// moving around doesn't count, while anything a person would notice does. The goldens are
+// only valid for the renderer they were made with, regenerate them with --update-goldens
+// after intentional changes to the output.
+//
+//   car-demo --regress [--headless] [--update-goldens]
+
+constexpr int RegressionWidth = 480;
+constexpr int RegressionHeight = 270;
+constexpr int RegressionFramesPerPose = 24;
+constexpr float RegressionMaxDeltaE = 3.0f; // a pixel differs if its CIE76 color difference is larger than this
+constexpr float RegressionMaxDifferentPixels = 0.002f; // fraction of the image that may differ
+constexpr const char *RegressionDirectory = "assets/regression";
+constexpr const char *RegressionBudgetsFile = "assets/regression/budgets.txt";
+
+struct RegressionPose
+{
+	const char *name;
+	float cameraRotX;
+	float cameraRotY;
+	float cameraDist;
+	double time; // scene time the pose is frozen at
+};
+
+struct RegressionSuite
+{
+	const RegressionPose *poses;
+	int numPoses;
+	bool updateGoldens;
+	int numFailures;
+	uint8_t *pixels;
+	GpuPassSamples gpuPassSamples;
+};
+
+RegressionSuite *createRegressionSuite(const RegressionPose *poses, int numPoses, bool updateGoldens);
+int getRegressionNumFrames(const RegressionSuite *suite);
+// The pose to render in the given frame.
+const RegressionPose &getRegressionPose(const RegressionSuite *suite, int frame);
+// Call at the very end of every frame, captures and checks the image on the last frame of each pose.
+// The size is the one the frame was rendered at.
+void endRegressionFrame(RegressionSuite *suite, int frame, int width, int height, const GpuProfiler *gpuProfiler);
+// Checks the GPU budgets and prints a summary, returns true if everything passed.
+bool finishRegressionSuite(RegressionSuite *suite, GpuProfiler *gpuProfiler);
\ No newline at end of file
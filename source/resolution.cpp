@@ -0,0 +1,255 @@
+#include "resolution.h"
+
+static void freeTargets(DynamicResolution *resolution)
+{
+	if (!resolution->sceneFramebuffer)
+		return;
+
+	glDeleteFramebuffers(1, &resolution->sceneFramebuffer);
+	glDeleteRenderbuffers(2, resolution->sceneRenderbuffers);
+	glDeleteFramebuffers(1, &resolution->resolveFramebuffer);
+	glDeleteTextures(1, &resolution->resolvedScene);
+	glDeleteTextures(1, &resolution->velocity);
+	glDeleteTextures(2, resolution->history);
+	glDeleteFramebuffers(2, resolution->historyFramebuffers);
+	resolution->sceneFramebuffer = 0;
+	resolution->sceneRenderbuffers[0] = resolution->sceneRenderbuffers[1] = 0;
+	resolution->resolveFramebuffer = 0;
+	resolution->velocity = 0;
+	resolution->history[0] = resolution->history[1] = 0;
+	resolution->historyFramebuffers[0] = resolution->historyFramebuffers[1] = 0;
+}
+
+// The scene renders straight into the textures the resolve reads, no samples to resolve.
+static void allocateTemporalTargets(DynamicResolution *resolution, int width, int height)
+{
+	resolution->resolvedScene = createTexture(NULL, width, height, GL_RGBA, GL_RGBA8, GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, false);
+	resolution->velocity = createTexture(NULL, width, height, GL_RG, GL_RG16F, GL_NEAREST, GL_NEAREST, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, false);
+	for (int i = 0; i < 2; ++i)
+	{
+		resolution->history[i] = createTexture(NULL, width, height, GL_RGBA, GL_RGBA8, GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, false);
+		resolution->historyFramebuffers[i] = createFramebuffer(resolution->history[i]);
+	}
+
+	GLuint *renderbuffers = resolution->sceneRenderbuffers;
+	glGenRenderbuffers(1, &renderbuffers[1]);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers(1, &resolution->sceneFramebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, resolution->sceneFramebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, resolution->resolvedScene, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, resolution->velocity, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+	const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+	glDrawBuffers(2, drawBuffers);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		fprintf(stderr, "ERROR: failed to create a %dx%d scene framebuffer\n", width, height);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+static void allocateTargets(DynamicResolution *resolution, int width, int height)
+{
+	freeTargets(resolution);
+	resolution->fullWidth = width;
+	resolution->fullHeight = height;
+	resolution->historyValid = false;
+
+	if (resolution->temporalAA)
+	{
+		allocateTemporalTargets(resolution, width, height);
+		glCheckErrors();
+		return;
+	}
+
+	GLint maxSamples;
+	glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+	int numSamples = min(resolution->numSamples, (int)maxSamples);
+
+	// same formats as the backbuffer
+	GLuint *renderbuffers = resolution->sceneRenderbuffers;
+	glGenRenderbuffers(2, renderbuffers);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+	glRenderbufferStorageMultisample(GL_RENDERBUFFER, numSamples, GL_RGBA8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+	glRenderbufferStorageMultisample(GL_RENDERBUFFER, numSamples, GL_DEPTH24_STENCIL8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers(1, &resolution->sceneFramebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, resolution->sceneFramebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		fprintf(stderr, "ERROR: failed to create a %dx%d scene framebuffer\n", width, height);
+
+	resolution->resolvedScene = createTexture(NULL, width, height, GL_RGBA, GL_RGBA8, GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, false);
+	resolution->resolveFramebuffer = createFramebuffer(resolution->resolvedScene);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glCheckErrors();
+}
+
+DynamicResolution *createDynamicResolution(float targetGpuMs, int numSamples)
+{
+	DynamicResolution *resolution = (DynamicResolution *)calloc(1, sizeof(DynamicResolution));
+	resolution->targetGpuMs = targetGpuMs;
+	resolution->scale = 1;
+	resolution->numSamples = numSamples;
+	resolution->framesUntilUpdate = ResolutionUpdateInterval;
+	resolution->upscaleShader = loadShaderProgram("assets/shaders/upscale.vert.glsl", "assets/shaders/upscale.frag.glsl");
+	resolution->taaShader = loadShaderProgram("assets/shaders/upscale.vert.glsl", "assets/shaders/taa.frag.glsl");
+	glGenVertexArrays(1, &resolution->emptyVertexSpec);
+	return resolution;
+}
+
+void setDynamicResolutionSamples(DynamicResolution *resolution, int numSamples)
+{
+	if (resolution->numSamples == numSamples)
+		return;
+
+	resolution->numSamples = numSamples;
+	freeTargets(resolution);
+	resolution->fullWidth = resolution->fullHeight = 0;
+}
+
+void setTemporalAA(DynamicResolution *resolution, bool enabled)
+{
+	if (resolution->temporalAA == enabled)
+		return;
+
+	resolution->temporalAA = enabled;
+	freeTargets(resolution);
+	resolution->fullWidth = resolution->fullHeight = 0;
+}
+
+// Element index (from 1) of the Halton sequence in the given base, in [0, 1).
+static float halton(int index, int base)
+{
+	float result = 0;
+	float fraction = 1;
+	while (index > 0)
+	{
+		fraction /= base;
+		result += fraction * (index % base);
+		index /= base;
+	}
+	return result;
+}
+
+// Average GPU time of the last few frames over all passes, 0 until there are enough samples.
+static float getRecentGpuFrameMs(const GpuProfiler *profiler)
+{
+	float totalMs = 0;
+	for (int pass = 0; pass < profiler->numPasses; ++pass)
+	{
+		if (profiler->historySize[pass] < ResolutionSamples)
+			return 0;
+		for (int age = 0; age < ResolutionSamples; ++age)
+			totalMs += getGpuPassSample(profiler, pass, age);
+	}
+	return totalMs / ResolutionSamples;
+}
+
+void updateDynamicResolution(DynamicResolution *resolution, const GpuProfiler *profiler, int windowWidth, int windowHeight)
+{
+	if (resolution->fullWidth != windowWidth || resolution->fullHeight != windowHeight)
+		allocateTargets(resolution, windowWidth, windowHeight);
+
+	if (resolution->targetGpuMs > 0 && --resolution->framesUntilUpdate <= 0)
+	{
+		resolution->framesUntilUpdate = ResolutionUpdateInterval;
+
+		float gpuMs = getRecentGpuFrameMs(profiler);
+		if (gpuMs > 0 && fabsf(gpuMs - resolution->targetGpuMs) > ResolutionDeadZone * resolution->targetGpuMs)
+		{
+			// only go half way, the fixed cost of the passes that don't scale makes the estimate overshoot
+			float step = sqrtf(resolution->targetGpuMs / gpuMs);
+			float scale = resolution->scale * (1 + 0.5f * (step - 1));
+			resolution->scale = clamp(scale, MinResolutionScale, 1.0f);
+		}
+	}
+
+	int width = max((int)(resolution->scale * windowWidth + 0.5f), 1);
+	int height = max((int)(resolution->scale * windowHeight + 0.5f), 1);
+	if (width != resolution->width || height != resolution->height)
+		resolution->historyValid = false;
+	resolution->width = width;
+	resolution->height = height;
+
+	if (resolution->temporalAA)
+	{
+		int index = resolution->jitterIndex++ % TemporalJitterSamples + 1;
+		vec2 offset = vec2(halton(index, 2), halton(index, 3)) - vec2(0.5f); // in pixels, around the center
+		resolution->jitter = vec2(2 * offset.x / width, 2 * offset.y / height);
+	}
+	else
+		resolution->jitter = vec2(0);
+}
+
+void bindScaledScene(const DynamicResolution *resolution)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, resolution->sceneFramebuffer);
+	glViewport(0, 0, resolution->width, resolution->height);
+}
+
+void resolveScene(DynamicResolution *resolution)
+{
+	int sceneWidth = resolution->width;
+	int sceneHeight = resolution->height;
+	if (!resolution->temporalAA)
+	{
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, resolution->sceneFramebuffer);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolution->resolveFramebuffer);
+		glBlitFramebuffer(0, 0, sceneWidth, sceneHeight, 0, 0, sceneWidth, sceneHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		return;
+	}
+
+	int target = resolution->historyIndex;
+	glBindFramebuffer(GL_FRAMEBUFFER, resolution->historyFramebuffers[target]);
+	glViewport(0, 0, sceneWidth, sceneHeight);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_BLEND);
+
+	glUseProgram(resolution->taaShader);
+	bindUniformTexture(0, 0, resolution->resolvedScene);
+	bindUniformTexture(1, 1, resolution->velocity);
+	bindUniformTexture(2, 2, resolution->history[1 - target]);
+	glUniform2f(3, (float)sceneWidth, (float)sceneHeight);
+	glUniform2f(4, 1.0f / resolution->fullWidth, 1.0f / resolution->fullHeight);
+	glUniform1f(5, resolution->historyValid ? TemporalHistoryWeight : 0.0f);
+	glBindVertexArray(resolution->emptyVertexSpec);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glBindVertexArray(0);
+
+	resolution->historyIndex = 1 - target;
+	resolution->historyValid = true;
+}
+
+void upscaleScene(const DynamicResolution *resolution, Framebuffer framebuffer, int width, int height)
+{
+	int sceneWidth = resolution->width;
+	int sceneHeight = resolution->height;
+	// with temporal AA that's the history resolveScene just wrote
+	Texture scene = resolution->temporalAA ? resolution->history[1 - resolution->historyIndex] : resolution->resolvedScene;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glViewport(0, 0, width, height);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_BLEND);
+
+	// nothing to sharpen at full resolution, which makes the pass an exact copy
+	float sharpness = clamp(2 * (1 - resolution->scale), 0.0f, 1.0f);
+	// and a bit more for the softness the history blend adds
+	if (resolution->temporalAA)
+		sharpness = min(sharpness + 0.25f, 1.0f);
+
+	glUseProgram(resolution->upscaleShader);
+	bindUniformTexture(0, 0, scene);
+	glUniform2f(1, (float)sceneWidth / width, (float)sceneHeight / height);
+	glUniform2f(2, 1.0f / resolution->fullWidth, 1.0f / resolution->fullHeight);
+	glUniform2f(3, (float)sceneWidth, (float)sceneHeight);
+	glUniform1f(4, sharpness);
+	glBindVertexArray(resolution->emptyVertexSpec);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glBindVertexArray(0);
+}
\ No newline at end of file
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "profiler.h"
+
+// Dynamic resolution
+// ------------------
+// The scene renders into a multisampled offscreen target as big as the window, of which only
+// the bottom left scale * size is used, so changing the scale never reallocates anything.
+// Every ResolutionUpdateInterval frames the scale moves toward whatever holds the target GPU
+// frame time, measured by the GPU profiler's timer queries. The cost of a frame grows with the
+// number of pixels, the square of the scale, so the step is sqrt(target / measured), damped and
+// with a dead zone around the target so the resolution doesn't wobble from frame to frame.
+//
+// The used part is resolved and stretched over the window by a pass that sharpens as much as
+// the upscale blurs. Everything drawn after that, like the text, is at native resolution.
+//
+// Temporal anti-aliasing
+// ----------------------
+// Instead of MSAA the scene can be antialiased over time: the projection is shifted by a
+// different subpixel offset every frame (a Halton sequence, which covers the pixel evenly in
+// a few frames) and the scene shaders write how far each fragment moved on screen since the
+// last frame, from last frame's matrices, into a second target. The resolve looks up where
+// the pixel was in the last resolve, clamps that to the colors around the pixel, which throws
+// away most of what was disoccluded, and blends it in. The scene then renders to a single
+// sampled target that's read directly, so there's no MSAA resolve either. The history is
+// dropped whenever the scale changes, it's only valid for one size.
+
+constexpr float MinResolutionScale = 0.5f;
+constexpr int ResolutionUpdateInterval = 8; // frames between adjustments
+constexpr int ResolutionSamples = 4;        // frames averaged for an adjustment, recent enough to all be at the current scale
+constexpr float ResolutionDeadZone = 0.05f; // no adjustment while within this fraction of the target
+constexpr float DefaultTargetGpuMs = 14.0f; // a 60 Hz frame with some room to spare
+constexpr int TemporalJitterSamples = 8;    // length of the jitter sequence
+constexpr float TemporalHistoryWeight = 0.9f;
+
+struct DynamicResolution
+{
+	float targetGpuMs; // 0 keeps the scale at 1
+	float scale;
+	int width;         // the scaled scene, what the viewport is set to
+	int height;
+	int fullWidth;     // what the targets are allocated at
+	int fullHeight;
+	int numSamples;    // MSAA samples of the scene target, 0 for none, ignored with temporal AA
+	int framesUntilUpdate;
+
+	bool temporalAA;
+	bool historyValid;
+	int historyIndex;  // of the history the next resolve writes, the other one is read
+	int jitterIndex;
+	vec2 jitter;       // of this frame's projection in NDC, 0 without temporal AA
+
+	Framebuffer sceneFramebuffer;
+	GLuint sceneRenderbuffers[2]; // color (only with MSAA), depth stencil
+	Framebuffer resolveFramebuffer;
+	Texture resolvedScene;
+	Texture velocity;             // only with temporal AA, like the history
+	Texture history[2];
+	Framebuffer historyFramebuffers[2];
+	ShaderProgram upscaleShader;
+	ShaderProgram taaShader;
+	VertexSpecification emptyVertexSpec; // the upscale triangle is made up from gl_VertexID
+};
+
+DynamicResolution *createDynamicResolution(float targetGpuMs, int numSamples = 4);
+
+// Takes effect with the next updateDynamicResolution, which reallocates the scene target.
+void setDynamicResolutionSamples(DynamicResolution *resolution, int numSamples);
+// Same as above, the scene shaders have to output the velocity while it's on.
+void setTemporalAA(DynamicResolution *resolution, bool enabled);
+// Call after beginGpuFrame, picks the scale of this frame from the GPU times measured so far
+// and reallocates the targets if the window size changed.
+void updateDynamicResolution(DynamicResolution *resolution, const GpuProfiler *profiler, int windowWidth, int windowHeight);
+// Binds the scene target and sets the viewport to the scaled size.
+void bindScaledScene(const DynamicResolution *resolution);
+// Resolves the MSAA samples, or blends in the history with temporal AA.
+void resolveScene(DynamicResolution *resolution);
+// Draws the resolved scene over the whole framebuffer, which stays bound afterwards.
+void upscaleScene(const DynamicResolution *resolution, Framebuffer framebuffer, int width, int height);
\ No newline at end of file
@@ -1,4 +1,11 @@
 #include "system.h"
+#include "profiler.h"
+#include "jobs.h"
+#include <string.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 /* request a dedicated GPU if avaliable https://stackoverflow.com/a/39047129 */
 #ifdef _MSC_VER
@@ -15,6 +22,11 @@ int mouseDeltaX;
 int mouseDeltaY;
 int mouseWheelDelta;
 RenderMode renderMode = RenderDefault;
+bool showProfiler = false;
+QualityTier qualityTier = QualityHigh;
+bool temporalAA = false;
+GLuint backbuffer;
+FramePacing framePacing;
 
 static double timerPeriod;
 
@@ -45,6 +57,8 @@ static void onGlError(GLenum source, GLenum type, GLuint id, GLenum severity, GL
 // -------------
 static void onFramebufferResized(GLFWwindow *window, int newWidth, int newHeight)
 {
+	if (backbuffer)
+		return; // the offscreen framebuffer doesn't change size
 	windowWidth = newWidth;
 	windowHeight = newHeight;
 }
@@ -58,9 +72,21 @@ static void onKey(GLFWwindow *window, int key, int scancode, int action, int mod
 		case GLFW_KEY_ESCAPE: /* close the window when ESC is pressed */
 			glfwSetWindowShouldClose(window, GLFW_TRUE);
 			break;
+		case GLFW_KEY_F2:
+			showProfiler = !showProfiler;
+			break;
+		case GLFW_KEY_F4:
+			writeCpuTrace(CpuTraceFilename);
+			break;
 		case GLFW_KEY_F3:
 			renderMode = RenderMode((int(renderMode) + 1) % (1 + RenderNormals));
 			break;
+		case GLFW_KEY_F5:
+			qualityTier = QualityTier((int(qualityTier) + 1) % NumQualityTiers);
+			break;
+		case GLFW_KEY_F6:
+			temporalAA = !temporalAA;
+			break;
 		case GLFW_KEY_F:
 		{
 			GLFWmonitor *monitor = glfwGetPrimaryMonitor();
@@ -96,7 +122,221 @@ static void onMouseWheel(GLFWwindow *window, double dX, double dY)
 		++mouseWheelDelta;
 }
 
-void initSystem()
+static void createOffscreenBackbuffer(int width, int height)
+{
+	// same format as the window's default framebuffer
+	GLuint renderbuffers[2];
+	glGenRenderbuffers(2, renderbuffers);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+	glRenderbufferStorageMultisample(GL_RENDERBUFFER, 4, GL_RGBA8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+	glRenderbufferStorageMultisample(GL_RENDERBUFFER, 4, GL_DEPTH24_STENCIL8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers(1, &backbuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, backbuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+	{
+		fprintf(stderr, "ERROR: failed to create a %dx%d offscreen framebuffer .. aborting\n", width, height);
+		abort();
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	windowWidth = width;
+	windowHeight = height;
+}
+
+// Headless EGL
+// ------------
+// A context without any window, for machines that don't have a display (or a GPU, Mesa's
+// llvmpipe works fine). libEGL is loaded at runtime so that it's only needed when it's
+// actually used, which is also why the few bits of EGL we need are declared here.
+#ifdef __linux__
+#include <dlfcn.h>
+
+typedef void *EGLDisplay;
+typedef void *EGLConfig;
+typedef void *EGLContext;
+typedef void *EGLSurface;
+typedef int32_t EGLint;
+typedef unsigned EGLBoolean;
+typedef unsigned EGLenum;
+
+constexpr EGLint EGL_NONE = 0x3038;
+constexpr EGLint EGL_EXTENSIONS = 0x3055;
+constexpr EGLint EGL_SURFACE_TYPE = 0x3033;
+constexpr EGLint EGL_PBUFFER_BIT = 0x0001;
+constexpr EGLint EGL_RENDERABLE_TYPE = 0x3040;
+constexpr EGLint EGL_OPENGL_BIT = 0x0008;
+constexpr EGLint EGL_RED_SIZE = 0x3024;
+constexpr EGLint EGL_GREEN_SIZE = 0x3023;
+constexpr EGLint EGL_BLUE_SIZE = 0x3022;
+constexpr EGLint EGL_WIDTH = 0x3057;
+constexpr EGLint EGL_HEIGHT = 0x3056;
+constexpr EGLenum EGL_OPENGL_API = 0x30A2;
+constexpr EGLint EGL_CONTEXT_MAJOR_VERSION = 0x3098;
+constexpr EGLint EGL_CONTEXT_MINOR_VERSION = 0x30FB;
+constexpr EGLint EGL_CONTEXT_OPENGL_PROFILE_MASK = 0x30FD;
+constexpr EGLint EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT = 0x0001;
+constexpr EGLint EGL_CONTEXT_OPENGL_DEBUG = 0x31B0;
+constexpr EGLenum EGL_PLATFORM_SURFACELESS_MESA = 0x31DD;
+
+static struct
+{
+	void *(*getProcAddress)(const char *name);
+	EGLDisplay (*getDisplay)(void *nativeDisplay);
+	EGLDisplay (*getPlatformDisplay)(EGLenum platform, void *nativeDisplay, const EGLint *attribs);
+	EGLBoolean (*initialize)(EGLDisplay display, EGLint *major, EGLint *minor);
+	const char *(*queryString)(EGLDisplay display, EGLint name);
+	EGLBoolean (*bindAPI)(EGLenum api);
+	EGLBoolean (*chooseConfig)(EGLDisplay display, const EGLint *attribs, EGLConfig *configs, EGLint configSize, EGLint *numConfigs);
+	EGLSurface (*createPbufferSurface)(EGLDisplay display, EGLConfig config, const EGLint *attribs);
+	EGLContext (*createContext)(EGLDisplay display, EGLConfig config, EGLContext shareContext, const EGLint *attribs);
+	EGLBoolean (*makeCurrent)(EGLDisplay display, EGLSurface draw, EGLSurface read, EGLContext context);
+	EGLDisplay display;
+	EGLSurface surface;
+	EGLContext context;
+} egl;
+
+static bool hasExtension(const char *extensions, const char *name)
+{
+	size_t length = strlen(name);
+	for (const char *found = extensions ? strstr(extensions, name) : NULL; found; found = strstr(found + length, name))
+	{
+		if ((found == extensions || found[-1] == ' ') && (found[length] == ' ' || found[length] == 0))
+			return true;
+	}
+	return false;
+}
+
+static bool initEglContext()
+{
+	void *lib = dlopen("libEGL.so.1", RTLD_NOW | RTLD_LOCAL);
+	if (!lib)
+	{
+		fprintf(stderr, "ERROR: failed to load libEGL.so.1: %s\n", dlerror());
+		return false;
+	}
+
+	*(void **)&egl.getProcAddress = dlsym(lib, "eglGetProcAddress");
+	*(void **)&egl.getDisplay = dlsym(lib, "eglGetDisplay");
+	*(void **)&egl.initialize = dlsym(lib, "eglInitialize");
+	*(void **)&egl.queryString = dlsym(lib, "eglQueryString");
+	*(void **)&egl.bindAPI = dlsym(lib, "eglBindAPI");
+	*(void **)&egl.chooseConfig = dlsym(lib, "eglChooseConfig");
+	*(void **)&egl.createPbufferSurface = dlsym(lib, "eglCreatePbufferSurface");
+	*(void **)&egl.createContext = dlsym(lib, "eglCreateContext");
+	*(void **)&egl.makeCurrent = dlsym(lib, "eglMakeCurrent");
+	if (!egl.getProcAddress || !egl.getDisplay || !egl.initialize || !egl.queryString || !egl.bindAPI ||
+		!egl.chooseConfig || !egl.createPbufferSurface || !egl.createContext || !egl.makeCurrent)
+	{
+		fprintf(stderr, "ERROR: libEGL.so.1 is missing EGL 1.4 functions\n");
+		return false;
+	}
+
+	// the surfaceless platform doesn't need any display server, otherwise take whatever the default is
+	EGLDisplay display = NULL;
+	const char *clientExtensions = egl.queryString(NULL, EGL_EXTENSIONS);
+	*(void **)&egl.getPlatformDisplay = egl.getProcAddress("eglGetPlatformDisplayEXT");
+	if (egl.getPlatformDisplay && hasExtension(clientExtensions, "EGL_MESA_platform_surfaceless"))
+		display = egl.getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, NULL, NULL);
+	if (!display)
+		display = egl.getDisplay(NULL);
+
+	EGLint major, minor;
+	if (!display || !egl.initialize(display, &major, &minor))
+	{
+		fprintf(stderr, "ERROR: failed to initialize an EGL display\n");
+		return false;
+	}
+	if (!egl.bindAPI(EGL_OPENGL_API))
+	{
+		fprintf(stderr, "ERROR: EGL %d.%d doesn't support desktop OpenGL\n", major, minor);
+		return false;
+	}
+
+	// the backbuffer is always an FBO, the config only matters for the pbuffer fallback
+	const EGLint configAttribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8,
+		EGL_GREEN_SIZE, 8,
+		EGL_BLUE_SIZE, 8,
+		EGL_NONE
+	};
+	EGLConfig config;
+	EGLint numConfigs;
+	if (!egl.chooseConfig(display, configAttribs, &config, 1, &numConfigs) || numConfigs < 1)
+	{
+		fprintf(stderr, "ERROR: no suitable EGL config\n");
+		return false;
+	}
+
+	const EGLint contextAttribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+#ifndef NDEBUG
+		EGL_CONTEXT_OPENGL_DEBUG, 1,
+#endif
+		EGL_NONE
+	};
+	EGLContext context = egl.createContext(display, config, NULL, contextAttribs);
+	if (!context)
+	{
+		fprintf(stderr, "ERROR: failed to create an OpenGL 4.3 core context with EGL\n");
+		return false;
+	}
+
+	// without surfaceless contexts we have to make do with a tiny pbuffer that's never drawn to
+	EGLSurface surface = NULL;
+	if (!hasExtension(egl.queryString(display, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context"))
+	{
+		const EGLint pbufferAttribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+		surface = egl.createPbufferSurface(display, config, pbufferAttribs);
+	}
+	if (!egl.makeCurrent(display, surface, surface, context))
+	{
+		fprintf(stderr, "ERROR: failed to make the EGL context current\n");
+		return false;
+	}
+
+	egl.display = display;
+	egl.surface = surface;
+	egl.context = context;
+	return true;
+}
+#else
+static struct { void *(*getProcAddress)(const char *name); } egl;
+
+static bool initEglContext()
+{
+	fprintf(stderr, "ERROR: the headless EGL backend is only available on Linux\n");
+	return false;
+}
+#endif
+
+static bool headless;
+
+// The context moves to the render thread for the game loop and back afterwards.
+static void makeContextCurrent(bool current)
+{
+#ifdef __linux__
+	if (headless)
+	{
+		if (current)
+			egl.makeCurrent(egl.display, egl.surface, egl.surface, egl.context);
+		else
+			egl.makeCurrent(egl.display, NULL, NULL, NULL);
+		return;
+	}
+#endif
+	glfwMakeContextCurrent(current ? window : NULL);
+}
+
+static void initWindow(bool hidden)
 {
 	glfwSetErrorCallback(onGlfwError);
 	int glfwOk = glfwInit();
@@ -108,7 +348,7 @@ void initSystem()
 
 	/* add additional window hints here ... */
 	// I want a 4.3 context because GLSL 430 has explicit uniform locations and Im too lazy not to use those
-	glfwWindowHint(GLFW_SAMPLES, 4);
+	glfwWindowHint(GLFW_SAMPLES, 0); // the scene is antialiased in its own target, see resolution.h
 	glfwWindowHint(GLFW_DEPTH_BITS, 24);
 	glfwWindowHint(GLFW_STENCIL_BITS, 8);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
@@ -117,6 +357,8 @@ void initSystem()
 #ifndef NDEBUG
 	glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GLFW_TRUE);
 #endif
+	if (hidden)
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
 
 	window = glfwCreateWindow(1280, 720, "Car Demo", NULL, NULL);
 	if (!window)
@@ -127,16 +369,41 @@ void initSystem()
 
 	glfwMakeContextCurrent(window);
 
-	int gladOk = gladLoadGLLoader((GLADloadproc)glfwGetProcAddress);
+	glfwSetFramebufferSizeCallback(window, onFramebufferResized);
+	glfwSetKeyCallback(window, onKey);
+	glfwSetMouseButtonCallback(window, onMouseButton);
+	glfwSetCursorPosCallback(window, onMouseMove);
+	glfwSetScrollCallback(window, onMouseWheel);
+
+	glfwGetFramebufferSize(window, &windowWidth, &windowHeight);
+	double mx, my;
+	glfwGetCursorPos(window, &mx, &my);
+}
+
+void initSystem(SystemBackend backend, int offscreenWidth, int offscreenHeight)
+{
+	headless = backend == BackendHeadlessEgl;
+	if (headless)
+	{
+		if (!initEglContext())
+		{
+			fprintf(stderr, "ERROR: failed to create a headless OpenGL context .. aborting\n");
+			abort();
+		}
+	}
+	else initWindow(offscreenWidth > 0 && offscreenHeight > 0);
+
+	int gladOk = gladLoadGLLoader((GLADloadproc)getGLProcAddress);
 	if (!gladOk)
 	{
 		fprintf(stderr, "ERROR: GLAD failed to load OpenGL functions .. aborting\n");
 		abort();
 	}
 
-	printf("using OpenGL %s: %s\n",
+	printf("using OpenGL %s: %s%s\n",
 		(const char *)glGetString(GL_VERSION),
-		(const char *)glGetString(GL_RENDERER));
+		(const char *)glGetString(GL_RENDERER),
+		headless ? " (headless)" : "");
 
 	if (GLVersion.major < 4 || (GLVersion.major == 4 && GLVersion.minor < 3))
 	{
@@ -149,36 +416,306 @@ void initSystem()
 	glDebugMessageCallback(onGlError, NULL);
 #endif
 
-	glfwSetFramebufferSizeCallback(window, onFramebufferResized);
-	glfwSetKeyCallback(window, onKey);
-	glfwSetMouseButtonCallback(window, onMouseButton);
-	glfwSetCursorPosCallback(window, onMouseMove);
-	glfwSetScrollCallback(window, onMouseWheel);
+	timerPeriod = 1.0 / getTimerFrequency();
+	initCpuProfiler();
+	initJobSystem();
 
-	timerPeriod = 1.0 / glfwGetTimerFrequency();
-	glfwGetFramebufferSize(window, &windowWidth, &windowHeight);
-	double mx, my;
-	glfwGetCursorPos(window, &mx, &my);
+	// there's no default framebuffer without a window
+	if (headless && (offscreenWidth <= 0 || offscreenHeight <= 0))
+	{
+		offscreenWidth = 1280;
+		offscreenHeight = 720;
+	}
+	if (offscreenWidth > 0 && offscreenHeight > 0)
+		createOffscreenBackbuffer(offscreenWidth, offscreenHeight);
 }
 
-void startGameLoop(std::function<void(double deltaTime)> frameCallback)
+// Frame Hand-over
+// ---------------
+// A triple buffer of packet indices: the simulation fills the back packet, the renderer draws
+// the front one, and publishing or taking a packet swaps it with the middle one in a single
+// atomic exchange. The mutex and the condition variable are only there to sleep on, nobody
+// holds the lock while working on a packet.
+constexpr uint8_t FramePacketFresh = 4; // the middle packet is waiting to be rendered
+
+static struct
+{
+	std::atomic<uint8_t> middle{1};
+	int back = 0;      // only touched by the simulation
+	int front = 2;     // only touched by the render thread
+	bool quit = false; // guarded by the mutex
+	std::mutex mutex;
+	std::condition_variable changed;
+
+	uint64_t inputTimes[NumFramePackets]; // when the input of each packet was read, published with it
+} frameExchange;
+
+static void signalFrameExchange()
 {
-	uint64_t time0 = glfwGetTimerValue();
+	// taking the lock makes sure a thread that's about to sleep sees the change first
+	{
+		std::lock_guard<std::mutex> lock(frameExchange.mutex);
+	}
+	frameExchange.changed.notify_all();
+}
+
+// Frame Pacing
+// ------------
+// The simulation starts its frames on a fixed schedule when there's a frame rate cap, and only
+// reads the input once the wait is over, so what's on screen is as fresh as it can be. The render
+// thread never lets the GPU fall more than framePacing.maxQueuedFrames behind: every frame ends
+// with a fence, and before submitting another one it waits for the one that many frames back.
+// The same frames carry a GPU timestamp, which turns into the input latency once they're done.
+constexpr double MinSleepMargin = 0.0005;
+constexpr double MaxSleepMargin = 0.02;
+
+static double sleepMargin = 0.002; // how much sleeping tends to overshoot, the rest of a wait spins
+static double inputLatencyMs;      // only touched by the render thread
 
-	while (!glfwWindowShouldClose(window))
+// Sleeps most of the way and spins the rest, sleeping alone wakes up too late too often.
+static void waitUntil(uint64_t deadline)
+{
+	for (;;)
+	{
+		uint64_t now = getTimerValue();
+		if (now >= deadline)
+			return;
+
+		double remaining = (deadline - now) * timerPeriod;
+		if (remaining > sleepMargin)
+		{
+			double sleepTime = remaining - sleepMargin;
+			std::this_thread::sleep_for(std::chrono::duration<double>(sleepTime));
+
+			// keep the margin a bit above the worst recent overshoot, and let it shrink slowly when the OS behaves
+			double overshoot = (getTimerValue() - now) * timerPeriod - sleepTime;
+			sleepMargin = clamp(max(0.99 * sleepMargin, 1.25 * overshoot), MinSleepMargin, MaxSleepMargin);
+		}
+		else std::this_thread::yield();
+	}
+}
+
+double getInputLatencyMs()
+{
+	return inputLatencyMs;
+}
+
+struct QueuedFrame
+{
+	GLsync fence; // NULL if the slot is free
+	GLuint timestampQuery;
+	uint64_t inputTime;
+};
+
+// Waits for the GPU to finish the frame and works out how long it took from reading its input.
+static void retireQueuedFrame(QueuedFrame *frame, uint64_t calibrationTime, GLint64 calibrationGpuTime)
+{
+	{
+		CPU_PROFILE("wait for gpu");
+		while (glClientWaitSync(frame->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+			;
+	}
+	glDeleteSync(frame->fence);
+	frame->fence = NULL;
+
+	// the GPU clock runs on its own, the calibration pair from this frame maps it onto the timer
+	GLuint64 gpuDoneTime;
+	glGetQueryObjectui64v(frame->timestampQuery, GL_QUERY_RESULT, &gpuDoneTime);
+	double doneSeconds = (calibrationTime - frame->inputTime) * timerPeriod + 1e-9 * ((GLint64)gpuDoneTime - calibrationGpuTime);
+	double latencyMs = 1000 * max(doneSeconds, 0.0);
+	inputLatencyMs = inputLatencyMs > 0 ? 0.9 * inputLatencyMs + 0.1 * latencyMs : latencyMs;
+}
+
+static void runRenderThread(const std::function<void(int packet)> *render)
+{
+	nameCpuProfilerThread("render");
+	registerJobThread();
+	makeContextCurrent(true);
+
+	if (window && !backbuffer)
+		glfwSwapInterval(framePacing.vsync ? 1 : 0);
+
+	int maxQueuedFrames = clamp(framePacing.maxQueuedFrames, 1, MaxQueuedFrames);
+	QueuedFrame queuedFrames[MaxQueuedFrames] = {};
+	for (int i = 0; i < maxQueuedFrames; ++i)
+		glGenQueries(1, &queuedFrames[i].timestampQuery);
+	int nextQueuedFrame = 0;
+
+	for (;;)
+	{
+		// make room on the GPU before taking the packet, so it's submitted as soon as it's taken
+		QueuedFrame &queued = queuedFrames[nextQueuedFrame];
+		nextQueuedFrame = (nextQueuedFrame + 1) % maxQueuedFrames;
+		if (queued.fence)
+		{
+			GLint64 calibrationGpuTime;
+			glGetInteger64v(GL_TIMESTAMP, &calibrationGpuTime);
+			retireQueuedFrame(&queued, getTimerValue(), calibrationGpuTime);
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(frameExchange.mutex);
+			frameExchange.changed.wait(lock, [] { return (frameExchange.middle.load() & FramePacketFresh) || frameExchange.quit; });
+		}
+		// when quitting there may still be a last packet to render
+		if (!(frameExchange.middle.load() & FramePacketFresh))
+			break;
+
+		frameExchange.front = frameExchange.middle.exchange((uint8_t)frameExchange.front) & 3;
+		signalFrameExchange();
+		{
+			CPU_PROFILE("render");
+			(*render)(frameExchange.front);
+		}
+
+		glQueryCounter(queued.timestampQuery, GL_TIMESTAMP);
+		queued.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		queued.inputTime = frameExchange.inputTimes[frameExchange.front];
+	}
+
+	for (int i = 0; i < maxQueuedFrames; ++i)
+	{
+		if (queuedFrames[i].fence)
+			glDeleteSync(queuedFrames[i].fence);
+		glDeleteQueries(1, &queuedFrames[i].timestampQuery);
+	}
+	makeContextCurrent(false);
+}
+
+void startGameLoop(std::function<void(double deltaTime, int packet)> simulate, std::function<void(int packet)> render, int numFrames, double fixedDeltaTime)
+{
+	makeContextCurrent(false);
+	frameExchange.quit = false;
+	std::thread renderThread(runRenderThread, &render);
+
+	// a fixed time step renders as fast as it can, it doesn't stand for real time
+	uint64_t framePeriod = 0;
+	if (framePacing.maxFrameRate > 0 && fixedDeltaTime <= 0)
+		framePeriod = (uint64_t)(getTimerFrequency() / framePacing.maxFrameRate);
+
+	uint64_t time0 = getTimerValue();
+	uint64_t nextFrameTime = time0;
+	for (int frame = 0; (numFrames <= 0 || frame < numFrames) && !(window && glfwWindowShouldClose(window)); ++frame)
 	{
 		int mouseXBefore = mouseX;
 		int mouseYBefore = mouseY;
 		mouseWheelDelta = 0;
-		glfwPollEvents();
+
+		// the last packet has to be taken by the renderer before there's room for another one,
+		// until then the events keep coming in and all of them go into this frame
+		for (;;)
+		{
+			if (window)
+			{
+				CPU_PROFILE("poll events");
+				glfwPollEvents();
+			}
+
+			std::unique_lock<std::mutex> lock(frameExchange.mutex);
+			if (frameExchange.changed.wait_for(lock, std::chrono::milliseconds(1), [] { return !(frameExchange.middle.load() & FramePacketFresh); }))
+				break;
+		}
+
+		if (framePeriod > 0)
+		{
+			{
+				CPU_PROFILE("frame rate cap");
+				waitUntil(nextFrameTime);
+			}
+			// latch the input as late as possible, right before the frame that uses it
+			if (window)
+				glfwPollEvents();
+
+			// keep to the schedule after a short hitch, start over after a long one instead of rushing to catch up
+			nextFrameTime = max(nextFrameTime + framePeriod, getTimerValue());
+		}
 		mouseDeltaX = mouseX - mouseXBefore;
 		mouseDeltaY = mouseY - mouseYBefore;
 
-		uint64_t time1 = glfwGetTimerValue();
-		double deltaTime = getDeltaTime(time0, time1);
-		frameCallback(deltaTime);
+		uint64_t time1 = getTimerValue();
+		double deltaTime = fixedDeltaTime > 0 ? fixedDeltaTime : getDeltaTime(time0, time1);
+		{
+			CPU_PROFILE("simulate");
+			simulate(deltaTime, frameExchange.back);
+		}
+		frameExchange.inputTimes[frameExchange.back] = time1;
+		frameExchange.back = frameExchange.middle.exchange((uint8_t)(frameExchange.back | FramePacketFresh)) & 3;
+		signalFrameExchange();
 		time0 = time1;
 	}
+
+	{
+		std::lock_guard<std::mutex> lock(frameExchange.mutex);
+		frameExchange.quit = true;
+	}
+	frameExchange.changed.notify_all();
+	renderThread.join();
+	makeContextCurrent(true);
+}
+
+void readBackbuffer(uint8_t *pixels, int width, int height)
+{
+	// multisampled framebuffers can't be read directly, resolve into a single sampled one first
+	static GLuint resolveFramebuffer, resolveRenderbuffer;
+	static int resolveWidth, resolveHeight;
+	if (resolveWidth != width || resolveHeight != height)
+	{
+		if (!resolveFramebuffer)
+		{
+			glGenFramebuffers(1, &resolveFramebuffer);
+			glGenRenderbuffers(1, &resolveRenderbuffer);
+		}
+		glBindRenderbuffer(GL_RENDERBUFFER, resolveRenderbuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, resolveFramebuffer);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, resolveRenderbuffer);
+		resolveWidth = width;
+		resolveHeight = height;
+	}
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, backbuffer);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolveFramebuffer);
+	glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, resolveFramebuffer);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+	glBindFramebuffer(GL_FRAMEBUFFER, backbuffer);
+
+	// OpenGL reads bottom up
+	int stride = 3 * width;
+	uint8_t *row = (uint8_t *)malloc(stride);
+	for (int y = 0; y < height / 2; ++y)
+	{
+		uint8_t *top = pixels + y * stride;
+		uint8_t *bottom = pixels + (height - 1 - y) * stride;
+		memcpy(row, top, stride);
+		memcpy(top, bottom, stride);
+		memcpy(bottom, row, stride);
+	}
+	free(row);
+}
+
+void *getGLProcAddress(const char *name)
+{
+	if (headless)
+		return egl.getProcAddress(name);
+	return (void *)glfwGetProcAddress(name);
+}
+
+uint64_t getTimerValue()
+{
+	if (headless)
+		return (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+	return glfwGetTimerValue();
+}
+
+uint64_t getTimerFrequency()
+{
+	if (headless)
+		return (uint64_t)(std::chrono::steady_clock::period::den / std::chrono::steady_clock::period::num);
+	return glfwGetTimerFrequency();
 }
 
 double getDeltaTime(uint64_t time1, uint64_t time2)
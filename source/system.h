@@ -13,6 +13,16 @@ enum RenderMode
 	RenderNormals,
 };
 
+// What each tier changes is in quality.h.
+enum QualityTier
+{
+	QualityLow,
+	QualityMedium,
+	QualityHigh,
+	QualityUltra,
+	NumQualityTiers,
+};
+
 extern GLFWwindow *window;
 extern int windowWidth;
 extern int windowHeight;
@@ -22,8 +32,63 @@ extern int mouseDeltaX;
 extern int mouseDeltaY;
 extern int mouseWheelDelta;
 extern RenderMode renderMode;
+extern bool showProfiler;
+extern QualityTier qualityTier;
+extern bool temporalAA; // antialias the scene over time instead of with the tier's MSAA
+extern GLuint backbuffer; // what the final image is rendered to, 0 (the window) unless rendering offscreen
+
+constexpr int MaxQueuedFrames = 4;
+
+// Read when the game loop starts.
+struct FramePacing
+{
+	bool vsync = true;
+	double maxFrameRate = 0; // frames per second, 0 doesn't cap them, ignored with a fixed time step
+	int maxQueuedFrames = 2; // how many frames the GPU may fall behind the render thread, up to MaxQueuedFrames
+};
+extern FramePacing framePacing;
+
+enum SystemBackend
+{
+	BackendWindow,
+	BackendHeadlessEgl, // no window at all, for machines without a display (Linux only)
+};
+
+// With an offscreen size the window stays hidden and everything is rendered into a
+// multisampled framebuffer of that size instead, windowWidth and windowHeight are its size.
+// The headless backend always renders offscreen, at 1280x720 if no size is given.
+// Either way the context is OpenGL 4.3 core.
+void initSystem(SystemBackend backend = BackendWindow, int offscreenWidth = 0, int offscreenHeight = 0);
+
+constexpr int NumFramePackets = 3;
+
+// Runs the game on two threads. The calling thread keeps handling the window's events and calls
+// simulate, which fills in frame packet number `packet` (of NumFramePackets the caller keeps).
+// A render thread owns the OpenGL context for the duration of the loop and calls render with
+// each packet once it's ready, so the simulation of a frame overlaps with the rendering of the
+// one before it. The packets are swapped through a lock-free triple buffer and neither thread
+// waits for the other while it works on one: while a finished packet waits to be rendered the
+// simulation only keeps collecting input, which goes into its next frame, so a hitch in the
+// driver or in the buffer swap never holds up the event handling.
+// With numFrames > 0 the loop stops after that many frames, and if fixedDeltaTime > 0
+// every frame advances time by exactly that much no matter how long it actually took.
+// Every packet gets rendered, and the context is current on the calling thread again afterwards.
+void startGameLoop(
+	std::function<void(double deltaTime, int packet)> simulate,
+	std::function<void(int packet)> render,
+	int numFrames = 0,
+	double fixedDeltaTime = 0);
+
+// Milliseconds from reading a frame's input until the GPU finished the frame, averaged over the
+// last few frames. Only call it from the render callback.
+double getInputLatencyMs();
 
-void initSystem();
-void startGameLoop(std::function<void(double deltaTime)>);
+double getDeltaTime(uint64_t time1, uint64_t time2);
+// Resolves the backbuffer and reads it back as width * height RGB8 pixels, top row first. Pass the
+// size the frame was rendered at, windowWidth and windowHeight belong to the main thread.
+void readBackbuffer(uint8_t *pixels, int width, int height);
 
-double getDeltaTime(uint64_t time1, uint64_t time2);
\ No newline at end of file
+// These work with every backend, use them instead of the GLFW ones.
+uint64_t getTimerValue();
+uint64_t getTimerFrequency();
+void *getGLProcAddress(const char *name);
\ No newline at end of file
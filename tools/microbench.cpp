@@ -0,0 +1,534 @@
+// CPU microbenchmarks
+// -------------------
+// Times the hot CPU paths of the demo in isolation: the bmath primitives, transform hierarchies,
+// frustum culling (also split across the job system), hashing, text layout, and the .model/.obj
+// loaders. Nothing here needs a GPU or a window, so it runs anywhere the sources compile. The
+// .model and .obj files are generated on the fly, so the results don't depend on which assets
+// happen to be around.
+//
+// Every benchmark runs its body a few times to warm up the caches and to pick a batch size that
+// takes at least ~1 ms, then times a number of batches. The statistics are per item, for example
+// per matrix or per box, so that benchmarks with different amounts of work can be compared.
+//
+// Build it next to the demo from the root of the project, and run it from there (it loads the font):
+//
+//   g++ -std=c++17 -O2 tools/microbench.cpp $(ls source/*.cpp | grep -v main.cpp) source/lib/*.cpp -lm -lglfw -ldl -pthread -o microbench
+//   ./microbench [--filter text] [--repetitions N] [--workers N] [--output microbench.json]
+//
+// --workers sets the number of job system workers besides the main thread, one per core by default.
+
+#include "../source/graphics.h"
+#include "../source/profiler.h"
+#include "../source/jobs.h"
+#include "../source/lib/tiny_obj_loader.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <string.h>
+
+constexpr double MinBatchSeconds = 0.001;
+constexpr int MaxBatchSize = 1 << 20;
+
+struct MicrobenchOptions
+{
+	const char *filter = NULL;
+	int numRepetitions = 50;
+	int numWarmupRuns = 3;
+	int numWorkers = -1;
+	const char *outputFilename = "microbench.json";
+};
+
+struct MicrobenchResult
+{
+	std::string name;
+	int itemsPerRun;
+	int batchSize;      // runs per sample
+	TimingStats stats;  // nanoseconds per item - getTimingStats() doesn't care about the unit
+};
+
+static MicrobenchOptions options;
+static std::vector<MicrobenchResult> results;
+
+// Keeps the compiler from optimizing away work whose result is never used.
+template<typename T>
+static inline void keep(const T &value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	asm volatile("" : : "r"(&value) : "memory");
+#else
+	static volatile const void *sink;
+	sink = &value;
+#endif
+}
+
+static double getSeconds()
+{
+	using namespace std::chrono;
+	return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+template<typename Body>
+static void runMicrobench(const char *name, int itemsPerRun, Body body)
+{
+	if (options.filter && !strstr(name, options.filter))
+		return;
+
+	double runSeconds = 0;
+	for (int i = 0; i < options.numWarmupRuns; ++i)
+	{
+		double start = getSeconds();
+		body();
+		runSeconds = getSeconds() - start;
+	}
+
+	int batchSize = 1;
+	while (batchSize < MaxBatchSize && batchSize * runSeconds < MinBatchSeconds)
+		batchSize *= 2;
+
+	std::vector<float> samples(options.numRepetitions);
+	for (int i = 0; i < options.numRepetitions; ++i)
+	{
+		double start = getSeconds();
+		for (int j = 0; j < batchSize; ++j)
+			body();
+		double seconds = getSeconds() - start;
+		samples[i] = (float)(1e9 * seconds / ((double)batchSize * itemsPerRun));
+	}
+
+	MicrobenchResult result;
+	result.name = name;
+	result.itemsPerRun = itemsPerRun;
+	result.batchSize = batchSize;
+	result.stats = getTimingStats(samples.data(), (int)samples.size());
+	results.push_back(result);
+
+	printf("%-36s %10.2f %10.2f %10.2f %10.2f ns/item  (%d items x %d runs)\n",
+		name, result.stats.minMs, result.stats.p50Ms, result.stats.p95Ms, result.stats.p99Ms, itemsPerRun, batchSize);
+}
+
+static uint32_t randomState = 0x12345678;
+
+// xorshift, the sequence has to be the same on every run and every platform
+static float randomFloat(float min, float max)
+{
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 17;
+	randomState ^= randomState << 5;
+	return min + (max - min) * (float)(randomState >> 8) / (float)(1 << 24);
+}
+
+static vec3 randomVec3(float min, float max)
+{
+	float x = randomFloat(min, max);
+	float y = randomFloat(min, max);
+	float z = randomFloat(min, max);
+	return vec3(x, y, z);
+}
+
+static quat randomQuat()
+{
+	vec3 axis = normalize(randomVec3(-1, 1) + vec3(0.001f));
+	return rotationQuat(axis, randomFloat(-Pi, Pi));
+}
+
+static mat4 randomMat4()
+{
+	return translationMat(randomVec3(-10, 10)) * quatToMat(randomQuat()) * scaleMat(randomVec3(0.5f, 2));
+}
+
+static void benchMath()
+{
+	constexpr int N = 1024;
+	std::vector<mat4> a(N), b(N), outMats(N);
+	std::vector<quat> quats(N);
+	std::vector<vec4> vecs(N), outVecs(N);
+	for (int i = 0; i < N; ++i)
+	{
+		a[i] = randomMat4();
+		b[i] = randomMat4();
+		quats[i] = randomQuat();
+		vecs[i] = vec4(randomVec3(-10, 10), 1);
+	}
+
+	runMicrobench("mat4 * mat4", N, [&]
+	{
+		for (int i = 0; i < N; ++i)
+			outMats[i] = a[i] * b[i];
+		keep(outMats[0]);
+	});
+	runMicrobench("mat4 * vec4", N, [&]
+	{
+		for (int i = 0; i < N; ++i)
+			outVecs[i] = a[i] * vecs[i];
+		keep(outVecs[0]);
+	});
+	runMicrobench("inverse(mat4)", N, [&]
+	{
+		for (int i = 0; i < N; ++i)
+			outMats[i] = inverse(a[i]);
+		keep(outMats[0]);
+	});
+	runMicrobench("quatToMat", N, [&]
+	{
+		for (int i = 0; i < N; ++i)
+			outMats[i] = quatToMat(quats[i]);
+		keep(outMats[0]);
+	});
+	runMicrobench("normalize(vec4)", N, [&]
+	{
+		for (int i = 0; i < N; ++i)
+			outVecs[i] = normalize(vecs[i]);
+		keep(outVecs[0]);
+	});
+}
+
+static void benchTransforms()
+{
+	// every leaf has its own chain of parents, like a wheel on a car on a turntable
+	constexpr int N = 1024;
+	constexpr int Depth = 4;
+	TransformHierarchy *hierarchy = createTransformHierarchy(N * Depth);
+	for (int i = 0; i < N; ++i)
+	{
+		int parent = -1;
+		for (int d = 0; d < Depth; ++d)
+		{
+			Transform t;
+			t.pos = randomVec3(-5, 5);
+			t.scale = randomVec3(0.5f, 2);
+			t.rotation = randomQuat();
+			parent = addTransform(hierarchy, parent, t);
+		}
+	}
+	updateTransforms(hierarchy);
+
+	// the times are per node in the hierarchy, whether it needed an update or not
+	runMicrobench("updateTransforms (all dirty, 4 levels)", N * Depth, [&]
+	{
+		for (int i = 0; i < N; ++i)
+			setTransformRotation(hierarchy, i * Depth, hierarchy->rotations[i * Depth]);
+		updateTransforms(hierarchy);
+		keep(hierarchy->worldMatrices[N * Depth - 1]);
+	});
+	runMicrobench("updateTransforms (1% dirty, 4 levels)", N * Depth, [&]
+	{
+		for (int i = 0; i < N; i += 100)
+			setTransformRotation(hierarchy, i * Depth, hierarchy->rotations[i * Depth]);
+		updateTransforms(hierarchy);
+		keep(hierarchy->worldMatrices[N * Depth - 1]);
+	});
+	runMicrobench("updateTransforms (nothing dirty)", N * Depth, [&]
+	{
+		updateTransforms(hierarchy);
+		keep(hierarchy->worldMatrices[N * Depth - 1]);
+	});
+}
+
+static void benchCulling()
+{
+	constexpr int N = 10000;
+	std::vector<vec3> mins(N), maxs(N);
+	for (int i = 0; i < N; ++i)
+	{
+		mins[i] = randomVec3(-20, 20);
+		maxs[i] = mins[i] + randomVec3(0.1f, 2);
+	}
+
+	mat4 viewProjection = perspectiveMatLH(radians(60.0f), 16.0f / 9, NearPlane, FarPlane) * lookAtMatLH(vec3(0, 2, -15), vec3(0, -0.1f, 1), vec3(0, 1, 0));
+	Frustum frustum = getFrustum(viewProjection);
+
+	runMicrobench("frustumCullAABB", N, [&]
+	{
+		int numCulled = 0;
+		for (int i = 0; i < N; ++i)
+			numCulled += frustumCullAABB(frustum, mins[i], maxs[i]);
+		keep(numCulled);
+	});
+
+	// like a frame of the demo: the camera and the six faces of a point light's cube map
+	Frustum frustums[7];
+	frustums[0] = frustum;
+	for (int face = 0; face < 6; ++face)
+	{
+		vec3 dir = vec3(0);
+		dir[face / 2] = face % 2 ? -1.0f : 1.0f;
+		vec3 up = face / 2 == 1 ? vec3(0, 0, 1) : vec3(0, 1, 0);
+		frustums[1 + face] = getFrustum(perspectiveMatRH(radians(90.0f), 1.0f, NearPlane, FarPlane) * lookAtMatRH(vec3(0, 5, 0), dir, up));
+	}
+
+	std::vector<uint8_t> visible(7 * N);
+	auto cullRange = [&](int begin, int end)
+	{
+		for (int i = begin; i < end; ++i)
+			visible[i] = !frustumCullAABB(frustums[i / N], mins[i % N], maxs[i % N]);
+	};
+	runMicrobench("frustumCullAABB (7 views)", 7 * N, [&]
+	{
+		cullRange(0, 7 * N);
+		keep(visible[0]);
+	});
+
+	char name[64];
+	snprintf(name, sizeof(name), "frustumCullAABB (7 views, %d threads)", getNumJobThreads());
+	runMicrobench(name, 7 * N, [&]
+	{
+		parallelFor(7 * N, 1024, cullRange);
+		keep(visible[0]);
+	});
+}
+
+static void benchHashing()
+{
+	constexpr int Sizes[] = { 16, 256, 4096, 65536 };
+	constexpr size_t TotalBytes = 1 << 20;
+	std::vector<uint8_t> bytes(TotalBytes);
+	for (size_t i = 0; i < TotalBytes; ++i)
+		bytes[i] = (uint8_t)randomFloat(0, 256);
+
+	for (int size : Sizes)
+	{
+		// hash different data every call, one buffer's worth of calls per run
+		int numCalls = (int)(TotalBytes / size);
+		char name[64];
+		snprintf(name, sizeof(name), "hashBytes (%d bytes)", size);
+		runMicrobench(name, numCalls, [&]
+		{
+			size_t hash = 0;
+			for (int i = 0; i < numCalls; ++i)
+				hash += hashBytes(&bytes[(size_t)i * size], size);
+			keep(hash);
+		});
+	}
+}
+
+static void benchText()
+{
+	Font *font = loadFont("assets/fonts/segoeui.ttf", 32, false);
+	if (!font)
+	{
+		fprintf(stderr, "ERROR: failed to load 'assets/fonts/segoeui.ttf', run this from the root of the project\n");
+		return;
+	}
+
+	const char *string = "Bugatti Chiron 2017 - 1500 hp, 0-100 km/h in 2.4 s, 420 km/h top speed.";
+	int length = (int)strlen(string);
+	std::vector<TextVertex> vertices(4 * length);
+
+	runMicrobench("getStringSize", length, [&]
+	{
+		vec2 size = getStringSize(font, string);
+		keep(size);
+	});
+	runMicrobench("layoutString", length, [&]
+	{
+		int numVertices = layoutString(font, string, true, vec2(0.5f), vec4(1), vertices.data());
+		keep(numVertices);
+	});
+
+	// what a label that didn't change since the last frame costs
+	TextLayout *layout = createTextLayout(font, true, vec2(0.5f));
+	setTextLayoutString(layout, string);
+	runMicrobench("setTextLayoutString (unchanged)", length, [&]
+	{
+		bool changed = setTextLayoutString(layout, string);
+		keep(changed);
+	});
+	freeTextLayout(layout);
+
+	freeFont(font);
+}
+
+static void benchModelLoading()
+{
+	// a grid of quads split into objects, same layout convertObjToModel() produces
+	constexpr int GridSize = 256;
+	constexpr int NumObjects = 16;
+	constexpr int NumMaterials = 4;
+	const char *modelFilename = "microbench-synthetic.model";
+	const char *objFilename = "microbench-synthetic.obj";
+	const char *convertedFilename = "microbench-converted.model";
+
+	ModelData data;
+	data.numVertices = (GridSize + 1) * (GridSize + 1);
+	data.vertices = (Vertex *)malloc(data.numVertices * sizeof(Vertex));
+	for (int y = 0; y <= GridSize; ++y)
+	{
+		for (int x = 0; x <= GridSize; ++x)
+		{
+			Vertex &v = data.vertices[y * (GridSize + 1) + x];
+			v = Vertex();
+			v.pos = vec3((float)x, randomFloat(0, 0.1f), (float)y);
+			v.normal = vec3(0, 1, 0);
+		}
+	}
+
+	data.numMaterials = NumMaterials;
+	data.materials = (Material *)malloc(NumMaterials * sizeof(Material));
+	for (int i = 0; i < NumMaterials; ++i)
+		data.materials[i] = Material();
+
+	data.numObjects = NumObjects;
+	data.materialIndices = (int *)malloc(NumObjects * sizeof(int));
+	data.minAABBs = (vec3 *)malloc(NumObjects * sizeof(vec3));
+	data.maxAABBs = (vec3 *)malloc(NumObjects * sizeof(vec3));
+	data.numIndices = (int *)malloc(NumObjects * sizeof(int));
+	data.indices = (uint **)malloc(NumObjects * sizeof(uint *));
+	int rowsPerObject = GridSize / NumObjects;
+	for (int i = 0; i < NumObjects; ++i)
+	{
+		data.materialIndices[i] = i % NumMaterials;
+		data.minAABBs[i] = vec3(0, 0, (float)(i * rowsPerObject));
+		data.maxAABBs[i] = vec3((float)GridSize, 0.1f, (float)((i + 1) * rowsPerObject));
+		data.numIndices[i] = 6 * GridSize * rowsPerObject;
+		data.indices[i] = (uint *)malloc(data.numIndices[i] * sizeof(uint));
+
+		uint *index = data.indices[i];
+		for (int y = i * rowsPerObject; y < (i + 1) * rowsPerObject; ++y)
+		{
+			for (int x = 0; x < GridSize; ++x)
+			{
+				uint v00 = (uint)(y * (GridSize + 1) + x);
+				uint v10 = v00 + 1;
+				uint v01 = v00 + GridSize + 1;
+				uint v11 = v01 + 1;
+				*index++ = v00; *index++ = v01; *index++ = v11;
+				*index++ = v11; *index++ = v10; *index++ = v00;
+			}
+		}
+	}
+	data.minAABB = vec3(0);
+	data.maxAABB = vec3((float)GridSize, 0.1f, (float)GridSize);
+
+	int numTriangles = 2 * GridSize * GridSize;
+	if (!writeModelData(modelFilename, &data))
+	{
+		fprintf(stderr, "ERROR: failed to write '%s'\n", modelFilename);
+		freeModelData(&data);
+		return;
+	}
+
+	// the same grid as an .obj, every corner is shared by up to 6 triangles so the converter has to deduplicate
+	FILE *obj = fopen(objFilename, "wb");
+	if (obj)
+	{
+		for (int i = 0; i < data.numVertices; ++i)
+			fprintf(obj, "v %f %f %f\n", data.vertices[i].pos.x, data.vertices[i].pos.y, data.vertices[i].pos.z);
+		fprintf(obj, "vn 0 1 0\n");
+		for (int i = 0; i < data.numObjects; ++i)
+		{
+			fprintf(obj, "o object%d\n", i);
+			for (int j = 0; j < data.numIndices[i]; j += 3)
+			{
+				const uint *t = &data.indices[i][j];
+				fprintf(obj, "f %u//1 %u//1 %u//1\n", t[0] + 1, t[1] + 1, t[2] + 1);
+			}
+		}
+		fclose(obj);
+	}
+	freeModelData(&data);
+
+	runMicrobench("readModelData (per triangle)", numTriangles, [&]
+	{
+		ModelData loaded;
+		readModelData(modelFilename, &loaded);
+		keep(loaded.vertices[0]);
+		freeModelData(&loaded);
+	});
+
+	if (obj)
+	{
+		// the difference between these two is the converter's vertex deduplication and writing the .model
+		runMicrobench("tinyobj::LoadObj (per triangle)", numTriangles, [&]
+		{
+			tinyobj::attrib_t attrib;
+			std::vector<tinyobj::shape_t> shapes;
+			std::vector<tinyobj::material_t> materials;
+			std::string error;
+			tinyobj::LoadObj(&attrib, &shapes, &materials, &error, objFilename, NULL, true);
+			keep(attrib.vertices[0]);
+		});
+		runMicrobench("convertObjToModel (per triangle)", numTriangles, [&]
+		{
+			convertObjToModel(objFilename, convertedFilename);
+		});
+	}
+
+	remove(modelFilename);
+	remove(objFilename);
+	remove(convertedFilename);
+}
+
+static bool parseOptions(int argc, char **argv)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (strcmp(arg, "--filter") == 0 && value)
+			options.filter = argv[++i];
+		else if (strcmp(arg, "--repetitions") == 0 && value)
+			options.numRepetitions = atoi(argv[++i]);
+		else if (strcmp(arg, "--warmup") == 0 && value)
+			options.numWarmupRuns = atoi(argv[++i]);
+		else if (strcmp(arg, "--workers") == 0 && value)
+			options.numWorkers = atoi(argv[++i]);
+		else if (strcmp(arg, "--output") == 0 && value)
+			options.outputFilename = argv[++i];
+		else
+		{
+			fprintf(stderr, "ERROR: unknown argument '%s'\n", arg);
+			return false;
+		}
+	}
+
+	if (options.numRepetitions <= 0 || options.numWarmupRuns <= 0)
+	{
+		fprintf(stderr, "ERROR: the number of repetitions and warmup runs have to be positive\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool writeResults(const char *filename)
+{
+	FILE *file = fopen(filename, "wb");
+	if (!file)
+	{
+		fprintf(stderr, "ERROR: failed to open '%s' for writing the results\n", filename);
+		return false;
+	}
+
+	fprintf(file, "{\n\t\"repetitions\": %d,\n\t\"nsPerItem\": {", options.numRepetitions);
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const MicrobenchResult &r = results[i];
+		fprintf(file, "%s\n\t\t\"%s\": { \"min\": %.3f, \"avg\": %.3f, \"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"items\": %d, \"batch\": %d }",
+			i > 0 ? "," : "", r.name.c_str(), r.stats.minMs, r.stats.avgMs, r.stats.p50Ms, r.stats.p95Ms, r.stats.p99Ms, r.itemsPerRun, r.batchSize);
+	}
+	fprintf(file, "\n\t}\n}\n");
+	fclose(file);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	if (!parseOptions(argc, argv))
+		return 1;
+	initJobSystem(options.numWorkers);
+
+	printf("%-36s %10s %10s %10s %10s\n", "", "min", "p50", "p95", "p99");
+	benchMath();
+	benchTransforms();
+	benchCulling();
+	benchHashing();
+	benchText();
+	benchModelLoading();
+
+	if (!writeResults(options.outputFilename))
+		return 1;
+	printf("results in '%s'\n", options.outputFilename);
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,427 @@
+// Stress model generator
+// ----------------------
+// Writes .model files of any size, for measuring the loader, culling and rendering at scales
+// the shipped assets don't reach. The output is a grid of lumpy spheres filling a car sized box
+// (so it can stand in for assets/models/car.model), one sphere per object. Everything is derived
+// from the options and the seed, so the same command always writes the same file.
+//
+// Spheres share their vertices between neighbouring triangles, which gives about one vertex per
+// two triangles. Asking for more vertices than that gives some of the triangles their own three
+// vertices with a flat normal, up to three vertices per triangle. A fraction of the objects get
+// one of the transparent materials, which puts them through the sorted transparent pass.
+//
+// The file is streamed out, nothing is held in memory, so 100M triangles (~2.4 GB) are fine.
+// Loading that back is another matter.
+//
+//   g++ -std=c++17 -O2 tools/modelgen.cpp -o modelgen
+//   ./modelgen [--triangles N] [--vertices N] [--objects N] [--materials N] [--transparent 0..1]
+//              [--scale S] [--seed N] [--output file.model]
+
+#include "../source/common.h"
+#include "../source/lib/bmath.h"
+
+#include <string.h>
+#include <vector>
+
+struct GeneratorOptions
+{
+	uint64_t numTriangles = 100000;
+	uint64_t numVertices = 0; // 0 shares as many vertices as possible
+	uint numObjects = 64;
+	uint numMaterials = 8;
+	float transparentRatio = 0.1f; // fraction of objects that are transparent
+	float scale = 1;
+	uint seed = 1;
+	const char *outputFilename = "stress.model";
+};
+
+// The tessellation of a single object, derived from the options.
+struct GeneratedObject
+{
+	vec3 center;
+	float radius;
+	uint rings;
+	uint segments;
+	uint numTriangles;
+	uint numFlatTriangles; // triangles with their own vertices, spread evenly through the object
+	uint firstVertex;
+	uint materialIndex;
+	vec3 minAABB;
+	vec3 maxAABB;
+
+	uint getNumGridVertices() const
+	{
+		return (rings + 1) * (segments + 1);
+	}
+	uint getNumVertices() const
+	{
+		return getNumGridVertices() + 3 * numFlatTriangles;
+	}
+};
+
+struct GeneratedLayout
+{
+	std::vector<GeneratedObject> objects;
+	uint numOpaqueMaterials; // the materials after these are transparent
+	uint numTransparentObjects;
+	uint64_t numFlatTriangles;
+	uint64_t numVertices;
+};
+
+static uint64_t parseCount(const char *value)
+{
+	// accepts 10000, 10k, 1.5M
+	char *end;
+	double count = strtod(value, &end);
+	if (*end == 'k' || *end == 'K')
+		count *= 1e3;
+	else if (*end == 'm' || *end == 'M')
+		count *= 1e6;
+	return (uint64_t)count;
+}
+
+static bool parseOptions(int argc, char **argv, GeneratorOptions *options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (strcmp(arg, "--triangles") == 0 && value)
+			options->numTriangles = parseCount(argv[++i]);
+		else if (strcmp(arg, "--vertices") == 0 && value)
+			options->numVertices = parseCount(argv[++i]);
+		else if (strcmp(arg, "--objects") == 0 && value)
+			options->numObjects = (uint)parseCount(argv[++i]);
+		else if (strcmp(arg, "--materials") == 0 && value)
+			options->numMaterials = (uint)parseCount(argv[++i]);
+		else if (strcmp(arg, "--transparent") == 0 && value)
+			options->transparentRatio = (float)atof(argv[++i]);
+		else if (strcmp(arg, "--scale") == 0 && value)
+			options->scale = (float)atof(argv[++i]);
+		else if (strcmp(arg, "--seed") == 0 && value)
+			options->seed = (uint)atoi(argv[++i]);
+		else if (strcmp(arg, "--output") == 0 && value)
+			options->outputFilename = argv[++i];
+		else
+		{
+			fprintf(stderr, "ERROR: unknown argument '%s'\n", arg);
+			return false;
+		}
+	}
+
+	if (options->numObjects == 0 || options->numTriangles < 2 * (uint64_t)options->numObjects)
+	{
+		fprintf(stderr, "ERROR: need at least one object and 2 triangles per object\n");
+		return false;
+	}
+	// a single object holds 3 indices per triangle in a uint
+	if (options->numTriangles / options->numObjects >= (1ull << 32) / 3 || options->numVertices >= (1ull << 32))
+	{
+		fprintf(stderr, "ERROR: too many triangles per object or vertices, use more objects\n");
+		return false;
+	}
+	if (options->transparentRatio < 0 || options->transparentRatio > 1 || options->scale <= 0)
+	{
+		fprintf(stderr, "ERROR: --transparent has to be between 0 and 1, and --scale positive\n");
+		return false;
+	}
+	bool hasOpaque = options->transparentRatio < 1;
+	bool hasTransparent = options->transparentRatio > 0;
+	if (options->numMaterials < (uint)hasOpaque + (uint)hasTransparent)
+	{
+		fprintf(stderr, "ERROR: need at least one opaque and one transparent material for --transparent %g\n", options->transparentRatio);
+		return false;
+	}
+
+	return true;
+}
+
+static uint randomState;
+
+// xorshift, the sequence has to be the same on every platform
+static float randomFloat(float min, float max)
+{
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 17;
+	randomState ^= randomState << 5;
+	return min + (max - min) * (float)(randomState >> 8) / (float)(1 << 24);
+}
+
+static vec3 getSphereNormal(const GeneratedObject &o, uint ring, uint segment)
+{
+	float theta = Pi * (float)ring / (float)o.rings;
+	float phi = 2 * Pi * (float)segment / (float)o.segments;
+	return vec3(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+}
+
+static vec3 getSpherePos(const GeneratedObject &o, uint ring, uint segment)
+{
+	// bumps, so that neighbouring triangles aren't all facing the same way
+	float theta = Pi * (float)ring / (float)o.rings;
+	float phi = 2 * Pi * (float)segment / (float)o.segments;
+	float bump = 1 + 0.08f * sinf(7 * theta) * sinf(5 * phi);
+	return o.center + o.radius * bump * getSphereNormal(o, ring, segment);
+}
+
+// Grid vertices of triangle t in object o, two triangles per quad, row by row.
+static void getTriangleCorners(const GeneratedObject &o, uint t, uint corners[3][2])
+{
+	uint quad = t / 2;
+	uint ring = quad / o.segments;
+	uint segment = quad % o.segments;
+	if (t % 2 == 0)
+	{
+		uint c[3][2] = { { ring, segment }, { ring + 1, segment }, { ring + 1, segment + 1 } };
+		memcpy(corners, c, sizeof(c));
+	}
+	else
+	{
+		uint c[3][2] = { { ring + 1, segment + 1 }, { ring, segment + 1 }, { ring, segment } };
+		memcpy(corners, c, sizeof(c));
+	}
+}
+
+// Spreads count items evenly over total slots: whether slot i holds one.
+static bool isSpreadSlot(uint64_t i, uint64_t count, uint64_t total)
+{
+	return (i + 1) * count / total > i * count / total;
+}
+
+static GeneratedLayout layoutObjects(const GeneratorOptions &options)
+{
+	GeneratedLayout layout;
+	std::vector<GeneratedObject> &objects = layout.objects;
+	objects.resize(options.numObjects);
+
+	// objects are spread over a 2:1:4 grid of cells in a car sized box
+	vec3 boxMin = options.scale * vec3(-2, 0, -4.5f);
+	vec3 boxMax = options.scale * vec3(2, 1.5f, 4.5f);
+	uint cellsX = 1;
+	while (cellsX * max(1u, cellsX / 2) * 2 * cellsX < options.numObjects)
+		++cellsX;
+	uint cellsY = max(1u, cellsX / 2);
+	uint cellsZ = 2 * cellsX;
+	vec3 cellSize = (boxMax - boxMin) / vec3((float)cellsX, (float)cellsY, (float)cellsZ);
+
+	uint numTransparent = (uint)(options.transparentRatio * options.numObjects + 0.5f);
+	uint numTransparentMaterials = 0;
+	if (numTransparent > 0)
+		numTransparentMaterials = clamp((uint)(options.transparentRatio * options.numMaterials + 0.5f), 1u, options.numMaterials - (numTransparent < options.numObjects ? 1 : 0));
+	uint numOpaqueMaterials = options.numMaterials - numTransparentMaterials;
+	layout.numOpaqueMaterials = numOpaqueMaterials;
+	layout.numTransparentObjects = numTransparent;
+
+	uint64_t numGridVertices = 0;
+	uint nextOpaque = 0, nextTransparent = 0;
+	for (uint i = 0; i < options.numObjects; ++i)
+	{
+		GeneratedObject &o = objects[i];
+		uint x = i % cellsX;
+		uint y = (i / cellsX) % cellsY;
+		uint z = i / (cellsX * cellsY);
+		vec3 jitter = vec3(randomFloat(0.4f, 0.6f), randomFloat(0.4f, 0.6f), randomFloat(0.4f, 0.6f));
+		o.center = boxMin + cellSize * (vec3((float)x, (float)y, (float)z) + jitter);
+		o.radius = 0.4f * min(cellSize.x, min(cellSize.y, cellSize.z)) * randomFloat(0.6f, 1);
+
+		o.numTriangles = (uint)(options.numTriangles / options.numObjects + (i < options.numTriangles % options.numObjects ? 1 : 0));
+		o.rings = max(1u, (uint)sqrtf(o.numTriangles / 4.0f));
+		o.segments = (o.numTriangles + 2 * o.rings - 1) / (2 * o.rings); // the last few quads at the bottom pole may be left out
+		numGridVertices += o.getNumGridVertices();
+
+		if (isSpreadSlot(i, numTransparent, options.numObjects))
+			o.materialIndex = numOpaqueMaterials + nextTransparent++ % numTransparentMaterials;
+		else
+			o.materialIndex = nextOpaque++ % numOpaqueMaterials;
+	}
+
+	// turn enough triangles flat to reach the vertex count, spread over all the objects
+	uint64_t numFlatTriangles = 0;
+	if (options.numVertices > numGridVertices)
+		numFlatTriangles = min((options.numVertices - numGridVertices) / 3, options.numTriangles);
+
+	uint64_t firstTriangle = 0;
+	uint64_t firstVertex = 0;
+	for (GeneratedObject &o : objects)
+	{
+		uint64_t endTriangle = firstTriangle + o.numTriangles;
+		o.numFlatTriangles = (uint)(endTriangle * numFlatTriangles / options.numTriangles - firstTriangle * numFlatTriangles / options.numTriangles);
+		o.firstVertex = (uint)firstVertex;
+		firstVertex += o.getNumVertices();
+		firstTriangle = endTriangle;
+	}
+
+	layout.numFlatTriangles = numFlatTriangles;
+	layout.numVertices = firstVertex;
+	return layout;
+}
+
+// Buffers the output, fwrite per float is what makes the loader slow and would make this slow too.
+struct Writer
+{
+	FILE *file;
+	uint8_t buffer[1 << 20];
+	size_t size;
+
+	void write(const void *data, size_t numBytes)
+	{
+		if (size + numBytes > sizeof(buffer))
+			flush();
+		memcpy(buffer + size, data, numBytes);
+		size += numBytes;
+	}
+
+	void flush()
+	{
+		fwrite(buffer, 1, size, file);
+		size = 0;
+	}
+};
+
+static void writeVertex(Writer *writer, vec3 pos, vec3 normal, vec3 *minAABB, vec3 *maxAABB)
+{
+	writer->write(&pos, sizeof(pos));
+	writer->write(&normal, sizeof(normal));
+	*minAABB = min(*minAABB, pos);
+	*maxAABB = max(*maxAABB, pos);
+}
+
+static bool writeStressModel(const GeneratorOptions &options, GeneratedLayout *layout)
+{
+	std::vector<GeneratedObject> &objects = layout->objects;
+	// see readModelData() in graphics.cpp for a description of the .model file format.
+
+	FILE *file = fopen(options.outputFilename, "wb");
+	if (!file)
+	{
+		fprintf(stderr, "ERROR: failed to open '%s' for writing\n", options.outputFilename);
+		return false;
+	}
+
+	Writer *writer = new Writer();
+	writer->file = file;
+
+	// the overall bounds come before the vertices, but only the vertices give the exact bounds
+	uint flags = 3;
+	uint header[4] = { flags, (uint)layout->numVertices, options.numMaterials, options.numObjects };
+	vec3 minAABB = vec3(+Inf);
+	vec3 maxAABB = vec3(-Inf);
+	writer->write(header, sizeof(header));
+	writer->write(&minAABB, sizeof(minAABB));
+	writer->write(&maxAABB, sizeof(maxAABB));
+
+	for (GeneratedObject &o : objects)
+	{
+		o.minAABB = vec3(+Inf);
+		o.maxAABB = vec3(-Inf);
+		for (uint ring = 0; ring <= o.rings; ++ring)
+			for (uint segment = 0; segment <= o.segments; ++segment)
+				writeVertex(writer, getSpherePos(o, ring, segment), getSphereNormal(o, ring, segment), &o.minAABB, &o.maxAABB);
+
+		for (uint t = 0; t < o.numTriangles; ++t)
+		{
+			if (!isSpreadSlot(t, o.numFlatTriangles, o.numTriangles))
+				continue;
+
+			uint corners[3][2];
+			getTriangleCorners(o, t, corners);
+			vec3 p[3];
+			for (int i = 0; i < 3; ++i)
+				p[i] = getSpherePos(o, corners[i][0], corners[i][1]);
+			vec3 normal = cross(p[2] - p[0], p[1] - p[0]);
+			normal = length(normal) > 0 ? normalize(normal) : getSphereNormal(o, corners[0][0], corners[0][1]);
+			for (int i = 0; i < 3; ++i)
+				writeVertex(writer, p[i], normal, &o.minAABB, &o.maxAABB);
+		}
+
+		minAABB = min(minAABB, o.minAABB);
+		maxAABB = max(maxAABB, o.maxAABB);
+	}
+
+	for (uint i = 0; i < options.numMaterials; ++i)
+	{
+		bool transparent = i >= layout->numOpaqueMaterials;
+		vec3 diffuse = vec3(randomFloat(0.1f, 1), randomFloat(0.1f, 1), randomFloat(0.1f, 1));
+		vec3 ambient = 0.1f * diffuse;
+		vec3 specular = vec3(randomFloat(0.2f, 1));
+		float specularExponent = randomFloat(8, 256);
+		float alpha = transparent ? randomFloat(0.2f, 0.6f) : 1.0f;
+		writer->write(&ambient, sizeof(ambient));
+		writer->write(&diffuse, sizeof(diffuse));
+		writer->write(&specular, sizeof(specular));
+		writer->write(&specularExponent, sizeof(specularExponent));
+		writer->write(&alpha, sizeof(alpha));
+	}
+
+	for (const GeneratedObject &o : objects)
+	{
+		uint numIndices = 3 * o.numTriangles;
+		writer->write(&o.materialIndex, sizeof(o.materialIndex));
+		writer->write(&o.minAABB, sizeof(o.minAABB));
+		writer->write(&o.maxAABB, sizeof(o.maxAABB));
+		writer->write(&numIndices, sizeof(numIndices));
+
+		uint nextFlatVertex = o.firstVertex + o.getNumGridVertices();
+		for (uint t = 0; t < o.numTriangles; ++t)
+		{
+			uint indices[3];
+			if (isSpreadSlot(t, o.numFlatTriangles, o.numTriangles))
+			{
+				for (int i = 0; i < 3; ++i)
+					indices[i] = nextFlatVertex++;
+			}
+			else
+			{
+				uint corners[3][2];
+				getTriangleCorners(o, t, corners);
+				for (int i = 0; i < 3; ++i)
+					indices[i] = o.firstVertex + corners[i][0] * (o.segments + 1) + corners[i][1];
+			}
+			writer->write(indices, sizeof(indices));
+		}
+	}
+
+	writer->flush();
+	delete writer;
+
+	// now that the bounds are known
+	fseek(file, sizeof(header), SEEK_SET);
+	fwrite(&minAABB, sizeof(minAABB), 1, file);
+	fwrite(&maxAABB, sizeof(maxAABB), 1, file);
+
+	bool ok = !ferror(file);
+	if (fclose(file) != 0)
+		ok = false;
+	if (!ok)
+		fprintf(stderr, "ERROR: failed to write '%s'\n", options.outputFilename);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	GeneratorOptions options;
+	if (!parseOptions(argc, argv, &options))
+		return 1;
+
+	randomState = options.seed * 2654435761u | 1;
+
+	GeneratedLayout layout = layoutObjects(options);
+	if (layout.numVertices >= (1ull << 32))
+	{
+		fprintf(stderr, "ERROR: %llu vertices don't fit into 32 bit indices\n", (unsigned long long)layout.numVertices);
+		return 1;
+	}
+
+	if (!writeStressModel(options, &layout))
+		return 1;
+
+	printf("wrote '%s': %llu triangles (%llu flat), %llu vertices, %u objects (%u transparent), %u materials\n",
+		options.outputFilename,
+		(unsigned long long)options.numTriangles,
+		(unsigned long long)layout.numFlatTriangles,
+		(unsigned long long)layout.numVertices,
+		options.numObjects,
+		layout.numTransparentObjects,
+		options.numMaterials);
+	return 0;
+}
\ No newline at end of file